@@ -7,15 +7,17 @@
 #include "Misc.hpp"
 
 #include "default_bg.hpp"
-#include "update_tile_trimmed.hpp"
-#include "update_tile_full.hpp"
 
 #include "LayerOps.hpp"
 #include "StackOps.hpp"
 #include "Renderer.hpp"
+#include "TileScheduler.hpp"
+#include "simd_compose.hpp"
+#include "resolve.hpp"
 
 #include <sstream>
 #include <vector>
+#include <algorithm>
 #include <iostream>
 
 using std::vector;
@@ -23,7 +25,150 @@ using std::pair;
 using std::make_pair;
 using std::string;
 
-typedef void (*RenderFn)(std::vector< std::pair< const LayerOp *, const uint32_t * > > const &, std::vector< std::pair< const StackOp *, const uint8_t * > > const &, uint32_t *);
+namespace {
+
+//One RESULT packet for every tile of the canvas:
+vector< RenderPacket * > result_workload(Canvas *canvas) {
+	vector< RenderPacket * > workload;
+	for (unsigned int y = 0; y < canvas->result_fbs.size.y; ++y) {
+		for (unsigned int x = 0; x < canvas->result_fbs.size.x; ++x) {
+			Vector2ui at = make_vector(x, y);
+			RenderPacket *pkt = new RenderPacket();
+			pkt->at = at;
+			pkt->type = RenderPacket::RESULT;
+			for (vector< Layer * >::iterator l = canvas->layers.begin(); l != canvas->layers.end(); ++l) {
+				pkt->add_layer((*l)->op, (*l)->get_ref(pkt->at), (*l)->get_coverage(pkt->at));
+			}
+			for (vector< Stroke * >::iterator s = canvas->strokes.begin(); s != canvas->strokes.end(); ++s) {
+				if ((*s)->get_tile_or_null(pkt->at)) {
+					pkt->add_stroke((*s)->op, (*s)->get_ref(pkt->at), (*s)->get_coverage(pkt->at));
+				}
+			}
+			memcpy(&(pkt->out[0]), default_bg(), sizeof(uint32_t) * TileSize * TileSize);
+			workload.push_back(pkt);
+		}
+	}
+	return workload;
+}
+
+//Feeds packets to Renderer threads through the old per-packet event round
+// trip (one request and one ready event per tile), for --bench-scheduler:
+class EventPathBench : public QObject {
+public:
+	EventPathBench(vector< RenderPacket * > const &_work) : work(_work), next(0), done(0) {
+	}
+	virtual void customEvent(QEvent *e) {
+		if (e->type() != RendererReadyEventType) {
+			QObject::customEvent(e);
+			return;
+		}
+		RendererReadyEvent *ready = dynamic_cast< RendererReadyEvent * >(e);
+		assert(ready);
+		if (ready->completed) {
+			++done;
+		}
+		if (next < work.size()) {
+			QCoreApplication::postEvent(ready->renderer, new RendererRequestEvent(work[next]));
+			++next;
+		}
+		if (done == work.size()) {
+			loop.quit();
+		}
+		e->accept();
+	}
+	vector< RenderPacket * > const &work;
+	unsigned int next;
+	unsigned int done;
+	QEventLoop loop;
+};
+
+//Time 'tiles' (repeated so everyone has plenty to do) through the event
+// path and through TileScheduler; prints tiles/sec for each.
+void bench_scheduler(vector< RenderPacket * > const &tiles, Misc *misc) {
+	assert(!tiles.empty());
+	vector< RenderPacket * > work;
+	while (work.size() < 256) {
+		for (vector< RenderPacket * >::const_iterator t = tiles.begin(); t != tiles.end(); ++t) {
+			work.push_back(new RenderPacket(**t));
+		}
+	}
+	const unsigned int threads = TileScheduler::default_threads();
+
+	//event path, with the old fixed four renderers and with one per hardware thread:
+	vector< unsigned int > counts;
+	counts.push_back(4);
+	if (threads != 4) {
+		counts.push_back(threads);
+	}
+	vector< vector< uint32_t > > event_out;
+	for (vector< unsigned int >::iterator count = counts.begin(); count != counts.end(); ++count) {
+		for (vector< RenderPacket * >::iterator p = work.begin(); p != work.end(); ++p) {
+			memcpy(&((*p)->out[0]), default_bg(), sizeof(uint32_t) * TileSize * TileSize);
+		}
+		EventPathBench bench(work);
+		QTime timer;
+		timer.start();
+		vector< QThread * > renderers;
+		for (unsigned int i = 0; i < *count; ++i) {
+			renderers.push_back(start_renderer(&bench, misc));
+		}
+		bench.loop.exec();
+		int elapsed = std::max(1, timer.elapsed());
+		for (vector< QThread * >::iterator r = renderers.begin(); r != renderers.end(); ++r) {
+			(*r)->quit();
+			(*r)->wait();
+			delete *r;
+		}
+		printf("event path, %d renderers: %.1f tiles/sec\n", int(*count), work.size() * 1000.0f / elapsed);
+		if (event_out.empty()) {
+			for (vector< RenderPacket * >::iterator p = work.begin(); p != work.end(); ++p) {
+				event_out.push_back(vector< uint32_t >((*p)->out, (*p)->out + TileSize * TileSize));
+			}
+		}
+	}
+
+	{ //scheduler, kept topped up in batches the way Canvas does:
+		for (vector< RenderPacket * >::iterator p = work.begin(); p != work.end(); ++p) {
+			memcpy(&((*p)->out[0]), default_bg(), sizeof(uint32_t) * TileSize * TileSize);
+		}
+		TileScheduler scheduler(NULL, threads);
+		QTime timer;
+		timer.start();
+		unsigned int next = 0;
+		unsigned int done = 0;
+		unsigned int wakeups = 0;
+		vector< RenderPacket * > batch, completed;
+		while (done < work.size()) {
+			batch.clear();
+			while (next < work.size() && scheduler.outstanding() + batch.size() < scheduler.queue_depth()) {
+				batch.push_back(work[next]);
+				++next;
+			}
+			scheduler.submit(batch);
+			completed.clear();
+			scheduler.wait_completed(completed);
+			done += completed.size();
+			++wakeups;
+		}
+		int elapsed = std::max(1, timer.elapsed());
+		bool identical = true;
+		for (unsigned int i = 0; i < work.size(); ++i) {
+			if (!std::equal(event_out[i].begin(), event_out[i].end(), work[i]->out)) {
+				identical = false;
+			}
+		}
+		printf("scheduler, %d workers: %.1f tiles/sec ; %d steals, %.1f tiles per wakeup ; %s\n", int(scheduler.threads()), work.size() * 1000.0f / elapsed, int(scheduler.steals), work.size() / float(wakeups), (identical ? "identical" : "DIFFERENT"));
+		scheduler.stop();
+		scheduler.report_stats(std::cerr);
+		report_allocations(std::cerr);
+	}
+
+	for (vector< RenderPacket * >::iterator p = work.begin(); p != work.end(); ++p) {
+		delete *p;
+	}
+}
+
+}
 
 App::App() {
 	QAction *add_layer_action = new QAction(tr("&Load Layer"), this);
@@ -120,25 +265,38 @@ App::App() {
 
 	QStringList args = qApp->arguments();
 	bool first_arg = true;
-	bool run_timing = false;
-	bool run_timing_short = false;
+	bool bench_tile_scheduler = false;
 	bool arg_error = false;
-	string run_name = "";
 	while (!args.empty()) {
 		QString opt = args.front();
 		args.pop_front();
 		bool was_first_arg = first_arg;
 		first_arg = false;
-		if (opt == "--run-timings" || opt == "--run-timings-short"){ 
-			if (opt == "--run-timings-short") {
-				run_timing_short = true;
+		if (opt == "--run-timings" || opt == "--run-timings-short" || opt == "--run-timings-arena"){ 
+			std::cerr << "ERROR: Solver timings have moved to softstack-bench (see softstack-bench --help)." << std::endl;
+			exit(1);
+		} else if (opt == "--check-compose") {
+			std::string error = "";
+			std::cerr << "Checking compose kernels (best is " << compose_kernels().isa << ")..." << std::endl;
+			if (!check_compose_kernels(&error)) {
+				std::cerr << "ERROR: " << error << std::endl;
+				exit(1);
 			}
-			run_timing = true;
-			if (!args.empty()) {
-				run_name = qPrintable(args.front());
-				args.pop_front();
-				std::cerr << "Run will be called '" << run_name << "'" << std::endl;
+			std::cerr << "All compose kernels match generic_compose/generic_multiply." << std::endl;
+			exit(0);
+		} else if (opt == "--check-stackops") {
+			std::string error = "";
+			std::cerr << "Checking compiled stack ops..." << std::endl;
+			if (!check_stack_ops(&error)) {
+				std::cerr << "ERROR: " << error << std::endl;
+				exit(1);
 			}
+			std::cerr << "All compiled stack ops match apply_reference." << std::endl;
+			exit(0);
+		} else if (opt == "--bench-scheduler") {
+			bench_tile_scheduler = true;
+		} else if (opt == "--bench-resolve") {
+			exit(benchmark_resolve(std::cerr) ? 0 : 1);
 		} else if (opt == "-l") {
 			if (args.size() < 3) {
 				std::cerr << "ERROR: Expecting '-l' to be followed by a name, mode, and image file." << std::endl;
@@ -221,192 +379,34 @@ App::App() {
 	}
 	if (arg_error) {
 		std::cerr << "WARNING: there were error parsing the arguments." << std::endl;
-		if (run_timing) {
-			std::cerr << "  (aborting before running timings)" << std::endl;
+		if (bench_tile_scheduler) {
+			std::cerr << "  (aborting before running benchmark)" << std::endl;
 			exit(1);
 		}
 	}
 
-	if (run_timing) {
-		vector< RenderPacket * > workload;
-		for (unsigned int y = 0; y < canvas->result_fbs.size.y; ++y) {
-			for (unsigned int x = 0; x < canvas->result_fbs.size.x; ++x) {
-				Vector2ui at = make_vector(x, y);
-				RenderPacket *pkt = new RenderPacket();
-				pkt->at = at;
-				pkt->type = RenderPacket::RESULT;
-				for (vector< Layer * >::iterator l = canvas->layers.begin(); l != canvas->layers.end(); ++l) {
-					pkt->layers.push_back(make_pair((*l)->op, (*l)->get_tile_or_null(pkt->at)));
-				}
-				for (vector< Stroke * >::iterator s = canvas->strokes.begin(); s != canvas->strokes.end(); ++s) {
-					if ((*s)->get_tile_or_null(pkt->at)) {
-						pkt->strokes.push_back(make_pair((*s)->op, (*s)->get_tile_or_null(pkt->at)));
-					}
-				}
-				memcpy(&(pkt->out[0]), default_bg(), sizeof(uint32_t) * TileSize * TileSize);
-				workload.push_back(pkt);
-			}
-		}
-		assert(!workload.empty());
-
-		printf("%dx%d is %d tiles\n",canvas->pix_size.x,canvas->pix_size.y,int(workload.size()));
-
-		vector< pair< RenderFn, string > > modes;
-		//Full is a fine reference for small stuff:
-		//Tiny blocks because, well, it might help.
-		{
-			RenderFn full = update_tile_full< TileSize*TileSize/32 >;
-			modes.push_back(make_pair(full, "full"));
-		}
-		#define TRIMMED( S ) \
-		{ \
-			RenderFn trimmed = update_tile_trimmed< S, TileSize*TileSize/16 >; \
-			modes.push_back(make_pair(trimmed, "trimmed-" #S "-b16")); \
-		}
-
-		if (run_timing_short) {
-			TRIMMED( 40 );
-			TRIMMED( 20 );
-			TRIMMED( 10 );
-			TRIMMED( 5 );
-		} else {
-			TRIMMED( 1000 );
-			TRIMMED( 500 );
-			TRIMMED( 200 );
-			TRIMMED( 100 );
-			TRIMMED( 50 );
-			TRIMMED( 20 );
-			TRIMMED( 18 );
-			TRIMMED( 16 );
-			TRIMMED( 14 );
-			TRIMMED( 12 );
-			TRIMMED( 10 );
-			TRIMMED( 9 );
-			TRIMMED( 8 );
-			TRIMMED( 7 );
-			TRIMMED( 6 );
-			TRIMMED( 5 );
-			TRIMMED( 4 );
-			TRIMMED( 3 );
-			TRIMMED( 2 );
-			TRIMMED( 1 );
-		}
-		for (vector< pair< RenderFn, string > >::iterator m = modes.begin(); m != modes.end(); ++m) {
-			//run through once to take care of any once-off costs (e.g. computing background checkerboard pattern):
-			std::cerr << "Running " << m->second << " "; std::cerr.flush();
-			/*
-			 * Not running this might result in slightly worse numbers, but running it is slowing down parameter sweeps!
-				std::cerr << "(init "; std::cerr.flush();
-				for (vector< RenderPacket * >::iterator p = workload.begin(); p != workload.end(); ++p) {
-					m->first((*p)->layers, (*p)->strokes, (*p)->out);
-					std::cerr << '.'; std::cerr.flush();
-				}
-				std::cerr << ") "; std::cerr.flush();
-			*/
-			const unsigned int Iters = 1;
-			int elapsed = 1000000;
-			if (run_timing_short && m == modes.begin()) {
-				assert(m->second == "full");
-				std::cerr << "Skipping full" << std::endl;
-			} else {
-				//Actually time:
-				QTime timer;
-				timer.start();
-				unsigned int count = 0;
-				for (unsigned int iter = 0; iter < Iters; ++iter) {
-					for (vector< RenderPacket * >::iterator p = workload.begin(); p != workload.end(); ++p) {
-						m->first((*p)->layers, (*p)->strokes, (*p)->out);
-						std::cerr << "."; std::cerr.flush();
-						++count;
-					}
-				}
-				std::cerr << " done. [" << count << "]" << std::endl;
-				elapsed = timer.elapsed();
-			}
-
-			//-----------------------------------------------------------
-			//Save image for later reference:
-			
-			vector< uint32_t > pix(canvas->pix_size.x * canvas->pix_size.y, 0xff000000);
-
-			if (run_timing_short && m == modes.begin()) {
-				assert(m->second == "full");
-			} else {
-				//Make tiled image into linear image:
-				for (unsigned int y = 0; y < canvas->pix_size.y; ++y) {
-					for (unsigned int x = 0; x < canvas->pix_size.x; ++x) {
-						Vector2ui at = make_vector(x / TileSize, y / TileSize);
-						unsigned int p  = at.y * canvas->result_fbs.size.x + at.x;
-						assert(p < workload.size());
-						assert(workload[p]->at == at);
-						uint32_t *tile = workload[p]->out;
-						assert(tile);
-						uint32_t val = tile[(y % TileSize) * TileSize + (x % TileSize)];
-						pix[y * canvas->pix_size.x + x] = 0xff000000 | (val & 0xff) << 16 | (val & 0x0000ff00) | ((val >> 16) & 0xff);
-					}
-				}
-			}
-
-			static vector< uint32_t > ref;
-			if (ref.empty()) {
-				ref = pix;
-
-				if (run_timing_short) {
-					printf("%s : % 5d / %d * %d = %0.4f ; maxerr: X sumerr: X (reference SKIPPED)\n",m->second.c_str(), elapsed, Iters, (int)workload.size(), elapsed / float(Iters * workload.size()));
-				} else {
-					printf("%s : % 5d / %d * %d = %0.4f ; maxerr: 0 sumerr: 0 (reference)\n",m->second.c_str(), elapsed, Iters, (int)workload.size(), elapsed / float(Iters * workload.size()));
-				}
-			} else {
-				assert(ref.size() == pix.size());
-				int32_t maxerr = 0;
-				long long unsigned int sumerr = 0;
-				for (unsigned int i = 0; i < ref.size(); ++i) {
-					assert(sizeof(Vector< uint8_t, 4 >) == sizeof(uint32_t));
-					Vector< uint8_t, 4 > rc = *(Vector< uint8_t, 4 > *)(&ref[i]);
-					Vector< uint8_t, 4 > pc = *(Vector< uint8_t, 4 > *)(&pix[i]);
-					for (unsigned int v = 0; v < 4; ++v) {
-						int32_t a = rc.c[v];
-						int32_t b = pc.c[v];
-						sumerr += abs(a-b);
-						if (abs(a-b) > maxerr) {
-							maxerr = abs(a-b);
-						}
-					}
-				}
-				if (run_timing_short) {
-					printf("%s : % 5d / %d * %d = %0.4f ; maxerr: X sumerr: X\n",m->second.c_str(), elapsed, Iters, (int)workload.size(), elapsed / float(Iters * workload.size()));
-				} else {
-					printf("%s : % 5d / %d * %d = %0.4f ; maxerr: %d sumerr: %llu\n",m->second.c_str(), elapsed, Iters, (int)workload.size(), elapsed / float(Iters * workload.size()), maxerr, sumerr);
-				}
-
-			}
-			
-
-
-			if (run_name != "") {
-				QImage image = QImage(reinterpret_cast< uchar * >(&pix[0]), canvas->pix_size.x, canvas->pix_size.y, QImage::Format_RGB32);
-	
-				std::string filename = run_name + "-" + m->second + ".png";
-				if (!image.save(filename.c_str())) {
-					std::cout << "ERROR saving result!" << std::endl;
-					exit(1);
-				}
-			}
+	if (bench_tile_scheduler) {
+		vector< RenderPacket * > workload = result_workload(canvas);
+		if (workload.empty()) {
+			std::cerr << "ERROR: --bench-scheduler needs some layers (-l) to render." << std::endl;
+			exit(1);
 		}
-
+		bench_scheduler(workload, misc);
 		exit(0);
 	}
 
-	//Create and connect up renderer(s):
-	for (unsigned int i = 0; i < 4; ++i) {
-		QThread *thread = start_renderer(canvas, misc);
-		thread->setParent(this);
-		connect(qApp, SIGNAL(aboutToQuit()), thread, SLOT(quit()));
-	}
-	std::cerr << "Created renderer threads." << std::endl;
+	//Create and connect up the tile scheduler:
+	TileScheduler *scheduler = new TileScheduler(canvas);
+	scheduler->setParent(this);
+	canvas->scheduler = scheduler;
+	connect(qApp, SIGNAL(aboutToQuit()), scheduler, SLOT(stop()));
+	connect(misc, SIGNAL(set_blocks(int)), scheduler, SLOT(set_blocks(int)));
+	connect(misc, SIGNAL(set_samples(int)), scheduler, SLOT(set_samples(int)));
+	std::cerr << "Created tile scheduler with " << scheduler->threads() << " workers." << std::endl;
 
-	connect(misc, SIGNAL(set_blocks(int)), canvas, SLOT(renderer_changed()));
-	connect(misc, SIGNAL(set_samples(int)), canvas, SLOT(renderer_changed()));
+	//(tiles stay up and are refined to the new setting in the background)
+	connect(misc, SIGNAL(set_blocks(int)), canvas, SLOT(quality_changed()));
+	connect(misc, SIGNAL(set_samples(int)), canvas, SLOT(quality_changed()));
 
 	misc->quality->setCurrentIndex(2);
 
@@ -458,10 +458,13 @@ void App::save() {
 		canvas->start_stroke_commit();
 		return;
 	}
-	if (!canvas->needs.empty() || !canvas->pending.empty()) {
+	Vector2ui at;
+	unsigned int type;
+	if (!canvas->needs.empty() || !canvas->pending.empty() || canvas->next_refinement(&at, &type, true)) {
 		QMessageBox::information(this, tr("Wait a moment more..."), "We'll pop up a save dialog after we finish the remaining rendering bits...");
-		canvas->flushing_render = true;
+		//drafts won't do for saving:
 		connect(canvas, SIGNAL(render_flushed()), this, SLOT(save()));
+		canvas->start_full_quality_flush();
 		return;
 	}
 
@@ -481,7 +484,7 @@ void App::save() {
 		for (unsigned int y = 0; y < result.size.y; ++y) {
 			for (unsigned int x = 0; x < result.size.x; ++x) {
 				Vector2ui at = make_vector(x, y);
-				uint32_t *into = result.get_tile(at);
+				uint32_t *into = result.overwrite_tile(at);
 				QGLFramebufferObject *fb = canvas->result_fbs.get(at);
 				if (!fb) {
 					memcpy(into, default_bg(), sizeof(uint32_t) * TileSize * TileSize);
@@ -499,7 +502,7 @@ void App::save() {
 		vector< uint32_t > pix(canvas->pix_size.x * canvas->pix_size.y, 0xff000000);
 		for (unsigned int y = 0; y < canvas->pix_size.y; ++y) {
 			for (unsigned int x = 0; x < canvas->pix_size.x; ++x) {
-				uint32_t *tile = result.get_tile_or_null(make_vector(x / TileSize, y / TileSize));
+				uint32_t const *tile = result.get_tile_or_null(make_vector(x / TileSize, y / TileSize));
 				assert(tile);
 				uint32_t val = tile[(y % TileSize) * TileSize + (x % TileSize)];
 				pix[y * canvas->pix_size.x + x] = 0xff000000 | (val & 0xff) << 16 | (val & 0x0000ff00) | ((val >> 16) & 0xff);
@@ -558,7 +561,7 @@ void App::save_stroke(unsigned int stroke) {
 		vector< uint32_t > pix(canvas->pix_size.x * canvas->pix_size.y, 0xff000000);
 		for (unsigned int y = 0; y < canvas->pix_size.y; ++y) {
 			for (unsigned int x = 0; x < canvas->pix_size.x; ++x) {
-				uint8_t *tile = canvas->strokes[stroke]->get_tile_or_null(make_vector(x / TileSize, y / TileSize));
+				uint8_t const *tile = canvas->strokes[stroke]->get_tile_or_null(make_vector(x / TileSize, y / TileSize));
 				if (tile) {
 					uint32_t val = tile[(y % TileSize) * TileSize + (x % TileSize)];
 					pix[y * canvas->pix_size.x + x] = 0xff000000 | (val << 16) | (val << 8) | val;
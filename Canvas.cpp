@@ -8,11 +8,13 @@
 #include "StackOps.hpp"
 #include "gl_errors.hpp"
 #include "Renderer.hpp"
+#include "TileScheduler.hpp"
 
 #include "GLHacks.hpp"
 
 #include <iostream>
 #include <sstream>
+#include <algorithm>
 
 using std::cout;
 using std::cerr;
@@ -23,7 +25,25 @@ using std::string;
 using std::pair;
 using std::make_pair;
 
-Canvas::Canvas(QWidget *parent) : QGLWidget( QGLFormat( /*nothing to request*/ ), parent), pix_size(make_vector(0U,0U)), layer_list(NULL), stroke_list(NULL), flushing_render(false), camera(make_vector(0.0f, 0.0f, 200.0f)), has_brush(false), brush_at(make_vector(0.0f, 0.0f)), pending_removal_stroke(-1U), pending_stroke(-1U), current_stroke(-1U), current_draw(NULL), paint_shader(NULL) {
+//(bound to const references, e.g. by ScalarTiled::expand, so they need storage)
+const uint8_t Canvas::LOD_STALE;
+const uint8_t Canvas::LOD_PENDING;
+
+namespace {
+
+//queue entries by tile, best tier first (for clearing out stale ones):
+class EntryTileLess {
+public:
+	bool operator()(TileQueue::Entry const &a, TileQueue::Entry const &b) const {
+		if (a.at.y != b.at.y) return a.at.y < b.at.y;
+		if (a.at.x != b.at.x) return a.at.x < b.at.x;
+		return a.tier < b.tier;
+	}
+};
+
+}
+
+Canvas::Canvas(QWidget *parent) : QGLWidget( QGLFormat( /*nothing to request*/ ), parent), pix_size(make_vector(0U,0U)), layer_list(NULL), stroke_list(NULL), scheduler(NULL), queued_count(0), queue_clock(1), keyed_visible_lo(make_vector(0U, 0U)), keyed_visible_hi(make_vector(0U, 0U)), keyed_stroked(0), keyed_defer(false), refine_results(false), flushing_render(false), full_quality(false), camera(make_vector(0.0f, 0.0f, 200.0f)), has_brush(false), brush_at(make_vector(0.0f, 0.0f)), pending_removal_stroke(-1U), pending_stroke(-1U), current_stroke(-1U), current_draw(NULL), paint_shader(NULL) {
 	set_pix_size(make_vector(TileSize, TileSize));
 	setMouseTracking(true);
 }
@@ -47,6 +67,29 @@ void tile_draw_tex_params() {
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 }
 
+//Quad over tile 'at' of a grid of 'extent'-pixel tiles (clipped to the
+// image), with texture coordinates to match:
+void tile_draw_quad(Vector2ui at, unsigned int extent, Vector2ui pix_size) {
+	Vector2ui pix_at = at * extent;
+	Vector2ui pix_max = pix_at + make_vector(extent, extent);
+	if (pix_max.x > pix_size.x) pix_max.x = pix_size.x;
+	if (pix_max.y > pix_size.y) pix_max.y = pix_size.y;
+
+	Vector2f tex_size = make_vector< float >(pix_max - pix_at);
+	tex_size /= float(extent);
+
+	glBegin(GL_QUADS);
+	glTexCoord2f(0.0f, 0.0f);
+	glVertex2f(pix_at.x, pix_at.y);
+	glTexCoord2f(tex_size.x, 0.0f);
+	glVertex2f(pix_max.x, pix_at.y);
+	glTexCoord2f(tex_size.x, tex_size.y);
+	glVertex2f(pix_max.x, pix_max.y);
+	glTexCoord2f(0.0f, tex_size.y);
+	glVertex2f(pix_at.x, pix_max.y);
+	glEnd();
+}
+
 void Canvas::initializeGL() {
 	show_all();
 
@@ -142,99 +185,38 @@ void Canvas::paintGL() {
 
 	glDisable(GL_BLEND);
 
-	glActiveTextureScope();
-
-	for (unsigned int y = 0; y * TileSize < pix_size.y; ++y) {
-		for (unsigned int x = 0; x * TileSize < pix_size.x; ++x) {
-			Vector2ui at = make_vector(x,y);
-			Vector2ui pix_at = at * TileSize;
-			Vector2ui pix_max = pix_at + make_vector(TileSize, TileSize);
-			if (pix_max.x > pix_size.x) pix_max.x = pix_size.x;
-			if (pix_max.y > pix_size.y) pix_max.y = pix_size.y;
-
-			Vector2f tex_size = make_vector< float >(pix_max - pix_at);
-			tex_size /= float(TileSize);
-
-			glColor3f(1.0f, 1.0f, 1.0f);
-			if (stroked.count(at)) {
-				//if stroked, then -- by default -- we're painting missing
-				// over missing (boring!):
-				GLuint zero_tex = missing_tex;
-				GLuint one_tex = missing_tex;
-
-				//if we have a result, we'll paint missing over that:
-				if (result_fbs.get(at)) {
-					zero_tex = result_fbs.get(at)->texture();
-				}
-
-				unsigned int flags = 0;
-				if (needs.count(at)) {
-					flags |= needs[at];
-				}
-				if (pending.count(at)) {
-					flags |= pending[at];
-				}
-				if (!(flags & FLAG_ZERO)) {
-					zero_tex = zero_texs.get(at);
-					assert(zero_tex);
+	const unsigned int view = view_level();
+	if (view == 0) {
+		for (unsigned int y = 0; y < result_fbs.size.y; ++y) {
+			for (unsigned int x = 0; x < result_fbs.size.x; ++x) {
+				draw_tile(make_vector(x,y), missing_tex);
+			}
+		}
+	} else {
+		//zoomed out: level tiles where they've been rendered (with stroked
+		// tiles on top, since those are changing), full-resolution tiles where
+		// they haven't:
+		ScalarTiled< GLuint > &texs = lod_texs[view - 1];
+		const unsigned int span = 1 << view;
+		for (unsigned int y = 0; y < texs.size.y; ++y) {
+			for (unsigned int x = 0; x < texs.size.x; ++x) {
+				const GLuint tex = texs.get(x,y);
+				if (tex) {
+					glColor3f(1.0f, 1.0f, 1.0f);
+					glEnable(GL_TEXTURE_2D);
+					glBindTexture(GL_TEXTURE_2D, tex);
+					tile_draw_quad(make_vector(x,y), TileSize << view, pix_size);
+					glBindTexture(GL_TEXTURE_2D, 0);
+					glDisable(GL_TEXTURE_2D);
 				}
-				if (!(flags & FLAG_ONE)) {
-					one_tex = one_texs.get(at);
-					assert(one_tex);
+				for (unsigned int ty = y * span; ty < (y + 1) * span && ty < result_fbs.size.y; ++ty) {
+					for (unsigned int tx = x * span; tx < (x + 1) * span && tx < result_fbs.size.x; ++tx) {
+						if (!tex || stroked.count(make_vector(tx,ty))) {
+							draw_tile(make_vector(tx,ty), missing_tex);
+						}
+					}
 				}
-				assert(current_draw->fbs.get(at));
-
-				glActiveTexture(GL_TEXTURE2);
-				glEnable(GL_TEXTURE_2D);
-				glBindTexture(GL_TEXTURE_2D, one_tex);
-				glActiveTexture(GL_TEXTURE1);
-				glEnable(GL_TEXTURE_2D);
-				glBindTexture(GL_TEXTURE_2D, current_draw->fbs.get(at)->texture());
-				glActiveTexture(GL_TEXTURE0);
-				glEnable(GL_TEXTURE_2D);
-				glBindTexture(GL_TEXTURE_2D, zero_tex);
-				paint_shader->bind();
-
-			} else if (result_fbs.get(at)) {
-				glEnable(GL_TEXTURE_2D);
-				glBindTexture(GL_TEXTURE_2D, result_fbs.get(at)->texture());
-				tile_draw_tex_params();
-			} else {
-				glEnable(GL_TEXTURE_2D);
-				glBindTexture(GL_TEXTURE_2D, missing_tex);
 			}
-
-			//leftover from multitexture version:
-			#define TEX(X, Y) \
-				glTexCoord2f( X, Y); \
-
-			glBegin(GL_QUADS);
-			TEX(0.0f, 0.0f);
-			glVertex2f(pix_at.x, pix_at.y);
-			TEX(tex_size.x, 0.0f);
-			glVertex2f(pix_max.x, pix_at.y);
-			TEX(tex_size.x, tex_size.y);
-			glVertex2f(pix_max.x, pix_max.y);
-			TEX(0.0f, tex_size.y);
-			glVertex2f(pix_at.x, pix_max.y);
-			glEnd();
-
-			#undef TEX
-
-			glActiveTexture(GL_TEXTURE2);
-			glBindTexture(GL_TEXTURE_2D, 0);
-			glDisable(GL_TEXTURE_2D);
-			glActiveTexture(GL_TEXTURE1);
-			glBindTexture(GL_TEXTURE_2D, 0);
-			glDisable(GL_TEXTURE_2D);
-			glActiveTexture(GL_TEXTURE0);
-			glBindTexture(GL_TEXTURE_2D, 0);
-			glDisable(GL_TEXTURE_2D);
-
-			paint_shader->release();
-			//Can't do this in linux, unfortunately:
-			//glUseProgram(0);
-
 		}
 	}
 	glDisable(GL_TEXTURE_2D);
@@ -244,13 +226,13 @@ void Canvas::paintGL() {
 
 	bool show_pending = true;
 	if (show_pending) {
-		for (TileFlags::iterator p = pending.begin(); p != pending.end(); ++p) {
+		for (vector< Vector2ui >::const_iterator p = pending.listed.begin(); p != pending.listed.end(); ++p) {
 			glBegin(GL_LINE_LOOP);
 			glColor3f(1.0f, 0.0f, 1.0f);
-			glVertex2f((p->first.x+0.1f)*TileSize, (p->first.y+0.1f)*TileSize);
-			glVertex2f((p->first.x+0.1f)*TileSize, (p->first.y+0.9f)*TileSize);
-			glVertex2f((p->first.x+0.9f)*TileSize, (p->first.y+0.9f)*TileSize);
-			glVertex2f((p->first.x+0.9f)*TileSize, (p->first.y+0.1f)*TileSize);
+			glVertex2f((p->x+0.1f)*TileSize, (p->y+0.1f)*TileSize);
+			glVertex2f((p->x+0.1f)*TileSize, (p->y+0.9f)*TileSize);
+			glVertex2f((p->x+0.9f)*TileSize, (p->y+0.9f)*TileSize);
+			glVertex2f((p->x+0.9f)*TileSize, (p->y+0.1f)*TileSize);
 			glEnd();
 		}
 	}
@@ -312,6 +294,75 @@ void Canvas::paintGL() {
 	}
 
 	gl_errors("paint");
+
+	//the view may have moved onto tiles (or to a level) that could use
+	// rendering or refining:
+	if (scheduler && scheduler->outstanding() < scheduler->threads()) {
+		dispatch_packets();
+	}
+}
+
+void Canvas::draw_tile(Vector2ui at, GLuint missing_tex) {
+	glActiveTextureScope();
+
+	glColor3f(1.0f, 1.0f, 1.0f);
+	if (stroked.count(at)) {
+		//if stroked, then -- by default -- we're painting missing
+		// over missing (boring!):
+		GLuint zero_tex = missing_tex;
+		GLuint one_tex = missing_tex;
+
+		//if we have a result, we'll paint missing over that:
+		if (result_fbs.get(at)) {
+			zero_tex = result_fbs.get(at)->texture();
+		}
+
+		unsigned int flags = needs.get(at) | pending.get(at);
+		if (!(flags & FLAG_ZERO)) {
+			zero_tex = zero_texs.get(at);
+			assert(zero_tex);
+		}
+		if (!(flags & FLAG_ONE)) {
+			one_tex = one_texs.get(at);
+			assert(one_tex);
+		}
+		assert(current_draw->fbs.get(at));
+
+		glActiveTexture(GL_TEXTURE2);
+		glEnable(GL_TEXTURE_2D);
+		glBindTexture(GL_TEXTURE_2D, one_tex);
+		glActiveTexture(GL_TEXTURE1);
+		glEnable(GL_TEXTURE_2D);
+		glBindTexture(GL_TEXTURE_2D, current_draw->fbs.get(at)->texture());
+		glActiveTexture(GL_TEXTURE0);
+		glEnable(GL_TEXTURE_2D);
+		glBindTexture(GL_TEXTURE_2D, zero_tex);
+		paint_shader->bind();
+
+	} else if (result_fbs.get(at)) {
+		glEnable(GL_TEXTURE_2D);
+		glBindTexture(GL_TEXTURE_2D, result_fbs.get(at)->texture());
+		tile_draw_tex_params();
+	} else {
+		glEnable(GL_TEXTURE_2D);
+		glBindTexture(GL_TEXTURE_2D, missing_tex);
+	}
+
+	tile_draw_quad(at, TileSize, pix_size);
+
+	glActiveTexture(GL_TEXTURE2);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	glDisable(GL_TEXTURE_2D);
+	glActiveTexture(GL_TEXTURE1);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	glDisable(GL_TEXTURE_2D);
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	glDisable(GL_TEXTURE_2D);
+
+	paint_shader->release();
+	//Can't do this in linux, unfortunately:
+	//glUseProgram(0);
 }
 
 void Canvas::resizeGL(int width, int height) {
@@ -395,19 +446,23 @@ void Canvas::leaveEvent(QEvent *event) {
 }
 
 void Canvas::customEvent(QEvent *e) {
-	if (e->type() == RendererReadyEventType) {
-		RendererReadyEvent *ready = dynamic_cast< RendererReadyEvent * >(e);
-		assert(ready);
-		if (ready->completed) {
-			got_packet(ready->completed);
-			assert(ready->completed == NULL);
+	if (e->type() == TilesReadyEventType) {
+		assert(scheduler);
+		vector< RenderPacket * > completed;
+		scheduler->take_completed(completed);
+		for (vector< RenderPacket * >::iterator c = completed.begin(); c != completed.end(); ++c) {
+			got_packet(*c);
+			assert(*c == NULL);
 		}
-		assert(ready->renderer);
-		ready_renderers.push_back(ready->renderer);
 		dispatch_packets();
-		if (pending.empty() && needs.empty() && flushing_render) {
+		Vector2ui at;
+		unsigned int type;
+		if (pending.empty() && needs.empty() && flushing_render && !(full_quality && next_refinement(&at, &type, true))) {
 			emit render_flushed();
 			flushing_render = false;
+			full_quality = false;
+			//(refinement waits out flushes)
+			dispatch_packets();
 		}
 		e->accept();
 	} else {
@@ -422,18 +477,49 @@ void Canvas::got_packet(RenderPacket * &pkt) {
 	assert(pkt->at.y < result_fbs.size.y);
 	assert(pkt->out);
 
-	{ //Mark tile as no longer pending:
-		TileFlags::iterator p = pending.find(pkt->at);
-		assert(p != pending.end());
-		assert(p->second & (1 << pkt->type));
-		p->second &= ~(1 << pkt->type);
-		if (p->second == 0) {
-			pending.erase(p);
+	if (pkt->level) {
+		//a zoomed-out tile; just no longer pending:
+		assert(pkt->level <= lod_flags.size());
+		uint8_t &flags = lod_flags[pkt->level - 1].get(pkt->at);
+		assert(flags & LOD_PENDING);
+		flags &= ~LOD_PENDING;
+	} else { //Mark tile as no longer pending:
+		assert(pending.get(pkt->at) & (1 << pkt->type));
+		pending.remove(pkt->at, 1 << pkt->type);
+		//(marked dirty while this was out?)
+		if (ready_needs(pkt->at)) {
+			queue_tile(pkt->at);
+		}
+	}
+
+	if (pkt->level == 0) { //note how good this texture is now, and whether it could be better:
+		assert(scheduler);
+		uint16_t &have = rendered_samples[pkt->type].get(pkt->at);
+		if (pkt->exact) {
+			have = ExactSamples;
+		} else {
+			have = (pkt->draft ? 0 : (pkt->samples ? pkt->samples : scheduler->samples()));
+		}
+		//(if it's needed again anyway, that render takes care of it)
+		const bool stale = (needs.get(pkt->at) & (1 << pkt->type));
+		if (!stale && have < scheduler->samples()) {
+			refine.add(pkt->at, 1 << pkt->type);
+			queue_refinement(pkt->at);
+		} else {
+			refine.remove(pkt->at, 1 << pkt->type);
 		}
 	}
 
 	makeCurrent();
-	if (pkt->type == RenderPacket::ZERO) {
+	if (pkt->level) {
+		assert(pkt->type == RenderPacket::RESULT);
+		GLuint &tex = lod_texs[pkt->level - 1].get(pkt->at);
+		if (tex == 0) {
+			glGenTextures(1, &tex);
+		}
+		glBindTexture(GL_TEXTURE_2D, tex);
+		tile_draw_tex_params();
+	} else if (pkt->type == RenderPacket::ZERO) {
 		GLuint &tex = zero_texs.get(pkt->at);
 		if (tex == 0) {
 			glGenTextures(1, &tex);
@@ -466,7 +552,7 @@ void Canvas::got_packet(RenderPacket * &pkt) {
 
 	gl_errors("got_pkt");
 
-	delete pkt;
+	RenderPacket::recycle(pkt);
 	pkt = NULL;
 
 	//indicate repaint would be good:
@@ -474,123 +560,469 @@ void Canvas::got_packet(RenderPacket * &pkt) {
 }
 
 void Canvas::dispatch_packets() {
-	
-	while (!ready_renderers.empty()) {
-
-		vector< pair< Vector2ui, unsigned int > > possible;
-		//prioritize tiles that have been drawn in:
-		for (TileSet::const_iterator s = stroked.begin(); s != stroked.end(); ++s) {
-			if (needs.count(*s)) {
-				if (needs[*s] & FLAG_ZERO) {
-					possible.push_back(make_pair(*s, RenderPacket::ZERO));
-				} else if (needs[*s] & FLAG_ONE) {
-					possible.push_back(make_pair(*s, RenderPacket::ONE));
-				} else if (needs[*s] & FLAG_RESULT) {
-					possible.push_back(make_pair(*s, RenderPacket::RESULT));
-				}
+	if (!scheduler) return;
+
+	//zoomed out, full-resolution results aren't on screen, so they wait
+	// until they are (or for a flush):
+	const unsigned int view = view_level();
+	const bool defer_results = (view > 0 && !flushing_render);
+	refresh_queue(defer_results);
+
+	//packets go to the scheduler in one batch; keep it topped up to its queue depth:
+	vector< RenderPacket * > batch;
+	while (scheduler->outstanding() + batch.size() < scheduler->queue_depth()) {
+
+		unsigned int want = 0;
+		TileQueue *from = peek_needed(defer_results, &want);
+		const bool found = (from != NULL);
+		//priority tiles are the ones the user is waiting on (they've been
+		// drawn in), so their blocks get spread over all the workers:
+		const bool priority = found && from->top().tier == 0;
+
+		//then, zoomed out, the level tiles on screen:
+		Vector2ui lod_at;
+		if (!priority && defer_results && next_lod_tile(view, &lod_at)) {
+			//(one of these stands in for 4^view full-resolution tiles, so it's
+			// rendered straight at the quality setting, not drafted)
+			RenderPacket *pkt = make_packet(lod_at, RenderPacket::RESULT, view);
+			pkt->split_blocks = true;
+			uint8_t &flags = lod_flags[view - 1].get(lod_at);
+			flags = (flags & ~LOD_STALE) | LOD_PENDING;
+			batch.push_back(pkt);
+			continue;
+		}
+
+		Vector2ui at;
+		unsigned int type;
+		//nothing out of date (that isn't already being rendered); workers that
+		// would otherwise sit idle refine what's on screen (unless a flush is
+		// waiting on what's in flight):
+		bool refining = false;
+		if (found) {
+			at = from->top().at;
+			if (want & FLAG_ZERO) {
+				type = RenderPacket::ZERO;
+			} else if (want & FLAG_ONE) {
+				type = RenderPacket::ONE;
+			} else {
+				type = RenderPacket::RESULT;
 			}
+		} else {
+			if (!needs.empty()) break;
+			if (flushing_render && !full_quality) break;
+			if (!full_quality && scheduler->outstanding() + batch.size() >= scheduler->threads()) break;
+			if (!next_refinement(&at, &type, full_quality)) break;
+			refining = true;
 		}
-		//if still no priority tiles, just use all tiles:
-		if (possible.empty()) {
-			for (TileFlags::const_iterator n = needs.begin(); n != needs.end(); ++n) {
-				if (n->second & FLAG_ZERO) {
-					possible.push_back(make_pair(n->first, RenderPacket::ZERO));
-				} else if (n->second & FLAG_ONE) {
-					possible.push_back(make_pair(n->first, RenderPacket::ONE));
-				} else if (n->second & FLAG_RESULT) {
-					possible.push_back(make_pair(n->first, RenderPacket::RESULT));
+
+		RenderPacket *pkt = make_packet(at, type);
+		//(refinements of the tiles being painted are the expensive part of
+		// what the user waits on, so they're spread out too)
+		pkt->split_blocks = priority || (refining && stroked.count(at));
+		if (refining) {
+			const unsigned int have = rendered_samples[pkt->type].get(pkt->at);
+			pkt->samples = (full_quality ? scheduler->samples() : TileRenderer::refine_samples(have, scheduler->samples()));
+		} else if (full_quality) {
+			pkt->samples = scheduler->samples();
+		} else {
+			//out-of-date tiles get a quick draft first:
+			pkt->samples = TileRenderer::DraftSamples;
+			pkt->draft = true;
+		}
+
+		{ //twiddle pending, needs, refine, and the queue correctly:
+			//pending gets bit for this packet:
+			assert(!(pending.get(pkt->at) & (1 << pkt->type)));
+			pending.add(pkt->at, 1 << pkt->type);
+
+			//needs gets bit for this packet cleared:
+			if (!refining) {
+				assert(needs.get(pkt->at) & (1 << pkt->type));
+				needs.remove(pkt->at, 1 << pkt->type);
+				//tile stays queued if there's more it can do now; otherwise
+				// got_packet queues it again if it still needs anything:
+				TileQueue::Entry entry = from->top();
+				from->pop();
+				unsigned int more = ready_needs(pkt->at);
+				if (defer_results) more &= ~FLAG_RESULT;
+				if (more) {
+					key_tile(entry, from == &near_queue);
+					from->push(entry);
 				} else {
-					assert(0);
+					//(entries left in the other queue are dropped as they come up)
+					queued_since.get(pkt->at) = 0;
+					--queued_count;
 				}
 			}
+
+			//refine too (got_packet sets it again if this isn't enough):
+			refine.remove(pkt->at, 1 << pkt->type);
 		}
 
+		batch.push_back(pkt);
+		//std::cerr << "Dispatching packet " << pkt << " for " << pkt->at << "/" << pkt->type << std::endl;
 
-		if (possible.empty()) return;
-		if (!has_brush) {
-			swap(possible.back(), possible[rand() % possible.size()]);
-		} else {
-			unsigned int closest = 0;
-			float dis = length_squared(make_vector(possible[0].first.x + 0.5f, possible[0].first.y + 0.5f) * TileSize - brush_at);
-			for (unsigned int i = 1; i < possible.size(); ++i) {
-				float test = length_squared(make_vector(possible[i].first.x + 0.5f, possible[i].first.y + 0.5f) * TileSize - brush_at);
-				if (test < dis) {
-					dis = test;
-					closest = i;
+	} //while ( scheduler wants more )
+
+	scheduler->submit(batch);
+}
+
+void Canvas::queue_tile(Vector2ui at) {
+	uint32_t &since = queued_since.get(at);
+	if (since) return;
+	since = queue_clock;
+	++queued_count;
+	TileQueue::Entry entry;
+	entry.at = at;
+	entry.since = since;
+	key_tile(entry);
+	queue.push(entry);
+}
+
+void Canvas::rekey_tile(Vector2ui at) {
+	const uint32_t since = queued_since.get(at);
+	if (!since) return;
+	TileQueue::Entry entry;
+	entry.at = at;
+	entry.since = since;
+	key_tile(entry);
+	queue.push(entry);
+}
+
+void Canvas::key_tile(TileQueue::Entry &entry, bool near) const {
+	if (stroked.count(entry.at)) {
+		entry.tier = 0;
+	} else if (tile_visible(entry.at)) {
+		entry.tier = 1;
+	} else {
+		entry.tier = 2;
+	}
+	const Vector2f focus = (has_brush ? brush_at : camera.xy);
+	//distance in tiles, and (unless near) a tile more for each generation younger:
+	entry.rank = length(make_vector(entry.at.x + 0.5f, entry.at.y + 0.5f) * float(TileSize) - focus) / float(TileSize);
+	if (!near) entry.rank += float(entry.since);
+}
+
+void Canvas::refresh_queue(bool defer_results) {
+	Vector2ui visible_lo, visible_hi;
+	visible_tiles(&visible_lo, &visible_hi);
+	if (defer_results != keyed_defer) {
+		//deferred tiles got dropped from the queue as they came up (or are
+		// about to be); start it over from needs:
+		queue.clear();
+		queued_since.tiles.assign(queued_since.tiles.size(), 0);
+		queued_count = 0;
+		for (vector< Vector2ui >::const_iterator n = needs.listed.begin(); n != needs.listed.end(); ++n) {
+			queue_tile(*n);
+		}
+	}
+	//tiles drawn on since last time go up to the stroked tier (when a
+	// stroke is committed, its tiles drop back down as they come up):
+	for (unsigned int i = keyed_stroked; i < stroked.listed.size(); ++i) {
+		rekey_tile(stroked.listed[i]);
+		queue_refinement(stroked.listed[i]);
+	}
+	//tiles that came into view go up to the visible tier:
+	if (visible_lo != keyed_visible_lo || visible_hi != keyed_visible_hi) {
+		for (unsigned int y = visible_lo.y; y < visible_hi.y; ++y) {
+			const bool seen_row = (y >= keyed_visible_lo.y && y < keyed_visible_hi.y);
+			for (unsigned int x = visible_lo.x; x < visible_hi.x; ++x) {
+				if (seen_row && x >= keyed_visible_lo.x && x < keyed_visible_hi.x) {
+					x = keyed_visible_hi.x - 1;
+					continue;
 				}
+				rekey_tile(make_vector(x, y));
+				queue_refinement(make_vector(x, y));
 			}
-			swap(possible.back(), possible[closest]);
 		}
+	}
+	//once stale entries are half the queue, keep just the best entry for
+	// each queued tile (so this is O(1) per entry made stale):
+	if (queue.size() > 2 * queued_count + 64) {
+		vector< TileQueue::Entry > &heap = queue.heap;
+		std::sort(heap.begin(), heap.end(), EntryTileLess());
+		unsigned int kept = 0;
+		for (unsigned int i = 0; i < heap.size(); ++i) {
+			if (i > 0 && heap[i - 1].at == heap[i].at) continue;
+			if (!queued_since.get(heap[i].at)) continue;
+			TileQueue::Entry entry = heap[i];
+			key_tile(entry);
+			heap[kept++] = entry;
+		}
+		heap.resize(kept);
+		assert(kept == queued_count);
+		queue.reheap();
+	}
+	keyed_defer = defer_results;
+	keyed_visible_lo = visible_lo;
+	keyed_visible_hi = visible_hi;
+	keyed_stroked = stroked.listed.size();
+
+	//and the tiles around the brush, by how close they are now:
+	near_queue.clear();
+	const Vector2f focus = (has_brush ? brush_at : camera.xy) / float(TileSize);
+	const int fx = int(floorf(focus.x));
+	const int fy = int(floorf(focus.y));
+	for (int y = std::max(0, fy - int(NearTiles)); y <= fy + int(NearTiles) && y < int(queued_since.size.y); ++y) {
+		for (int x = std::max(0, fx - int(NearTiles)); x <= fx + int(NearTiles) && x < int(queued_since.size.x); ++x) {
+			TileQueue::Entry entry;
+			entry.at = make_vector< unsigned int >(x, y);
+			entry.since = queued_since.get(entry.at);
+			if (!entry.since) continue;
+			key_tile(entry, true);
+			near_queue.push(entry);
+		}
+	}
+}
 
-		RenderPacket *pkt = new RenderPacket();
-		{ //assemble tile info into pkt:
-			pkt->at = possible.back().first;
-			pkt->type = possible.back().second;
-			possible.pop_back();
+TileQueue *Canvas::peek_needed(bool defer_results, unsigned int *want) {
+	assert(want);
+	//best tile that still needs something:
+	unsigned int queue_want = 0;
+	while (!queue.empty()) {
+		const TileQueue::Entry &top = queue.top();
+		const Vector2ui at = top.at;
+		if (!queued_since.get(at)) {
+			//(left over from before the tile was last dispatched or dropped)
+			queue.pop();
+			continue;
+		}
+		TileQueue::Entry now = top;
+		key_tile(now);
+		if (now.tier != top.tier) {
+			//gone down a tier, so goes back in lower down; gone up one, so
+			// it's got another entry already:
+			const bool down = (now.tier > top.tier);
+			queue.pop();
+			if (down) queue.push(now);
+			continue;
+		}
+		queue_want = ready_needs(at);
+		if (defer_results) queue_want &= ~FLAG_RESULT;
+		if (queue_want) break;
+		//(queued again when whatever's pending comes back, or when results
+		// stop being deferred)
+		queue.pop();
+		queued_since.get(at) = 0;
+		--queued_count;
+	}
+	//unless there's one as good near the brush:
+	while (!near_queue.empty()) {
+		const Vector2ui at = near_queue.top().at;
+		if (queued_since.get(at)) {
+			*want = ready_needs(at);
+			if (defer_results) *want &= ~FLAG_RESULT;
+			if (*want) break;
+		}
+		near_queue.pop();
+	}
+	if (!near_queue.empty() && (queue.empty() || near_queue.top().tier <= queue.top().tier)) {
+		return &near_queue;
+	}
+	if (queue.empty()) return NULL;
+	*want = queue_want;
+	return &queue;
+}
 
+unsigned int Canvas::ready_needs(Vector2ui at) {
+	return needs.get(at) & ~pending.get(at);
+}
 
-			for (vector< Layer * >::iterator l = layers.begin(); l != layers.end(); ++l) {
-				pkt->layers.push_back(make_pair((*l)->op, (*l)->get_tile_or_null(pkt->at)));
-			}
-			for (vector< Stroke * >::iterator s = strokes.begin(); s != strokes.end(); ++s) {
-				if (s - strokes.begin() == current_stroke) {
-					//current stroke might be changed (dependin'):
-					if (pkt->type == RenderPacket::ZERO) {
-						//Skip constraint.
-					} else if (pkt->type == RenderPacket::ONE) {
-						static uint8_t *ones = NULL;
-						if (!ones) {
-							ones = new uint8_t[TileSize * TileSize];
-							memset(ones, 0xff, TileSize * TileSize);
-						}
-						//constraint is all ones:
-						pkt->strokes.push_back(make_pair((*s)->op, ones));
-					} else if (pkt->type == RenderPacket::RESULT) {
-						if ((*s)->get_tile_or_null(pkt->at)) {
-							pkt->strokes.push_back(make_pair((*s)->op, (*s)->get_tile_or_null(pkt->at)));
-						}
-					} else {
-						assert(0);
-					}
-				} else {
-					//treat non-current stroke normally:
-					if ((*s)->get_tile_or_null(pkt->at)) {
-						pkt->strokes.push_back(make_pair((*s)->op, (*s)->get_tile_or_null(pkt->at)));
-					}
+RenderPacket *Canvas::make_packet(Vector2ui at, unsigned int type, unsigned int level) {
+	assert(level == 0 || type == RenderPacket::RESULT);
+	RenderPacket *pkt = RenderPacket::create();
+	pkt->at = at;
+	pkt->level = level;
+	pkt->type = type;
+
+	for (vector< Layer * >::iterator l = layers.begin(); l != layers.end(); ++l) {
+		pkt->add_layer((*l)->op, (*l)->get_level_ref(level, pkt->at), (*l)->get_level_coverage(level, pkt->at));
+	}
+	for (vector< Stroke * >::iterator s = strokes.begin(); s != strokes.end(); ++s) {
+		if (s - strokes.begin() == current_stroke) {
+			//current stroke might be changed (dependin'):
+			if (pkt->type == RenderPacket::ZERO) {
+				//Skip constraint.
+			} else if (pkt->type == RenderPacket::ONE) {
+				static uint8_t *ones = NULL;
+				if (!ones) {
+					ones = new uint8_t[TileSize * TileSize];
+					memset(ones, 0xff, TileSize * TileSize);
+				}
+				//constraint is all ones:
+				pkt->strokes.push_back(make_pair((*s)->op, ones));
+				pkt->stroke_coverage.push_back(CoverageFull);
+			} else if (pkt->type == RenderPacket::RESULT) {
+				TileRef< uint8_t > tile = (*s)->get_level_ref(level, pkt->at);
+				if (tile.get()) {
+					pkt->add_stroke((*s)->op, tile, (*s)->get_level_coverage(level, pkt->at));
 				}
+			} else {
+				assert(0);
+			}
+		} else {
+			//treat non-current stroke normally:
+			TileRef< uint8_t > tile = (*s)->get_level_ref(level, pkt->at);
+			if (tile.get()) {
+				pkt->add_stroke((*s)->op, tile, (*s)->get_level_coverage(level, pkt->at));
 			}
+		}
+	}
 
-			memcpy(&(pkt->out[0]), default_bg(), sizeof(uint32_t) * TileSize * TileSize);
+	memcpy(&(pkt->out[0]), default_bg(), sizeof(uint32_t) * TileSize * TileSize);
+	return pkt;
+}
+
+bool Canvas::has_texture(Vector2ui at, unsigned int type) {
+	if (type == RenderPacket::ZERO) return zero_texs.get(at) != 0;
+	if (type == RenderPacket::ONE) return one_texs.get(at) != 0;
+	assert(type == RenderPacket::RESULT);
+	return result_fbs.get(at) != NULL;
+}
+
+bool Canvas::next_refinement(Vector2ui *at, unsigned int *type, bool anywhere) {
+	assert(at);
+	assert(type);
+	//(zoomed out, results come from level tiles instead)
+	const bool results = (anywhere || view_level() == 0);
+	//(a rebuild costs what the stale entries did to make)
+	if (results != refine_results || refine_queue.size() > 2 * refine.listed.size() + 64) {
+		refine_results = results;
+		requeue_refinements();
+	}
+	while (!refine_queue.empty()) {
+		const TileQueue::Entry &top = refine_queue.top();
+		TileQueue::Entry now = top;
+		key_refinement(now, type);
+		if (now.tier != top.tier) {
+			//(refined, scrolled off, drawn on, ...; back in where it goes now)
+			refine_queue.pop();
+			if (now.tier != NoRefinement) refine_queue.push(now);
+			continue;
 		}
+		//(everything after this is offscreen too)
+		if (!anywhere && now.tier >= OffscreenRefinement) return false;
+		*at = now.at;
+		return true;
+	}
+	return false;
+}
 
-		{ //twiddle pending and needs correctly:
-			//pending gets bit for this packet:
-			TileFlags::iterator p = pending.find(pkt->at);
-			if (p == pending.end()) {
-				p = pending.insert(make_pair(pkt->at, 0)).first;
-			}
-			assert(!(p->second & (1 << pkt->type)));
-			p->second |= (1 << pkt->type);
+void Canvas::queue_refinement(Vector2ui at) {
+	if (!refine.get(at)) return;
+	TileQueue::Entry entry;
+	entry.at = at;
+	entry.since = 0;
+	key_refinement(entry);
+	if (entry.tier != NoRefinement) refine_queue.push(entry);
+}
 
-			//needs gets bit for this packet cleared:
-			TileFlags::iterator n = needs.find(pkt->at);
-			assert(n != needs.end());
-			assert(n->second & (1 << pkt->type));
-			n->second &= ~(1 << pkt->type);
-			if (n->second == 0) {
-				needs.erase(n);
+void Canvas::requeue_refinements() {
+	refine_queue.clear();
+	for (vector< Vector2ui >::const_iterator r = refine.listed.begin(); r != refine.listed.end(); ++r) {
+		queue_refinement(*r);
+	}
+}
+
+void Canvas::key_refinement(TileQueue::Entry &entry, unsigned int *type) {
+	const unsigned int flags = refine.get(entry.at);
+	//only what paintGL shows -- zero/one where stroked, result elsewhere:
+	const unsigned int shown = (stroked.count(entry.at) ? FLAG_ZERO | FLAG_ONE : (refine_results ? FLAG_RESULT : 0));
+	entry.tier = NoRefinement;
+	for (unsigned int t = RenderPacket::ZERO; t <= RenderPacket::RESULT; ++t) {
+		if (!(flags & shown & (1 << t))) continue;
+		//roughest first:
+		const uint32_t samples = rendered_samples[t].get(entry.at);
+		if (entry.tier == NoRefinement || samples < entry.tier) {
+			entry.tier = samples;
+			if (type) *type = t;
+		}
+	}
+	if (entry.tier == NoRefinement) return;
+	if (!tile_visible(entry.at)) entry.tier += OffscreenRefinement;
+	//then closest to where the user is looking:
+	const Vector2f focus = (has_brush ? brush_at : camera.xy);
+	entry.rank = length(make_vector(entry.at.x + 0.5f, entry.at.y + 0.5f) * float(TileSize) - focus) / float(TileSize);
+}
+
+bool Canvas::tile_visible(Vector2ui at) const {
+	Vector2ui lo, hi;
+	visible_tiles(&lo, &hi);
+	return at.x >= lo.x && at.x < hi.x && at.y >= lo.y && at.y < hi.y;
+}
+
+void Canvas::visible_tiles(Vector2ui *lo, Vector2ui *hi) const {
+	assert(lo);
+	assert(hi);
+	*lo = *hi = make_vector(0U, 0U);
+	if (width() == 0 || height() == 0) return;
+	//(matches the projection in paintGL)
+	const Vector2f half = make_vector(camera.z * float(width()) / float(height()), camera.z);
+	const Vector2f min = (camera.xy - half) * (1.0f / float(TileSize));
+	const Vector2f max = (camera.xy + half) * (1.0f / float(TileSize));
+	const Vector2f size = make_vector< float >(result_fbs.size);
+	lo->x = (unsigned int)std::max(0.0f, std::min(size.x, floorf(min.x)));
+	lo->y = (unsigned int)std::max(0.0f, std::min(size.y, floorf(min.y)));
+	hi->x = (unsigned int)std::max(float(lo->x), std::min(size.x, ceilf(max.x)));
+	hi->y = (unsigned int)std::max(float(lo->y), std::min(size.y, ceilf(max.y)));
+}
+
+unsigned int Canvas::view_level() const {
+	if (height() == 0) return 0;
+	//image pixels per screen pixel:
+	float per_pixel = 2.0f * camera.z / float(height());
+	unsigned int level = 0;
+	while (level < lod_texs.size() && per_pixel >= 2.0f) {
+		per_pixel *= 0.5f;
+		++level;
+	}
+	return level;
+}
+
+bool Canvas::next_lod_tile(unsigned int level, Vector2ui *at) {
+	assert(level > 0 && level <= lod_flags.size());
+	assert(at);
+	if (width() == 0 || height() == 0) return false;
+	ScalarTiled< uint8_t > &flags = lod_flags[level - 1];
+	//level tiles on screen (as in tile_visible):
+	const float extent = float(TileSize << level);
+	const Vector2f half = make_vector(camera.z * float(width()) / float(height()), camera.z);
+	const Vector2f lo = (camera.xy - half) * (1.0f / extent);
+	const Vector2f hi = (camera.xy + half) * (1.0f / extent);
+	const unsigned int x0 = (unsigned int)std::max(0.0f, floorf(lo.x));
+	const unsigned int y0 = (unsigned int)std::max(0.0f, floorf(lo.y));
+	const unsigned int x1 = (unsigned int)std::max(0.0f, std::min(float(flags.size.x), ceilf(hi.x)));
+	const unsigned int y1 = (unsigned int)std::max(0.0f, std::min(float(flags.size.y), ceilf(hi.y)));
+
+	const Vector2f focus = (has_brush ? brush_at : camera.xy);
+	bool found = false;
+	float best_dis = 0.0f;
+	for (unsigned int y = y0; y < y1; ++y) {
+		for (unsigned int x = x0; x < x1; ++x) {
+			if ((flags.get(x,y) & (LOD_STALE | LOD_PENDING)) != LOD_STALE) continue;
+			const float dis = length_squared(make_vector(x + 0.5f, y + 0.5f) * extent - focus);
+			if (!found || dis < best_dis) {
+				found = true;
+				best_dis = dis;
+				*at = make_vector(x,y);
 			}
 		}
+	}
+	return found;
+}
 
-		//Dispatch packet to renderer:
-		{
-			QObject *renderer = ready_renderers.back();
-			ready_renderers.pop_back();
-			QCoreApplication::postEvent(renderer, new RendererRequestEvent(pkt));
-			//std::cerr << "Dispatching packet " << pkt << " for " << pkt->at << "/" << pkt->type << std::endl;
+void Canvas::mark_lods_stale(Vector2ui at) {
+	for (unsigned int l = 1; l <= lod_flags.size(); ++l) {
+		lod_flags[l - 1].get(make_vector(at.x >> l, at.y >> l)) |= LOD_STALE;
+	}
+}
+
+void Canvas::mark_lods_stale() {
+	for (unsigned int l = 0; l < lod_flags.size(); ++l) {
+		for (vector< uint8_t >::iterator f = lod_flags[l].tiles.begin(); f != lod_flags[l].tiles.end(); ++f) {
+			*f |= LOD_STALE;
 		}
-		
-	} //while ( renderers still ready )
+	}
 }
 
 Vector2f Canvas::widget_to_image(Vector2f const &widget) const {
@@ -649,6 +1081,32 @@ void Canvas::set_pix_size(Vector2ui new_size) {
 		result_fbs.expand(tile_size, NULL);
 		zero_texs.expand(tile_size, 0);
 		one_texs.expand(tile_size, 0);
+		for (unsigned int t = RenderPacket::ZERO; t <= RenderPacket::RESULT; ++t) {
+			rendered_samples[t].expand(tile_size, 0);
+		}
+		queued_since.expand(tile_size, 0);
+	}
+
+	//and the tile states:
+	stroked.expand(tile_size);
+	needs.expand(tile_size);
+	pending.expand(tile_size);
+	refine.expand(tile_size);
+
+	{ //and the zoomed-out levels, up to one that fits in a single tile:
+		unsigned int levels = 0;
+		while ((1U << levels) < std::max(tile_size.x, tile_size.y)) {
+			++levels;
+		}
+		if (levels > lod_texs.size()) {
+			lod_texs.resize(levels);
+			lod_flags.resize(levels);
+		}
+		for (unsigned int l = 1; l <= lod_texs.size(); ++l) {
+			Vector2ui level_size = make_vector((tile_size.x + (1 << l) - 1) >> l, (tile_size.y + (1 << l) - 1) >> l);
+			lod_texs[l - 1].expand(level_size, 0);
+			lod_flags[l - 1].expand(level_size, LOD_STALE);
+		}
 	}
 
 	//Should be equivalent but safer:
@@ -658,8 +1116,7 @@ void Canvas::set_pix_size(Vector2ui new_size) {
 	for (unsigned int y = 0; y < tile_size.y; ++y) {
 		for (unsigned int x = 0; x < tile_size.x; ++x) {
 			Vector2ui at = make_vector(x,y);
-			TileFlags::iterator n = needs.insert(make_pair(at, 0)).first;
-			n->second |= FLAG_RESULT;
+			needs.add(at, FLAG_RESULT);
 		}
 	}
 	dispatch_packets();
@@ -780,23 +1237,27 @@ bool Canvas::update_stroke_op(unsigned int stroke, std::string new_op) {
 
 
 void Canvas::mark_dirty() {
-	if (!pending.empty()) {
-		cerr << "**** Warning, marking dirty while things are pending; this is likely to cause a crash ****" << endl;
-	}
-	//Mark everything as needing to be recalculated.
+	//Mark everything as needing to be recalculated. (Tiles still being
+	// rendered are sent again once they come back; see ready_needs.)
+	++queue_clock;
 	for (unsigned int y = 0; y < result_fbs.size.y; ++y) {
 		for (unsigned int x = 0; x < result_fbs.size.x; ++x) {
 			Vector2ui at = make_vector(x,y);
-			TileFlags::iterator n = needs.insert(make_pair(at, 0)).first;
+			unsigned int flags = 0;
 			if (current_stroke != -1U) {
-				n->second |= FLAG_ZERO;
-				n->second |= FLAG_ONE;
+				flags |= FLAG_ZERO;
+				flags |= FLAG_ONE;
 			}
 			if (!stroked.count(at)) {
-				n->second |= FLAG_RESULT;
+				flags |= FLAG_RESULT;
+			}
+			if (flags) {
+				needs.add(at, flags);
+				queue_tile(at);
 			}
 		}
 	}
+	mark_lods_stale();
 	dispatch_packets();
 }
 
@@ -818,6 +1279,46 @@ void Canvas::finish_renderer_changed() {
 	mark_dirty();
 }
 
+void Canvas::start_full_quality_flush() {
+	flushing_render = true;
+	full_quality = true;
+	dispatch_packets();
+	//just in case we're already done:
+	Vector2ui at;
+	unsigned int type;
+	if (needs.empty() && pending.empty() && !next_refinement(&at, &type, true)) {
+		emit render_flushed();
+		flushing_render = false;
+		full_quality = false;
+	}
+}
+
+void Canvas::quality_changed() {
+	if (!scheduler) return;
+	const unsigned int target = scheduler->samples();
+	//(zero/one textures only matter while there's a current stroke)
+	const unsigned int shown = (current_stroke != -1U ? FLAG_ZERO | FLAG_ONE | FLAG_RESULT : FLAG_RESULT);
+	for (unsigned int y = 0; y < result_fbs.size.y; ++y) {
+		for (unsigned int x = 0; x < result_fbs.size.x; ++x) {
+			Vector2ui at = make_vector(x,y);
+			//(these get looked at when they come back)
+			const unsigned int busy = needs.get(at) | pending.get(at);
+			unsigned int flags = 0;
+			for (unsigned int t = RenderPacket::ZERO; t <= RenderPacket::RESULT; ++t) {
+				if ((shown & ~busy & (1 << t)) && has_texture(at, t) && rendered_samples[t].get(at) < target) {
+					flags |= (1 << t);
+				}
+			}
+			refine.set(at, flags);
+		}
+	}
+	requeue_refinements();
+	//(level tiles are cheap enough to just re-render)
+	mark_lods_stale();
+	dispatch_packets();
+	update();
+}
+
 void Canvas::add_stroke(QImage const &from, const StackOp *op) {
 	if ((int)pix_size.x < from.width()) {
 		pix_size.x = from.width();
@@ -957,17 +1458,20 @@ void Canvas::finish_setting_current_stroke() {
 		current_draw = new StrokeDraw(&brush, strokes[current_stroke]);
 
 		//set needs, and kick off rendering:
+		++queue_clock;
 		for (unsigned int y = 0; y < result_fbs.size.y; ++y) {
 			for (unsigned int x = 0; x < result_fbs.size.x; ++x) {
 				Vector2ui at = make_vector(x,y);
-				TileFlags::iterator n = needs.insert(make_pair(at, FLAG_ONE)).first;
+				unsigned int flags = FLAG_ONE;
 				if (strokes[current_stroke]->get_tile_or_null(at)) {
 					//anywhere the stroke is, can't use result.
-					n->second |= FLAG_ZERO;
+					flags |= FLAG_ZERO;
 				} else {
 					//TODO: if stroke isn't there, can copy result to zero.
-					n->second |= FLAG_ZERO;
+					flags |= FLAG_ZERO;
 				}
+				needs.add(at, flags);
+				queue_tile(at);
 			}
 		}
 		dispatch_packets();
@@ -988,9 +1492,8 @@ void Canvas::start_stroke_commit() {
 	}
 
 	//We don't need to render stuff that wasn't stroked:
-	for (TileFlags::const_iterator t = needs.begin(); t != needs.end(); /* later */) {
-		if (!stroked.count(t->first)) t = needs.erase(t);
-		else ++t;
+	for (unsigned int i = needs.listed.size() - 1; i < needs.listed.size(); --i) {
+		if (!stroked.count(needs.listed[i])) needs.set(needs.listed[i], 0);
 	}
 
 	//TODO: could go through here and find stuff we were going to request zero/one and
@@ -1033,7 +1536,7 @@ void Canvas::finish_stroke_commit() {
 
 	glActiveTextureScope();
 
-	for (TileSet::iterator s = stroked.begin(); s != stroked.end(); ++s) {
+	for (vector< Vector2ui >::const_iterator s = stroked.listed.begin(); s != stroked.listed.end(); ++s) {
 
 		QGLFramebufferObject *&fb = result_fbs.get(*s);
 		if (!fb) {
@@ -1087,7 +1590,24 @@ void Canvas::finish_stroke_commit() {
 
 	gl_errors("composite in stroke commit");
 
+	//zero/one textures aren't shown any more, and committed tiles are only
+	// as good as the textures they were mixed from:
+	for (unsigned int i = refine.listed.size() - 1; i < refine.listed.size(); --i) {
+		refine.set(refine.listed[i], refine.get(refine.listed[i]) & FLAG_RESULT);
+	}
+	for (vector< Vector2ui >::const_iterator s = stroked.listed.begin(); s != stroked.listed.end(); ++s) {
+		mark_lods_stale(*s);
+		uint16_t &have = rendered_samples[RenderPacket::RESULT].get(*s);
+		have = std::min(rendered_samples[RenderPacket::ZERO].get(*s), rendered_samples[RenderPacket::ONE].get(*s));
+		if (scheduler && have < scheduler->samples()) {
+			refine.add(*s, FLAG_RESULT);
+		}
+	}
+
 	stroked.clear();
+	keyed_stroked = 0;
+	//(zero/one entries are all stale, and results may have gotten rougher)
+	requeue_refinements();
 
 	delete current_draw;
 	current_draw = NULL;
@@ -5,6 +5,7 @@
 #include "LayerOps.hpp"
 #include "StrokeDraw.hpp"
 #include "Renderer.hpp"
+#include "TileQueue.hpp"
 
 #include <QtOpenGL>
 
@@ -13,6 +14,7 @@
 class LayerList;
 class StrokeList;
 class RenderPacket;
+class TileScheduler;
 
 class Canvas : public QGLWidget {
 	Q_OBJECT
@@ -38,6 +40,14 @@ protected:
 	virtual void customEvent(QEvent *e);
 	void got_packet(RenderPacket * &completed); //deletes completed, sets to NULL.
 	void dispatch_packets();
+	//needs bits for 'at' that aren't already being rendered (those wait for
+	// the render in flight to come back):
+	unsigned int ready_needs(Vector2ui at);
+	//the packet to (re-)render tile 'at' of mip level 'level' as 'type' (a
+	// RenderPacket::* value):
+	RenderPacket *make_packet(Vector2ui at, unsigned int type, unsigned int level = 0);
+	//paintGL's drawing of full-resolution tile 'at':
+	void draw_tile(Vector2ui at, GLuint missing_tex);
 
 	Vector2f widget_to_image(Vector2f const &) const;
 	Vector2f widget_to_image(QPointF const &) const;
@@ -62,6 +72,9 @@ public slots:
 	void mark_dirty();
 	void renderer_changed();
 	void finish_renderer_changed();
+	//the scheduler's quality setting changed; textures stay up and get
+	// refined (or are already good enough):
+	void quality_changed();
 
 public:
 
@@ -84,7 +97,8 @@ public:
 	std::vector< Stroke * > strokes;
 	StrokeList *stroke_list;
 
-	std::vector< QObject * > ready_renderers;
+	//renders packets (set up by App):
+	TileScheduler *scheduler;
 
 
 	ScalarTiled< QGLFramebufferObject * > result_fbs;
@@ -100,7 +114,97 @@ public:
 	//tiles that are being rendered without/with current stroke:
 	TileFlags pending;
 
+	//Tiles with needs bits that aren't pending, best first: stroked tiles
+	// (the user is waiting on those), then visible ones, then the rest;
+	// within a tier, nearest the brush (or the middle of the view) as of
+	// when the tile was keyed, with a tile of distance given up per batch of
+	// marking a tile is younger.
+	//Keys aren't redone as the brush or view move. A queued tile that goes
+	// up a tier (drawn on, or scrolled into view) gets another entry, and
+	// entries that have gone stale are dropped or re-keyed as they come to
+	// the top, so each dispatch is O(log n) (plus the tiles that changed).
+	//queued_since is when a tile was queued (0 == isn't).
+	TileQueue queue;
+	ScalarTiled< uint32_t > queued_since;
+	unsigned int queued_count; //tiles with queued_since set
+	uint32_t queue_clock; //bumped each time a batch of tiles is marked
+	void queue_tile(Vector2ui at); //(if it isn't already)
+	void rekey_tile(Vector2ui at); //another entry, if queued, at its current tier
+	//('near' ranks by distance alone, for near_queue)
+	void key_tile(TileQueue::Entry &entry, bool near = false) const;
+	//Queued tiles within NearTiles of the brush (or the middle of the view),
+	// by tier and then current distance; rebuilt every dispatch, and taken
+	// ahead of 'queue' within a tier:
+	static const unsigned int NearTiles = 2;
+	TileQueue near_queue;
+	//what the queues were last brought up to date with:
+	Vector2ui keyed_visible_lo, keyed_visible_hi;
+	unsigned int keyed_stroked; //(stroked.listed only grows until it's cleared)
+	bool keyed_defer;
+	//add entries (in refine_queue too) for tiles that went up a tier since
+	// last time, clear out stale entries once they're half the queue, and
+	// rebuild near_queue; rebuild everything first if results stopped or
+	// started being deferred:
+	void refresh_queue(bool defer_results);
+	//near_queue or queue, whichever has the tile to do next, and that
+	// tile's ready needs (dropping tiles without any); NULL if neither has one:
+	TileQueue *peek_needed(bool defer_results, unsigned int *want);
+
+	//Progressive rendering: tiles are first rendered as quick drafts, then
+	// -- whenever workers would otherwise be idle and nothing is out of date --
+	// re-rendered a rung up TileRenderer's quality ladder at a time, on-screen
+	// tiles first, until they reach the scheduler's setting.
+	//coefficients each texture was last rendered with (0 == draft), by packet type:
+	ScalarTiled< uint16_t > rendered_samples[3];
+	static const uint16_t ExactSamples = 0xffff; //can't be improved on
+	//textures (FLAG_* bits) below the current setting:
+	TileFlags refine;
+	//refine's tiles, roughest shown texture first (offscreen after onscreen),
+	// then closest to the focus when keyed. Like 'queue', entries are checked
+	// as they come to the top; a tile gets a new entry whenever a texture is
+	// added to refine or it goes up a tier in refresh_queue:
+	TileQueue refine_queue;
+	static const uint32_t OffscreenRefinement = 0x10000; //(added to samples)
+	static const uint32_t NoRefinement = -1U;
+	bool refine_results; //what refine_queue was keyed with (see next_refinement)
+	void queue_refinement(Vector2ui at); //(if it has anything to refine)
+	void requeue_refinements(); //from scratch, O(refine.listed)
+	//(also sets 'type', if given, to the texture the tier came from)
+	void key_refinement(TileQueue::Entry &entry, unsigned int *type = NULL);
+	//is there a texture of 'type' at 'at'?
+	bool has_texture(Vector2ui at, unsigned int type);
+	//the (shown, and unless 'anywhere' is set, visible) texture to refine
+	// next; false if there isn't one:
+	bool next_refinement(Vector2ui *at, unsigned int *type, bool anywhere);
+	bool tile_visible(Vector2ui at) const;
+	//the on-screen tiles, [lo, hi) (clamped to the grid):
+	void visible_tiles(Vector2ui *lo, Vector2ui *hi) const;
+
+	//Zoomed out, the view shows RESULT tiles rendered from the layers' and
+	// strokes' mip levels (see Tiled::get_level_ref) instead, and
+	// full-resolution RESULT renders wait until they're looked at (or
+	// flushed). lod_texs[l-1] and lod_flags[l-1] are for level l, whose tiles
+	// each cover 2^l x 2^l full-resolution tiles:
+	std::vector< ScalarTiled< GLuint > > lod_texs;
+	std::vector< ScalarTiled< uint8_t > > lod_flags; //LOD_* bits
+	static const uint8_t LOD_STALE = 1; //out of date (or never rendered)
+	static const uint8_t LOD_PENDING = 2; //being rendered
+	//the level that matches the camera (0 unless image pixels are at most
+	// half a screen pixel):
+	unsigned int view_level() const;
+	//the visible, stale, not-pending tile of 'level' nearest the brush; false
+	// if there isn't one:
+	bool next_lod_tile(unsigned int level, Vector2ui *at);
+	//full-resolution tile 'at' changed:
+	void mark_lods_stale(Vector2ui at);
+	//everything did:
+	void mark_lods_stale();
+
 	bool flushing_render;
+	//while flushing, render straight to full quality and refine every tile,
+	// not just visible ones, before render_flushed (e.g. before saving):
+	bool full_quality;
+	void start_full_quality_flush();
 signals:
 	void render_flushed();
 
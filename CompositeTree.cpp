@@ -0,0 +1,186 @@
+#include "CompositeTree.hpp"
+#include "LayerOps.hpp"
+#include "OrderingCache.hpp"
+#include "Constants.hpp"
+
+#include <memory.h>
+
+#include <algorithm>
+#include <cassert>
+
+using std::vector;
+using std::make_pair;
+
+namespace {
+class OrderLess {
+public:
+	OrderLess(vector< unsigned int > const &_orders, vector< unsigned int > const &_offsets) : orders(_orders), offsets(_offsets) {
+	}
+	bool operator()(unsigned int a, unsigned int b) const {
+		return std::lexicographical_compare(
+			orders.begin() + offsets[a], orders.begin() + offsets[a + 1],
+			orders.begin() + offsets[b], orders.begin() + offsets[b + 1]);
+	}
+	vector< unsigned int > const &orders;
+	vector< unsigned int > const &offsets;
+};
+}
+
+CompositeTree::CompositeTree() : layer_composites(0), naive_composites(0), occluded_layers(0), merged_orderings(0), layers(NULL), base(0), bg(NULL), count(0), coverage(NULL), pool_count(0) {
+}
+
+CompositeTree::~CompositeTree() {
+	assert(results.empty());
+	assert(prefixes.empty());
+	for (vector< uint32_t * >::iterator b = pool.begin(); b != pool.end(); ++b) {
+		delete[] *b;
+	}
+}
+
+void CompositeTree::begin(vector< std::pair< const LayerOp *, const uint32_t * > > const &_layers, unsigned int _base, uint32_t const *_bg, uint32_t _count, vector< uint8_t > const *_coverage) {
+	assert(results.empty());
+	assert(prefixes.empty());
+	assert(!_coverage || _coverage->size() == _layers.size());
+	layers = &_layers;
+	coverage = _coverage;
+	base = _base;
+	bg = _bg;
+	count = _count;
+	if (count != pool_count) {
+		for (vector< uint32_t * >::iterator b = pool.begin(); b != pool.end(); ++b) {
+			delete[] *b;
+		}
+		pool.clear();
+		pool_count = count;
+	}
+	orders.clear();
+	offsets.clear();
+	offsets.push_back(0);
+}
+
+unsigned int CompositeTree::add(LayerToOrder const &l2o) {
+	assert(l2o.size() == layers->size());
+	const unsigned int at = orders.size();
+	orders.resize(at + l2o.size(), -1U);
+	for (unsigned int l = 0; l < l2o.size(); ++l) {
+		assert(l2o[l] < l2o.size());
+		orders[at + l2o[l]] = l;
+	}
+	//leave out NULL layers, which don't change the composite, and anything
+	// under an opaque layer (which would be entirely replaced by it):
+	unsigned int keep = at;
+	for (unsigned int i = at; i < orders.size(); ++i) {
+		assert(orders[i] < layers->size());
+		if ((*layers)[orders[i]].second) {
+			if (coverage && LayerOp::hides_below((*layers)[orders[i]], (*coverage)[orders[i]])) {
+				occluded_layers += keep - at;
+				keep = at;
+			}
+			orders[keep++] = orders[i];
+		}
+	}
+	orders.resize(keep);
+	offsets.push_back(keep);
+	return offsets.size() - 2;
+}
+
+void CompositeTree::composite() {
+	const unsigned int n = offsets.size() - 1;
+	results.assign(n, NULL);
+	canonical_of.resize(n);
+
+	by_order.resize(n);
+	for (unsigned int i = 0; i < n; ++i) {
+		by_order[i] = i;
+	}
+	std::sort(by_order.begin(), by_order.end(), OrderLess(orders, offsets));
+	lcp.resize(n);
+	for (unsigned int s = 0; s + 1 < n; ++s) {
+		unsigned int const *a = order(by_order[s]);
+		unsigned int const *b = order(by_order[s + 1]);
+		unsigned int size = std::min(order_size(by_order[s]), order_size(by_order[s + 1]));
+		unsigned int common = 0;
+		while (common < size && a[common] == b[common]) ++common;
+		lcp[s] = common;
+	}
+
+	//Depth-first walk of the trie: each ordering picks up from the deepest
+	// composite it shares with the one before it (which is on 'prefixes').
+	for (unsigned int s = 0; s < n; ++s) {
+		const unsigned int index = by_order[s];
+		unsigned int const *o = order(index);
+		const unsigned int size = order_size(index);
+		const unsigned int start = (s == 0 ? 0 : lcp[s - 1]);
+		if (s > 0 && start == size && order_size(by_order[s - 1]) == size) {
+			//same as the last one, so share its composite:
+			results[index] = results[by_order[s - 1]];
+			canonical_of[index] = canonical_of[by_order[s - 1]];
+			++merged_orderings;
+			naive_composites += size;
+			continue;
+		}
+		canonical_of[index] = index;
+		while (!prefixes.empty() && prefixes.back().first > start) {
+			put_buffer(prefixes.back().second);
+			prefixes.pop_back();
+		}
+		uint32_t *col = get_buffer();
+		if (start == 0) {
+			memcpy(col, bg, count * sizeof(uint32_t));
+		} else {
+			assert(!prefixes.empty() && prefixes.back().first == start);
+			memcpy(col, prefixes.back().second, count * sizeof(uint32_t));
+		}
+		//later orderings branch off this one at the successive lows of lcp:
+		saves.clear();
+		unsigned int low = size + 1;
+		for (unsigned int m = s; m + 1 < n && lcp[m] > start; ++m) {
+			//(duplicates share the result, so don't need a copy)
+			if (lcp[m] < low && !(lcp[m] == size && order_size(by_order[m + 1]) == size)) {
+				low = lcp[m];
+				saves.push_back(low);
+			}
+		}
+		unsigned int depth = start;
+		for (vector< unsigned int >::reverse_iterator d = saves.rbegin(); d != saves.rend(); ++d) {
+			assert(*d <= size);
+			LayerOp::compose_stack(o + depth, *d - depth, *layers, base, col, count);
+			depth = *d;
+			uint32_t *keep = get_buffer();
+			memcpy(keep, col, count * sizeof(uint32_t));
+			prefixes.push_back(make_pair(depth, keep));
+		}
+		LayerOp::compose_stack(o + depth, size - depth, *layers, base, col, count);
+		results[index] = col;
+
+		layer_composites += size - start;
+		naive_composites += size;
+	}
+
+	while (!prefixes.empty()) {
+		put_buffer(prefixes.back().second);
+		prefixes.pop_back();
+	}
+}
+
+void CompositeTree::end() {
+	for (unsigned int index = 0; index < results.size(); ++index) {
+		if (results[index] && canonical_of[index] == index) {
+			put_buffer(results[index]);
+		}
+	}
+	results.clear();
+}
+
+uint32_t *CompositeTree::get_buffer() {
+	if (pool.empty()) {
+		return new uint32_t[pool_count];
+	}
+	uint32_t *ret = pool.back();
+	pool.pop_back();
+	return ret;
+}
+
+void CompositeTree::put_buffer(uint32_t *buffer) {
+	pool.push_back(buffer);
+}
@@ -0,0 +1,81 @@
+#ifndef COMPOSITE_TREE_HPP
+#define COMPOSITE_TREE_HPP
+
+#include <stdint.h>
+
+#include <vector>
+#include <utility>
+#include <cstddef>
+
+class LayerOp;
+class LayerToOrder;
+
+//Pre-composites a batch of orderings over a shared background. Orderings
+// are sorted so that ones with a common bottom prefix are neighbours, and
+// each shared prefix is composited once (walking the trie of orderings
+// depth-first) instead of once per ordering.
+//Given per-layer coverage, an ordering starts at its topmost opaque 'over'
+// layer (which hides everything under it), and orderings that come out the
+// same are composited once.
+//Buffers come from a pool that persists across batches; like
+// OrderingCache, keep one per renderer thread.
+class CompositeTree {
+public:
+	CompositeTree();
+	~CompositeTree();
+
+	//Start a batch: layers are read from pixel 'base', over 'count' pixels
+	// of background 'bg'. 'coverage' (if given) holds a Coverage* value per
+	// layer, for the whole of every layer tile.
+	void begin(std::vector< std::pair< const LayerOp *, const uint32_t * > > const &layers, unsigned int base, uint32_t const *bg, uint32_t count, std::vector< uint8_t > const *coverage = NULL);
+	//Add an ordering; returns its index in the batch.
+	unsigned int add(LayerToOrder const &l2o);
+	//Composite everything added since begin():
+	void composite();
+	//composite of ordering 'index', valid until end():
+	uint32_t const *result(unsigned int index) const {
+		return results[index];
+	}
+	//Return this batch's buffers to the pool:
+	void end();
+
+	//stats:
+	uint64_t layer_composites; //layers actually composited
+	uint64_t naive_composites; //layers compositing each ordering from the background would take
+	uint64_t occluded_layers; //layers left out because an opaque one was above them
+	uint64_t merged_orderings; //orderings that shared another's composite
+	uint64_t saved() const {
+		return naive_composites - layer_composites;
+	}
+
+private:
+	uint32_t *get_buffer();
+	void put_buffer(uint32_t *buffer);
+	//index'th ordering, bottom to top, NULL layers left out:
+	unsigned int const *order(unsigned int index) const {
+		return &orders[offsets[index]];
+	}
+	unsigned int order_size(unsigned int index) const {
+		return offsets[index + 1] - offsets[index];
+	}
+
+	std::vector< std::pair< const LayerOp *, const uint32_t * > > const *layers;
+	unsigned int base;
+	uint32_t const *bg;
+	uint32_t count;
+	std::vector< uint8_t > const *coverage;
+
+	std::vector< unsigned int > orders; //all orderings, concatenated
+	std::vector< unsigned int > offsets; //ordering i is [offsets[i], offsets[i+1])
+	std::vector< unsigned int > by_order; //batch indices, sorted by ordering
+	std::vector< unsigned int > lcp; //lcp[i] == common prefix of by_order[i] and by_order[i+1]
+	std::vector< unsigned int > saves; //scratch: depths to keep while compositing one ordering
+	std::vector< std::pair< unsigned int, uint32_t * > > prefixes; //(depth, composite) along the current path
+	std::vector< uint32_t * > results;
+	std::vector< unsigned int > canonical_of; //the ordering whose composite each one shares (itself if none)
+
+	std::vector< uint32_t * > pool;
+	uint32_t pool_count; //size of the buffers in the pool
+};
+
+#endif //COMPOSITE_TREE_HPP
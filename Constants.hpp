@@ -5,4 +5,9 @@ const unsigned int TileSize = 128;
 const unsigned int BrushSize = 512;
 const unsigned int ThumbSize = 100;
 
+//Per-tile summary of pixel amounts (stroke value, or layer alpha):
+const unsigned char CoverageEmpty = 0; //every pixel is 0 (or there's no tile at all)
+const unsigned char CoverageFull = 1; //every pixel is 255
+const unsigned char CoverageMixed = 2; //anything else
+
 #endif //CONSTANTS_HPP
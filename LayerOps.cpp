@@ -4,14 +4,16 @@
 #include <cstdlib>
 #include <iostream>
 
-#include "sse_compose.hpp"
+#include "simd_compose.hpp"
 
 class OverOp : public LayerOp {
 public:
+	OverOp() : kernel(compose_kernels().over) {
+	}
 	virtual ~OverOp() {
 	}
 	virtual void compose(uint32_t const *bg_tile, uint32_t const *fg_tile, uint32_t *into_tile, uint32_t count) const {
-		sse_compose(bg_tile, fg_tile, into_tile, count);
+		kernel(bg_tile, fg_tile, into_tile, count);
 	}
 	virtual std::string shorthand() const {
 		return "o";
@@ -19,6 +21,7 @@ public:
 	virtual std::string desc() const {
 		return "over";
 	}
+	ComposeFn kernel;
 
 };
 
@@ -29,13 +32,15 @@ const LayerOp *LayerOp::over() {
 
 class MultiplyOp : public LayerOp {
 public:
+	MultiplyOp() : kernel(compose_kernels().multiply) {
+	}
 	virtual ~MultiplyOp() {
 	}
 	virtual void compose(uint32_t const *bg_tile, uint32_t const *fg_tile, uint32_t *into_tile, uint32_t count) const {
 		assert(bg_tile);
 		assert(fg_tile);
 		assert(into_tile);
-		sse_multiply(bg_tile, fg_tile, into_tile, count);
+		kernel(bg_tile, fg_tile, into_tile, count);
 	}
 	virtual std::string shorthand() const {
 		return "*";
@@ -43,6 +48,7 @@ public:
 	virtual std::string desc() const {
 		return "multiply";
 	}
+	ComposeFn kernel;
 
 };
 
@@ -67,3 +73,47 @@ std::vector< std::string > LayerOp::op_shorthands() {
 	ret.push_back(multiply()->shorthand());
 	return ret;
 }
+
+namespace {
+const unsigned int MaxFusedLayers = 128;
+
+void flush_stack(StackLayer *stack, unsigned int &stack_size, uint32_t *into, uint32_t count) {
+	if (stack_size == 0) return;
+	for (unsigned int l = stack_size - 1; l < stack_size; --l) {
+		stack[l].run = 1;
+		if (l + 1 < stack_size && stack[l + 1].multiply == stack[l].multiply) {
+			stack[l].run += stack[l + 1].run;
+		}
+	}
+	compose_kernels().stack(stack, stack_size, into, count);
+	stack_size = 0;
+}
+}
+
+void LayerOp::compose_stack(std::vector< unsigned int > const &order, std::vector< std::pair< const LayerOp *, const uint32_t * > > const &layers, unsigned int base, uint32_t *into, uint32_t count) {
+	if (order.empty()) return;
+	compose_stack(&order[0], order.size(), layers, base, into, count);
+}
+
+void LayerOp::compose_stack(unsigned int const *order, unsigned int order_size, std::vector< std::pair< const LayerOp *, const uint32_t * > > const &layers, unsigned int base, uint32_t *into, uint32_t count) {
+	StackLayer stack[MaxFusedLayers];
+	unsigned int stack_size = 0;
+	for (unsigned int const *o = order; o != order + order_size; ++o) {
+		assert(*o < layers.size());
+		//Don't composite 'NULL' of course:
+		if (!layers[*o].second) continue;
+		const LayerOp *op = layers[*o].first;
+		if (op == over() || op == multiply()) {
+			if (stack_size == MaxFusedLayers) {
+				flush_stack(stack, stack_size, into, count);
+			}
+			stack[stack_size].fg = layers[*o].second + base;
+			stack[stack_size].multiply = (op == multiply());
+			++stack_size;
+		} else {
+			flush_stack(stack, stack_size, into, count);
+			op->compose(into, layers[*o].second + base, into, count);
+		}
+	}
+	flush_stack(stack, stack_size, into, count);
+}
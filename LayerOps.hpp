@@ -7,6 +7,7 @@
 
 #include <string>
 #include <vector>
+#include <utility>
 
 /*
  * Big note: for speed purposes, all Ops can assume background has opaque alpha.
@@ -22,6 +23,21 @@ static const LayerOp *over();
 static const LayerOp *multiply();
 static const LayerOp *named_op(std::string const &name);
 static std::vector< std::string > op_shorthands();
+
+//True if 'layer' (whose tile has Coverage* value 'coverage') replaces
+// whatever is under it -- it's an opaque 'over' -- so compositing can
+// start from it:
+static bool hides_below(std::pair< const LayerOp *, const uint32_t * > const &layer, uint8_t coverage) {
+	return layer.second && layer.first == over() && coverage == CoverageFull;
+}
+
+//Composite layers[order[0]], layers[order[1]], ... (bottom to top) into
+// 'into', reading each layer from pixel 'base'. NULL layers are skipped.
+//over/multiply layers go through the fused stack kernel, which keeps
+// each chunk of pixels in registers for the whole stack.
+static void compose_stack(std::vector< unsigned int > const &order, std::vector< std::pair< const LayerOp *, const uint32_t * > > const &layers, unsigned int base, uint32_t *into, uint32_t count = TileSize * TileSize);
+//same, for layers order[0] .. order[order_size-1]:
+static void compose_stack(unsigned int const *order, unsigned int order_size, std::vector< std::pair< const LayerOp *, const uint32_t * > > const &layers, unsigned int base, uint32_t *into, uint32_t count = TileSize * TileSize);
 };
 
 #endif //LAYER_OPS_HPP
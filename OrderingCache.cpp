@@ -0,0 +1,88 @@
+#include "OrderingCache.hpp"
+#include "StackOps.hpp"
+
+#include <cassert>
+
+using std::make_pair;
+
+OrderingCache::OrderingCache(unsigned int _max_orderings) : hits(0), misses(0), flushes(0), max_orderings(_max_orderings), layer_count(-1U) {
+}
+
+uint32_t OrderingCache::begin_tile(unsigned int _layer_count) {
+	if (_layer_count != layer_count || orderings.size() > max_orderings) {
+		if (!orderings.empty()) {
+			++flushes;
+		}
+		clear();
+		layer_count = _layer_count;
+	}
+	if (orderings.empty()) {
+		//fill up starting order:
+		LayerToOrder starting;
+		starting.resize(layer_count, -1U);
+		for (unsigned int l = 0; l < starting.size(); ++l) {
+			starting[l] = l;
+		}
+		intern(starting);
+	}
+	//starting order always gets the first id:
+	return 0;
+}
+
+uint32_t OrderingCache::intern(LayerToOrder const &l2o) {
+	assert(l2o.size() == layer_count);
+	LayerToOrderToInd::iterator f = ids.find(l2o);
+	if (f != ids.end()) {
+		return f->second;
+	}
+	uint32_t id = orderings.size();
+	orderings.push_back(l2o);
+	ids.insert(make_pair(l2o, id));
+	return id;
+}
+
+uint32_t OrderingCache::apply(uint32_t id, const StackOp *op) {
+	assert(id < orderings.size());
+	std::pair< uint32_t, const StackOp * > key = make_pair(id, op);
+	TransitionToInd::iterator f = transitions.find(key);
+	if (f != transitions.end()) {
+		++hits;
+		return f->second;
+	}
+	++misses;
+	scratch = orderings[id];
+	op->apply(scratch.size(), &scratch[0]);
+	uint32_t result = intern(scratch);
+	transitions.insert(make_pair(key, result));
+	return result;
+}
+
+uint32_t OrderingCache::project(uint32_t id, std::vector< bool > const &keep) {
+	assert(id < orderings.size());
+	assert(keep.size() == layer_count);
+	LayerToOrder const &from = orderings[id];
+	order_scratch.assign(layer_count, -1U);
+	for (unsigned int l = 0; l < layer_count; ++l) {
+		assert(from[l] < layer_count);
+		order_scratch[from[l]] = l;
+	}
+	scratch.resize(layer_count);
+	unsigned int at = 0;
+	for (unsigned int l = 0; l < layer_count; ++l) {
+		if (!keep[l]) {
+			scratch[l] = at++;
+		}
+	}
+	for (unsigned int i = 0; i < layer_count; ++i) {
+		if (keep[order_scratch[i]]) {
+			scratch[order_scratch[i]] = at++;
+		}
+	}
+	return intern(scratch);
+}
+
+void OrderingCache::clear() {
+	orderings.clear();
+	ids.clear();
+	transitions.clear();
+}
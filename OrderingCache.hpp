@@ -0,0 +1,99 @@
+#ifndef ORDERING_CACHE_HPP
+#define ORDERING_CACHE_HPP
+
+#include <stdint.h>
+#include <cstddef>
+
+#include <vector>
+#include <utility>
+
+#ifdef WIN32
+#include <unordered_map>
+#else
+#include <tr1/unordered_map>
+#endif
+
+class StackOp;
+
+//layer_to_order[layer] == position of layer in the stack (0 == bottom).
+class LayerToOrder : public std::vector< unsigned int > {
+public:
+	LayerToOrder() { }
+};
+
+class HashLayerToOrder {
+public:
+	size_t operator()(LayerToOrder const &o) const {
+		size_t ret = 0;
+		for (unsigned int i = 0; i < o.size(); ++i) {
+			ret ^= ( (ret << 5) | (ret >> (sizeof(size_t)*8-5)) ) ^ o[i];
+		}
+		return ret;
+	}
+};
+
+class HashTransition {
+public:
+	size_t operator()(std::pair< uint32_t, const StackOp * > const &t) const {
+		return size_t(t.first) * 2654435761U ^ (size_t(t.second) >> 4);
+	}
+};
+
+//Interns orderings (LayerToOrder's) and remembers the result of applying a
+// StackOp to each, so that a stroke transition is a single table lookup.
+//Meant to be kept around (one per renderer thread -- it isn't locked) and
+// shared across blocks, tiles, and packets.
+class OrderingCache {
+public:
+	static const unsigned int DefaultMaxOrderings = 1 << 16;
+
+	OrderingCache(unsigned int max_orderings = DefaultMaxOrderings);
+
+	//Call at the start of every tile. Flushes the table if the layer count
+	// changed or if the table has outgrown max_orderings (it may grow past
+	// that within a tile, since ids handed out must stay valid until then).
+	//Returns the id of the starting (identity) ordering.
+	uint32_t begin_tile(unsigned int layer_count);
+
+	uint32_t intern(LayerToOrder const &l2o);
+	//id of the ordering produced by running op on ordering id:
+	uint32_t apply(uint32_t id, const StackOp *op);
+	//id of ordering id with the layers not in 'keep' moved to the bottom (in
+	// layer order) and the rest left in the same order above them:
+	uint32_t project(uint32_t id, std::vector< bool > const &keep);
+
+	LayerToOrder const &ordering(uint32_t id) const {
+		return orderings[id];
+	}
+	unsigned int size() const {
+		return orderings.size();
+	}
+	void clear();
+
+	//stats:
+	uint64_t hits; //transitions found in table
+	uint64_t misses; //transitions that needed StackOp::apply
+	uint64_t flushes; //times the table was cleared
+	float hit_rate() const {
+		if (hits + misses == 0) return 0.0f;
+		return hits / float(hits + misses);
+	}
+
+private:
+#ifdef WIN32
+	typedef std::unordered_map< LayerToOrder, uint32_t, HashLayerToOrder > LayerToOrderToInd;
+	typedef std::unordered_map< std::pair< uint32_t, const StackOp * >, uint32_t, HashTransition > TransitionToInd;
+#else
+	typedef std::tr1::unordered_map< LayerToOrder, uint32_t, HashLayerToOrder > LayerToOrderToInd;
+	typedef std::tr1::unordered_map< std::pair< uint32_t, const StackOp * >, uint32_t, HashTransition > TransitionToInd;
+#endif
+	unsigned int max_orderings;
+	unsigned int layer_count;
+	std::vector< LayerToOrder > orderings;
+	LayerToOrderToInd ids;
+	TransitionToInd transitions;
+	LayerToOrder scratch;
+	std::vector< unsigned int > order_scratch;
+};
+
+#endif //ORDERING_CACHE_HPP
@@ -1,28 +1,119 @@
 #include "Renderer.hpp"
 
 #include "Constants.hpp"
-#include "update_tile_trimmed.hpp"
+#include "update_tile_uniform.hpp"
 
 #include "LayerOps.hpp"
 
 #include <QCoreApplication>
 #include <QThread>
+#include <QMutex>
 
 #include <cassert>
 #include <cstdlib>
+#include <algorithm>
+#include <iostream>
 
-RenderPacket::RenderPacket() : at(make_vector(-1U,-1U)), type(RESULT) {
+RenderPacket::RenderPacket() : at(make_vector(-1U,-1U)), level(0), split_blocks(false), samples(0), draft(false), exact(false), type(RESULT) {
 }
 
+namespace {
+//more than enough for every packet the canvas keeps in flight:
+const unsigned int MaxSparePackets = 256;
+QMutex spare_packets_lock;
+std::vector< RenderPacket * > spare_packets;
+QAtomicInt packets_created(0);
+QAtomicInt packets_recycled(0);
+
+TilePool &packet_pool() {
+	return tile_pool< RenderPacket >("render packets");
+}
+}
+
+RenderPacket *RenderPacket::create() {
+	packets_created.ref();
+	{
+		QMutexLocker locker(&spare_packets_lock);
+		if (!spare_packets.empty()) {
+			RenderPacket *packet = spare_packets.back();
+			spare_packets.pop_back();
+			packets_recycled.ref();
+			return packet;
+		}
+	}
+	return new RenderPacket();
+}
+
+void RenderPacket::recycle(RenderPacket *packet) {
+	if (!packet) return;
+	//back to as-constructed, but keeping storage:
+	packet->layers.clear();
+	packet->layer_coverage.clear();
+	packet->strokes.clear();
+	packet->stroke_coverage.clear();
+	packet->layer_tiles.clear();
+	packet->stroke_tiles.clear();
+	packet->at = make_vector(-1U,-1U);
+	packet->level = 0;
+	packet->split_blocks = false;
+	packet->samples = 0;
+	packet->draft = false;
+	packet->exact = false;
+	packet->type = RESULT;
+	{
+		QMutexLocker locker(&spare_packets_lock);
+		if (spare_packets.size() < MaxSparePackets) {
+			if (spare_packets.capacity() < MaxSparePackets) {
+				spare_packets.reserve(MaxSparePackets);
+			}
+			spare_packets.push_back(packet);
+			return;
+		}
+	}
+	delete packet;
+}
+
+void *RenderPacket::operator new(size_t size) {
+	assert(size == sizeof(RenderPacket));
+	return packet_pool().allocate();
+}
+
+void RenderPacket::operator delete(void *packet) {
+	packet_pool().release(packet);
+}
+
+void RenderPacket::add_layer(const LayerOp *op, TileRef< uint32_t > const &tile, uint8_t coverage) {
+	layers.push_back(std::make_pair(op, tile.get()));
+	layer_coverage.push_back(coverage);
+	if (tile.get()) {
+		layer_tiles.push_back(tile);
+	}
+}
+
+void RenderPacket::add_stroke(const StackOp *op, TileRef< uint8_t > const &tile, uint8_t coverage) {
+	strokes.push_back(std::make_pair(op, tile.get()));
+	stroke_coverage.push_back(coverage);
+	if (tile.get()) {
+		stroke_tiles.push_back(tile);
+	}
+}
+
+void report_allocations(std::ostream &into) {
+	into << "render packets: " << int(packets_recycled) << " of " << int(packets_created) << " requests recycled." << std::endl;
+	TilePool::report(into);
+}
 
 QEvent::Type RendererReadyEventType = QEvent::None;
 QEvent::Type RendererRequestEventType = QEvent::None;
+QEvent::Type TilesReadyEventType = QEvent::None;
 
 void setup_renderer_event_types() {
 	assert(RendererReadyEventType == QEvent::None);
 	assert(RendererRequestEventType == QEvent::None);
+	assert(TilesReadyEventType == QEvent::None);
 	RendererReadyEventType = static_cast< QEvent::Type >(QEvent::registerEventType());
 	RendererRequestEventType = static_cast< QEvent::Type >(QEvent::registerEventType());
+	TilesReadyEventType = static_cast< QEvent::Type >(QEvent::registerEventType());
 }
 
 RendererReadyEvent::RendererReadyEvent(Renderer *_renderer, RenderPacket *_completed) : QEvent(RendererReadyEventType), renderer(_renderer), completed(_completed) {
@@ -39,16 +130,17 @@ RendererRequestEvent::RendererRequestEvent(RenderPacket *_request) : QEvent(Rend
 RendererRequestEvent::~RendererRequestEvent() {
 }
 
+TilesReadyEvent::TilesReadyEvent() : QEvent(TilesReadyEventType) {
+	assert(TilesReadyEventType != QEvent::None);
+}
 
-Renderer::Renderer(QObject *_canvas) : canvas(_canvas), blocks(8), samples(10) {
-	//Tell the canvas it's got a ready renderer:
-	QCoreApplication::postEvent(canvas, new RendererReadyEvent(this, NULL));
+TilesReadyEvent::~TilesReadyEvent() {
 }
 
-Renderer::~Renderer() {
+TileRenderer::TileRenderer() : rendered(0), uniform_rendered(0), drafts_rendered(0) {
 }
 
-void Renderer::set_blocks(int new_blocks) {
+unsigned int TileRenderer::round_blocks(int new_blocks) {
 	if (new_blocks < 1) new_blocks = 1;
 	if (new_blocks > 64) new_blocks = 64;
 	unsigned int best_val = 1;
@@ -58,6 +150,90 @@ void Renderer::set_blocks(int new_blocks) {
 		}
 	}
 	assert(best_val <= 64);
+	return best_val;
+}
+
+unsigned int TileRenderer::clamp_samples(int new_samples) {
+	if (new_samples < 1) new_samples = 1;
+	if (new_samples > 1000) new_samples = 1000;
+	return new_samples;
+}
+
+unsigned int TileRenderer::clamp_energy(int parts_per_million) {
+	if (parts_per_million < 1) parts_per_million = 1;
+	if (parts_per_million > 1000000) parts_per_million = 1000000;
+	return parts_per_million;
+}
+
+unsigned int TileRenderer::refine_samples(unsigned int have, unsigned int target) {
+	assert(have < target);
+	unsigned int next = FirstRefineSamples;
+	while (next <= have) {
+		next *= 4;
+	}
+	//(a rung less than half the way to target isn't worth stopping at)
+	return (next * 2 >= target ? target : next);
+}
+
+void TileRenderer::render(RenderPacket *packet, unsigned int blocks, unsigned int samples, float keep_energy) {
+	if (render_uniform(packet)) return;
+	if (packet->draft) {
+		++drafts_rendered;
+		collect_live_strokes(packet);
+		update_tile_sampled(packet->layers, live_strokes, packet->out, (packet->samples ? packet->samples : DraftSamples), TileSize * TileSize / blocks, &orderings, &composites, &draft_scratch, &packet->layer_coverage);
+		return;
+	}
+	render_blocks(packet, blocks, samples, 0, blocks, keep_energy);
+}
+
+bool TileRenderer::render_uniform(RenderPacket *packet) {
+	assert(packet);
+	assert(packet->stroke_coverage.size() == packet->strokes.size());
+	++rendered;
+	bool uniform = update_tile_uniform(packet->layers, packet->strokes, packet->stroke_coverage, packet->out, &orderings, &uniform_order, &packet->layer_coverage);
+	if (uniform) {
+		++uniform_rendered;
+	}
+	packet->exact = uniform;
+	return uniform;
+}
+
+void TileRenderer::report_stats(std::ostream &into) const {
+	double solved = std::max(1U, rendered - uniform_rendered);
+	into << "Renderer " << this << ": " << uniform_rendered << " of " << rendered << " packets were uniform, " << drafts_rendered << " drafts; " << orderings.size() << " cached orderings, " << int(orderings.hit_rate() * 100.0f) << "% transition hits, " << orderings.flushes << " flushes; " << composites.saved() / solved << " of " << composites.naive_composites / solved << " layer composites per tile saved by prefix sharing, " << composites.occluded_layers / solved << " hidden under opaque layers; " << composites.merged_orderings / solved << " orderings per tile merged; " << scratch.collapsed / solved << " stackings per tile collapsed; " << scratch.mean_kept() << " coefficients per pixel (at most " << scratch.max_kept << ")." << std::endl;
+}
+
+void TileRenderer::render_blocks(RenderPacket *packet, unsigned int blocks, unsigned int samples, unsigned int first_block, unsigned int end_block, float keep_energy) {
+	assert(packet);
+	assert(!packet->draft);
+	collect_live_strokes(packet);
+	if (packet->samples) {
+		samples = packet->samples;
+	}
+	update_tile_trimmed_blocks(packet->layers, live_strokes, packet->out, samples, TileSize * TileSize / blocks, first_block, end_block, &orderings, &composites, &scratch, &packet->layer_coverage, false, keep_energy);
+}
+
+void TileRenderer::collect_live_strokes(RenderPacket const *packet) {
+	assert(packet->stroke_coverage.size() == packet->strokes.size());
+	//strokes that are zero everywhere can't change anything:
+	live_strokes.clear();
+	for (unsigned int s = 0; s < packet->strokes.size(); ++s) {
+		if (packet->stroke_coverage[s] != CoverageEmpty) {
+			live_strokes.push_back(packet->strokes[s]);
+		}
+	}
+}
+
+Renderer::Renderer(QObject *_canvas) : canvas(_canvas), blocks(8), samples(10) {
+	//Tell the canvas it's got a ready renderer:
+	QCoreApplication::postEvent(canvas, new RendererReadyEvent(this, NULL));
+}
+
+Renderer::~Renderer() {
+}
+
+void Renderer::set_blocks(int new_blocks) {
+	unsigned int best_val = TileRenderer::round_blocks(new_blocks);
 	if (blocks != best_val) {
 		blocks = best_val;
 		emit blocks_changed(int(blocks));
@@ -65,10 +241,9 @@ void Renderer::set_blocks(int new_blocks) {
 	}
 }
 
-void Renderer::set_samples(int new_samples) {
-	if (new_samples < 1) new_samples = 1;
-	if (new_samples > 1000) new_samples = 1000;
-	if (samples != (unsigned int)new_samples) {
+void Renderer::set_samples(int _new_samples) {
+	unsigned int new_samples = TileRenderer::clamp_samples(_new_samples);
+	if (samples != new_samples) {
 		samples = new_samples;
 		emit samples_changed(int(samples));
 		std::cerr << "Render switches to " << samples << " samples." << std::endl;
@@ -90,13 +265,12 @@ void Renderer::customEvent(QEvent *e) {
 }
 
 void Renderer::render(RenderPacket *packet) {
-	assert(packet);
-	update_tile_trimmed(packet->layers, packet->strokes, packet->out, samples, TileSize * TileSize / blocks);
+	tiles.render(packet, blocks, samples);
 }
 
 
 
-RendererThread::RendererThread(QObject *_canvas, Misc *_control) : QThread(), canvas(_canvas), control(_control) {
+RendererThread::RendererThread(QObject *_canvas, QObject *_control) : QThread(), canvas(_canvas), control(_control) {
 }
 
 RendererThread::~RendererThread() {
@@ -109,7 +283,7 @@ void RendererThread::run() {
 	exec();
 }
 
-QThread *start_renderer(QObject *canvas, Misc *control) {
+QThread *start_renderer(QObject *canvas, QObject *control) {
 	QThread *thread = new RendererThread(canvas, control);
 	thread->setStackSize(8 * 1024 * 1024); //eight meg of stack should be enough.
 	thread->start();
@@ -2,7 +2,11 @@
 #define RENDERER_HPP
 
 #include "Constants.hpp"
-#include "Misc.hpp"
+#include "OrderingCache.hpp"
+#include "CompositeTree.hpp"
+#include "TileRef.hpp"
+#include "update_tile_trimmed.hpp"
+#include "update_tile_sampled.hpp"
 
 #include <Vector/Vector.hpp>
 
@@ -12,6 +16,7 @@
 
 #include <vector>
 #include <utility>
+#include <iostream>
 
 class LayerOp;
 class StackOp;
@@ -19,18 +24,44 @@ class StackOp;
 class RenderPacket {
 public:
 	RenderPacket();
+	//Packets live in a TilePool; create() hands out a recycled one when it
+	// can, with its vectors' storage intact, so the canvas's steady stream
+	// of requests doesn't allocate:
+	static RenderPacket *create();
+	static void recycle(RenderPacket *packet); //drops its tile refs
+	static void *operator new(size_t size);
+	static void operator delete(void *packet);
+	uint32_t out[TileSize * TileSize]; //first, so it's 64-byte aligned
+	//append a layer/stroke, keeping the given tile version alive (and
+	// unchanged) until the packet is deleted:
+	void add_layer(const LayerOp *op, TileRef< uint32_t > const &tile, uint8_t coverage);
+	void add_stroke(const StackOp *op, TileRef< uint8_t > const &tile, uint8_t coverage);
 	std::vector< std::pair< const LayerOp *, const uint32_t * > > layers;
+	std::vector< uint8_t > layer_coverage; //Coverage* value for each layer tile (CoverageFull == opaque)
 	std::vector< std::pair< const StackOp *, const uint8_t * > > strokes;
-	uint32_t out[TileSize * TileSize];
-	Vector2ui at;
+	std::vector< uint8_t > stroke_coverage; //Coverage* value for each stroke tile
+	std::vector< TileRef< uint32_t > > layer_tiles; //what layers/strokes point into
+	std::vector< TileRef< uint8_t > > stroke_tiles;
+	Vector2ui at; //in tiles of 'level'
+	unsigned int level; //mip level the layers and strokes come from (0 == full resolution)
+	bool split_blocks; //latency-critical: spread the tile's blocks over the worker pool
+	//coefficients to keep (0 == the renderer's current setting); a draft is a
+	// quick update_tile_sampled solve with 'samples' samples instead:
+	unsigned int samples;
+	bool draft;
+	bool exact; //set by the renderer if out doesn't depend on samples (e.g. uniform tiles)
 	static const unsigned int ZERO = 0;
 	static const unsigned int ONE = 1;
 	static const unsigned int RESULT = 2;
 	unsigned int type;
 };
 
+//Packet recycling and TilePool stats, a line per pool:
+void report_allocations(std::ostream &into);
+
 extern QEvent::Type RendererReadyEventType;
 extern QEvent::Type RendererRequestEventType;
+extern QEvent::Type TilesReadyEventType;
 
 //call on main thread:
 void setup_renderer_event_types();
@@ -54,6 +85,53 @@ public:
 	RenderPacket *request; //now "owned" by Renderer until Renderer
 };
 
+//Sent from TileScheduler -> canvas when completed packets start waiting;
+// one event covers every completion until TileScheduler::take_completed.
+class TilesReadyEvent : public QEvent {
+public:
+	TilesReadyEvent();
+	virtual ~TilesReadyEvent();
+};
+
+//Solver state for one rendering thread (caches aren't locked, so don't share):
+class TileRenderer {
+public:
+	TileRenderer();
+	//(keep_energy as for update_tile_trimmed; 1 keeps 'samples' coefficients.
+	// The packet's own samples, if set, win over 'samples'.)
+	void render(RenderPacket *packet, unsigned int blocks, unsigned int samples, float keep_energy = 1.0f);
+	//render() in pieces: the uniform fast path (returns false if it doesn't
+	// apply), then the solver on blocks [first_block, end_block) of 'blocks'
+	// (drafts aren't split, so aren't rendered this way):
+	bool render_uniform(RenderPacket *packet);
+	void render_blocks(RenderPacket *packet, unsigned int blocks, unsigned int samples, unsigned int first_block, unsigned int end_block, float keep_energy = 1.0f);
+	//a line of cache and solver stats (not locked; call from the renderer's thread, or once it's done):
+	void report_stats(std::ostream &into) const;
+	//settings, as the renderers will use them:
+	static unsigned int round_blocks(int blocks); //nearest power of two in [1,64]
+	static unsigned int clamp_samples(int samples); //[1,1000]
+	static unsigned int clamp_energy(int parts_per_million); //[1,1000000]
+	//Progressive rendering climbs a ladder: a draft, then coefficient
+	// counts going up by 4x from FirstRefineSamples, then 'target' itself.
+	//The rung above a tile rendered with 'have' coefficients (0 == draft):
+	static const unsigned int DraftSamples = 4;
+	static const unsigned int FirstRefineSamples = 5;
+	static unsigned int refine_samples(unsigned int have, unsigned int target);
+	//stacking orders seen by this renderer:
+	OrderingCache orderings;
+	//pre-composite buffers and prefix-sharing stats:
+	CompositeTree composites;
+	//solver storage, kept so rendering doesn't allocate once warmed up:
+	TrimmedScratch scratch;
+	SampledScratch draft_scratch;
+	std::vector< std::pair< const StackOp *, const uint8_t * > > live_strokes;
+	void collect_live_strokes(RenderPacket const *packet);
+	std::vector< unsigned int > uniform_order;
+	unsigned int rendered; //packets rendered
+	unsigned int uniform_rendered; //packets that took the uniform-stroke fast path
+	unsigned int drafts_rendered;
+};
+
 class Renderer : public QObject {
 	Q_OBJECT
 public:
@@ -72,20 +150,22 @@ public:
 	QObject *canvas;
 	unsigned int blocks;
 	unsigned int samples;
+	//(lives on the renderer's thread)
+	TileRenderer tiles;
 };
 
 class RendererThread : public QThread {
 	Q_OBJECT
 public:
-	RendererThread(QObject *canvas, Misc *control);
+	RendererThread(QObject *canvas, QObject *control);
 	virtual ~RendererThread();
 protected:
 	void run();
 	QObject *canvas;
-	Misc *control;
+	QObject *control; //has set_blocks(int) and set_samples(int) signals
 };
 
 
-QThread *start_renderer(QObject *canvas, Misc *control);
+QThread *start_renderer(QObject *canvas, QObject *control);
 
 #endif //RENDERER_HPP
@@ -0,0 +1,182 @@
+#include "Scene.hpp"
+
+#include "LayerOps.hpp"
+#include "StackOps.hpp"
+#include "Renderer.hpp"
+#include "default_bg.hpp"
+
+#include <cassert>
+#include <cstring>
+#include <iostream>
+
+using std::vector;
+using std::string;
+
+Scene::Scene() : pix_size(make_vector(0U, 0U)) {
+}
+
+Scene::~Scene() {
+	for (vector< Stroke * >::iterator s = strokes.begin(); s != strokes.end(); ++s) {
+		delete *s;
+	}
+	strokes.clear();
+	for (vector< Layer * >::iterator l = layers.begin(); l != layers.end(); ++l) {
+		delete *l;
+	}
+	layers.clear();
+}
+
+bool Scene::parse_arg(QStringList &args, bool *error) {
+	assert(error);
+	if (args.empty()) return false;
+	QString opt = args.front();
+	if (opt == "-l") {
+		args.pop_front();
+		if (args.size() < 3) {
+			std::cerr << "ERROR: Expecting '-l' to be followed by a name, mode, and image file." << std::endl;
+			args.clear();
+			*error = true;
+			return true;
+		}
+		QString name = args.front();
+		args.pop_front();
+		QString mode = args.front();
+		args.pop_front();
+		QString image = args.front();
+		args.pop_front();
+		const LayerOp *op = LayerOp::named_op(qPrintable(mode));
+		if (!op) {
+			std::cerr << "ERROR: Unrecognized layer mode '" << qPrintable(mode) << "'." << std::endl;
+			*error = true;
+			return true;
+		}
+		QImage loaded(image);
+		if (loaded.isNull()) {
+			std::cerr << "ERROR: Can't read image from '" << qPrintable(image) << "'." << std::endl;
+			*error = true;
+			return true;
+		}
+		string message = "";
+		if (!add_layer(loaded, qPrintable(name), op, &message)) {
+			std::cerr << "ERROR: " << message << std::endl;
+			*error = true;
+			return true;
+		}
+		std::cerr << "Layer " << (layers.size()-1) << " (\"" << layers.back()->name << "\") is '" << qPrintable(image) << "'." << std::endl;
+		return true;
+	} else if (opt == "-s") {
+		args.pop_front();
+		if (args.size() < 2) {
+			std::cerr << "ERROR: Expecting '-s' to be followed by an shorthand opspec and image file." << std::endl;
+			args.clear();
+			*error = true;
+			return true;
+		}
+		string spec = qPrintable(args.front());
+		args.pop_front();
+		QString image = args.front();
+		args.pop_front();
+
+		string message = "";
+		const StackOp *op = StackOp::from_shorthand(spec, layer_names(), &message);
+		if (op == NULL) {
+			std::cerr << "ERROR: Invalid shorthand '" << spec << "': " << message << std::endl;
+			*error = true;
+			return true;
+		}
+		QImage loaded(image);
+		if (loaded.isNull()) {
+			std::cerr << "ERROR: Can't read image from '" << qPrintable(image) << "'." << std::endl;
+			*error = true;
+			return true;
+		}
+		std::cerr << "Stroke " << strokes.size() << " is '" << qPrintable(image) << "', and does '" << op->shorthand(layer_names()) << "' == \"" << op->description(layer_names()) << "\"" << std::endl;
+		add_stroke(loaded, op);
+		return true;
+	}
+	return false;
+}
+
+bool Scene::add_layer(QImage const &from, string const &name, const LayerOp *op, string *error) {
+	vector< string > names = layer_names();
+	for (vector< string >::iterator n = names.begin(); n != names.end(); ++n) {
+		if (*n == name) {
+			if (error) {
+				*error = "Layer name '" + name + "' isn't unique.";
+			}
+			return false;
+		}
+	}
+	if ((int)pix_size.x < from.width()) {
+		pix_size.x = from.width();
+	}
+	if ((int)pix_size.y < from.height()) {
+		pix_size.y = from.height();
+	}
+	layers.push_back(new Layer(name, from, op));
+	return true;
+}
+
+void Scene::add_stroke(QImage const &from, const StackOp *op) {
+	if ((int)pix_size.x < from.width()) {
+		pix_size.x = from.width();
+	}
+	if ((int)pix_size.y < from.height()) {
+		pix_size.y = from.height();
+	}
+	strokes.push_back(new Stroke(from, op));
+}
+
+vector< string > Scene::layer_names() const {
+	vector< string > names;
+	for (vector< Layer * >::const_iterator l = layers.begin(); l != layers.end(); ++l) {
+		names.push_back((*l)->name);
+	}
+	return names;
+}
+
+Vector2ui Scene::tiles() const {
+	return make_vector((pix_size.x + TileSize - 1) / TileSize, (pix_size.y + TileSize - 1) / TileSize);
+}
+
+RenderPacket *Scene::result_packet(Vector2ui at) const {
+	RenderPacket *pkt = RenderPacket::create();
+	pkt->at = at;
+	pkt->type = RenderPacket::RESULT;
+	for (vector< Layer * >::const_iterator l = layers.begin(); l != layers.end(); ++l) {
+		pkt->add_layer((*l)->op, (*l)->get_ref(pkt->at), (*l)->get_coverage(pkt->at));
+	}
+	for (vector< Stroke * >::const_iterator s = strokes.begin(); s != strokes.end(); ++s) {
+		if ((*s)->get_tile_or_null(pkt->at)) {
+			pkt->add_stroke((*s)->op, (*s)->get_ref(pkt->at), (*s)->get_coverage(pkt->at));
+		}
+	}
+	memcpy(&(pkt->out[0]), default_bg(), sizeof(uint32_t) * TileSize * TileSize);
+	return pkt;
+}
+
+vector< RenderPacket * > Scene::result_workload() const {
+	vector< RenderPacket * > workload;
+	const Vector2ui size = tiles();
+	for (unsigned int y = 0; y < size.y; ++y) {
+		for (unsigned int x = 0; x < size.x; ++x) {
+			workload.push_back(result_packet(make_vector(x, y)));
+		}
+	}
+	return workload;
+}
+
+void Scene::store_result(RenderPacket const *packet, uint32_t *pix) const {
+	assert(packet);
+	assert(pix);
+	const unsigned int x0 = packet->at.x * TileSize;
+	const unsigned int y0 = packet->at.y * TileSize;
+	for (unsigned int y = y0; y < y0 + TileSize && y < pix_size.y; ++y) {
+		uint32_t const *row = &(packet->out[(y - y0) * TileSize]);
+		uint32_t *line = pix + y * pix_size.x;
+		for (unsigned int x = x0; x < x0 + TileSize && x < pix_size.x; ++x) {
+			uint32_t val = row[x - x0];
+			line[x] = 0xff000000 | (val & 0xff) << 16 | (val & 0x0000ff00) | ((val >> 16) & 0xff);
+		}
+	}
+}
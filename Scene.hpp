@@ -0,0 +1,51 @@
+#ifndef SCENE_HPP
+#define SCENE_HPP
+
+#include "Tiled.hpp"
+
+#include <Vector/Vector.hpp>
+
+#include <QStringList>
+
+#include <string>
+#include <vector>
+
+class LayerOp;
+class StackOp;
+class RenderPacket;
+
+//Layers and strokes to render without a Canvas (for the command-line tools).
+// Owns its layers and strokes.
+class Scene {
+public:
+	Scene();
+	~Scene();
+	Scene &operator=(Scene const &o); //not defined
+
+	//Handles '-l name mode image' or '-s spec image' at the front of args
+	// (removing them). Returns false if args doesn't start with either;
+	// sets *error (and leaves the scene alone) if they can't be loaded.
+	bool parse_arg(QStringList &args, bool *error);
+
+	//false (with a message in *error) if name isn't unique:
+	bool add_layer(QImage const &from, std::string const &name, const LayerOp *op, std::string *error);
+	void add_stroke(QImage const &from, const StackOp *op);
+
+	std::vector< std::string > layer_names() const;
+	//size in tiles:
+	Vector2ui tiles() const;
+	//A RESULT packet (from RenderPacket::create) for tile 'at', with out set to
+	// the default background:
+	RenderPacket *result_packet(Vector2ui at) const;
+	//One for every tile, in scanline order:
+	std::vector< RenderPacket * > result_workload() const;
+	//Copy a rendered packet into pix (pix_size.x * pix_size.y, 0xffRRGGBB as
+	// QImage::Format_RGB32 wants):
+	void store_result(RenderPacket const *packet, uint32_t *pix) const;
+
+	std::vector< Layer * > layers;
+	std::vector< Stroke * > strokes;
+	Vector2ui pix_size; //big enough for every layer and stroke
+};
+
+#endif //SCENE_HPP
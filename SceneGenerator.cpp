@@ -0,0 +1,291 @@
+#include "SceneGenerator.hpp"
+
+#include "Scene.hpp"
+#include "LayerOps.hpp"
+#include "StackOps.hpp"
+
+#include <cassert>
+#include <cmath>
+#include <cstdlib>
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+
+using std::vector;
+using std::string;
+
+namespace {
+
+const float Pi = 3.14159265f;
+
+//Small LCG, so scenes don't depend on the platform's rand():
+class Rng {
+public:
+	Rng(uint32_t seed) : state(seed * 2654435761U + 1) {
+	}
+	uint32_t next() {
+		state = state * 1664525U + 1013904223U;
+		return state >> 8;
+	}
+	//[0, n):
+	unsigned int below(unsigned int n) {
+		assert(n > 0);
+		return next() % n;
+	}
+	//[0, 1):
+	float uniform() {
+		return (next() & 0xffff) / 65536.0f;
+	}
+	uint32_t state;
+};
+
+//A soft-edged disc:
+class Blob {
+public:
+	float x, y;
+	float radius; //fully 'inside' this close
+	float fade; //then fading to nothing over this distance
+	float amount(float px, float py) const {
+		float d = sqrtf((px - x) * (px - x) + (py - y) * (py - y));
+		if (d <= radius) return 1.0f;
+		if (d >= radius + fade) return 0.0f;
+		return 1.0f - (d - radius) / fade;
+	}
+};
+
+//1-4 blobs that cover (roughly, since they may overlap) 'coverage' of the image:
+vector< Blob > make_blobs(Rng &rng, unsigned int width, unsigned int height, float coverage, float softness) {
+	vector< Blob > blobs;
+	if (coverage <= 0.0f) return blobs;
+	const unsigned int count = 1 + rng.below(4);
+	//pi * (radius + fade / 2)^2 per blob:
+	const float reach = sqrtf(coverage * width * height / (count * Pi));
+	for (unsigned int i = 0; i < count; ++i) {
+		Blob b;
+		b.x = rng.uniform() * width;
+		b.y = rng.uniform() * height;
+		b.fade = std::max(1.0f, reach * softness);
+		b.radius = std::max(0.0f, reach - b.fade * 0.5f);
+		blobs.push_back(b);
+	}
+	return blobs;
+}
+
+float blob_amount(vector< Blob > const &blobs, float px, float py) {
+	float amt = 0.0f;
+	for (vector< Blob >::const_iterator b = blobs.begin(); b != blobs.end(); ++b) {
+		amt = std::max(amt, b->amount(px, py));
+	}
+	return amt;
+}
+
+//A random shorthand using up to the complexity limits in params:
+string random_shorthand(Rng &rng, vector< string > const &names, SceneParams const &params) {
+	assert(names.size() >= 2);
+	string ret = "";
+	const unsigned int phases = 1 + rng.below(std::max(1U, params.phases));
+	for (unsigned int p = 0; p < phases; ++p) {
+		vector< unsigned int > order(names.size());
+		for (unsigned int i = 0; i < order.size(); ++i) {
+			order[i] = i;
+		}
+		for (unsigned int i = order.size() - 1; i > 0; --i) {
+			std::swap(order[i], order[rng.below(i + 1)]);
+		}
+		unsigned int used = 0;
+		bool wild = false;
+		string phase = "";
+		const unsigned int partitions = 1 + rng.below(std::max(1U, params.partitions));
+		for (unsigned int part = 0; part < partitions; ++part) {
+			const char link = (rng.below(2) ? '<' : '>');
+			const unsigned int groups = 2 + rng.below(std::max(2U, params.chain) - 1);
+			vector< string > chain;
+			for (unsigned int g = 0; g < groups; ++g) {
+				if (!wild && rng.uniform() < params.wildcards) {
+					chain.push_back("*");
+					wild = true;
+					continue;
+				}
+				const unsigned int size = 1 + rng.below(std::max(1U, params.group));
+				string group = "";
+				for (unsigned int i = 0; i < size && used < order.size(); ++i) {
+					if (i) group += '&';
+					group += names[order[used++]];
+				}
+				if (group == "") break;
+				chain.push_back(group);
+			}
+			if (chain.size() < 2) break;
+			if (phase != "") phase += '|';
+			for (unsigned int g = 0; g < chain.size(); ++g) {
+				if (g) phase += link;
+				phase += chain[g];
+			}
+		}
+		if (phase == "") continue;
+		if (ret != "") ret += ';';
+		ret += phase;
+	}
+	return ret;
+}
+
+bool parse_float(string const &value, float *into) {
+	char *end = NULL;
+	*into = strtof(value.c_str(), &end);
+	return !value.empty() && *end == '\0';
+}
+
+//fractions and chances, in [0,1] (so NaN doesn't get through either):
+bool parse_fraction(string const &value, float *into) {
+	return parse_float(value, into) && *into >= 0.0f && *into <= 1.0f;
+}
+
+bool parse_uint(string const &value, unsigned int *into) {
+	char *end = NULL;
+	*into = strtoul(value.c_str(), &end, 10);
+	return !value.empty() && *end == '\0';
+}
+
+}
+
+SceneParams::SceneParams() : width(512), height(512), layers(8), strokes(8), seed(1), layer_density(0.5f), multiply(0.25f), opaque(0.0f), stroke_coverage(0.3f), stroke_softness(0.5f), phases(1), partitions(1), chain(2), group(1), wildcards(0.0f) {
+}
+
+bool SceneParams::set(string const &key, string const &value, string *error) {
+	bool ok = false;
+	unsigned int seed_value = 0;
+	if (key == "width") ok = parse_uint(value, &width) && width > 0;
+	else if (key == "height") ok = parse_uint(value, &height) && height > 0;
+	else if (key == "layers") ok = parse_uint(value, &layers);
+	else if (key == "strokes") ok = parse_uint(value, &strokes);
+	else if (key == "seed") {
+		ok = parse_uint(value, &seed_value);
+		seed = seed_value;
+	}
+	else if (key == "density") ok = parse_fraction(value, &layer_density);
+	else if (key == "multiply") ok = parse_fraction(value, &multiply);
+	else if (key == "opaque") ok = parse_fraction(value, &opaque);
+	else if (key == "coverage") ok = parse_fraction(value, &stroke_coverage);
+	else if (key == "softness") ok = parse_fraction(value, &stroke_softness);
+	else if (key == "phases") ok = parse_uint(value, &phases);
+	else if (key == "partitions") ok = parse_uint(value, &partitions);
+	else if (key == "chain") ok = parse_uint(value, &chain);
+	else if (key == "group") ok = parse_uint(value, &group);
+	else if (key == "wildcards") ok = parse_fraction(value, &wildcards);
+	else {
+		if (error) {
+			*error = "unknown scene parameter '" + key + "'";
+		}
+		return false;
+	}
+	if (!ok && error) {
+		*error = "bad value '" + value + "' for scene parameter '" + key + "'";
+	}
+	return ok;
+}
+
+string SceneParams::describe() const {
+	std::ostringstream str;
+	str << "width=" << width << ",height=" << height;
+	str << ",layers=" << layers << ",strokes=" << strokes << ",seed=" << seed;
+	str << ",density=" << layer_density << ",multiply=" << multiply << ",opaque=" << opaque;
+	str << ",coverage=" << stroke_coverage << ",softness=" << stroke_softness;
+	str << ",phases=" << phases << ",partitions=" << partitions << ",chain=" << chain << ",group=" << group << ",wildcards=" << wildcards;
+	return str.str();
+}
+
+bool parse_scene_sweep(string const &spec, vector< SceneParams > *into, string *error) {
+	assert(into);
+	vector< SceneParams > sweep(1);
+	std::istringstream str(spec);
+	string item;
+	while (std::getline(str, item, ',')) {
+		if (item == "") continue;
+		string::size_type eq = item.find('=');
+		if (eq == string::npos) {
+			if (error) {
+				*error = "expecting key=value, got '" + item + "'";
+			}
+			return false;
+		}
+		const string key = item.substr(0, eq);
+		vector< string > values;
+		{
+			std::istringstream vstr(item.substr(eq + 1));
+			string value;
+			while (std::getline(vstr, value, ':')) {
+				values.push_back(value);
+			}
+		}
+		if (values.empty()) {
+			values.push_back("");
+		}
+		vector< SceneParams > next;
+		for (vector< SceneParams >::iterator s = sweep.begin(); s != sweep.end(); ++s) {
+			for (vector< string >::iterator v = values.begin(); v != values.end(); ++v) {
+				next.push_back(*s);
+				if (!next.back().set(key, *v, error)) {
+					return false;
+				}
+			}
+		}
+		sweep = next;
+	}
+	into->insert(into->end(), sweep.begin(), sweep.end());
+	return true;
+}
+
+void generate_scene(SceneParams const &params, Scene *scene) {
+	assert(scene);
+	assert(scene->layers.empty() && scene->strokes.empty());
+	Rng rng(params.seed);
+	const Vector2ui pix_size = make_vector(params.width, params.height);
+	scene->pix_size = pix_size;
+
+	vector< uint32_t > pix(pix_size.x * pix_size.y);
+	for (unsigned int l = 0; l < params.layers; ++l) {
+		std::ostringstream name;
+		name << 'l' << l;
+		const LayerOp *op = (rng.uniform() < params.multiply ? LayerOp::multiply() : LayerOp::over());
+		vector< Blob > blobs = make_blobs(rng, pix_size.x, pix_size.y, params.layer_density, 0.1f);
+		const uint32_t color = rng.next() & 0xffffff;
+		float opacity = 0.5f + 0.5f * rng.uniform();
+		//(only drawn when asked for, so other scenes don't change)
+		if (params.opaque > 0.0f && rng.uniform() < params.opaque) {
+			opacity = 1.0f;
+		}
+		for (unsigned int y = 0; y < pix_size.y; ++y) {
+			for (unsigned int x = 0; x < pix_size.x; ++x) {
+				uint32_t alpha = uint32_t(255.0f * opacity * blob_amount(blobs, x + 0.5f, y + 0.5f));
+				//a little texture, so pixels aren't all the same color:
+				uint32_t c = (color + (x ^ y) * 0x010101) & 0xffffff;
+				pix[y * pix_size.x + x] = (alpha ? (alpha << 24) | c : 0);
+			}
+		}
+		Layer *layer = new Layer(name.str(), pix_size, op);
+		layer->set(pix_size, &pix[0]);
+		scene->layers.push_back(layer);
+	}
+
+	const vector< string > names = scene->layer_names();
+	vector< uint8_t > amounts(pix_size.x * pix_size.y);
+	for (unsigned int s = 0; s < params.strokes && names.size() >= 2; ++s) {
+		string spec = random_shorthand(rng, names, params);
+		string error = "";
+		const StackOp *op = (spec == "" ? NULL : StackOp::from_shorthand(spec, names, &error));
+		if (op == NULL) {
+			std::cerr << "WARNING: generated shorthand '" << spec << "' didn't parse (" << error << "); using a simple one." << std::endl;
+			op = StackOp::from_shorthand(names[0] + "<" + names[1], names, &error);
+			assert(op);
+		}
+		vector< Blob > blobs = make_blobs(rng, pix_size.x, pix_size.y, params.stroke_coverage, params.stroke_softness);
+		for (unsigned int y = 0; y < pix_size.y; ++y) {
+			for (unsigned int x = 0; x < pix_size.x; ++x) {
+				amounts[y * pix_size.x + x] = uint8_t(255.0f * blob_amount(blobs, x + 0.5f, y + 0.5f));
+			}
+		}
+		Stroke *stroke = new Stroke(pix_size, op);
+		stroke->set(pix_size, &amounts[0]);
+		scene->strokes.push_back(stroke);
+	}
+}
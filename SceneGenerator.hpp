@@ -0,0 +1,47 @@
+#ifndef SCENE_GENERATOR_HPP
+#define SCENE_GENERATOR_HPP
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+class Scene;
+
+//What generate_scene makes. Everything is drawn from 'seed', so the same
+// parameters always give the same scene.
+class SceneParams {
+public:
+	SceneParams();
+	unsigned int width; //pixels
+	unsigned int height;
+	unsigned int layers;
+	unsigned int strokes;
+	uint32_t seed;
+	float layer_density; //fraction of pixels each layer covers, [0,1]
+	float multiply; //fraction of layers that multiply (the rest are over), [0,1]
+	float opaque; //fraction of layers at full opacity (opaque inside their blobs), [0,1]
+	float stroke_coverage; //fraction of pixels each stroke touches, [0,1]
+	float stroke_softness; //fraction of a stroke's radius that fades out, [0,1]
+	//StackOp shorthand complexity (each op picks up to these many):
+	unsigned int phases; //';'-separated phases
+	unsigned int partitions; //'|'-separated partitions per phase
+	unsigned int chain; //'<' or '>' linked groups per partition (at least 2)
+	unsigned int group; //'&'-joined layers per group
+	float wildcards; //chance a group is '*' (at most one per phase), [0,1]
+
+	//Set one parameter from text; false (with a message) on a bad key or value:
+	bool set(std::string const &key, std::string const &value, std::string *error = NULL);
+	//"layers=8,strokes=16,...", for reports (and parse_scene_sweep):
+	std::string describe() const;
+};
+
+//Parse "key=value,key=v1:v2:v3,..." into every combination of the listed
+// values (the first key varying slowest). Unmentioned keys keep defaults.
+bool parse_scene_sweep(std::string const &spec, std::vector< SceneParams > *into, std::string *error = NULL);
+
+//Add params.layers layers (named l0, l1, ...) and params.strokes strokes to
+// an empty scene:
+void generate_scene(SceneParams const &params, Scene *scene);
+
+#endif //SCENE_GENERATOR_HPP
@@ -49,11 +49,162 @@ public:
 
 typedef vector< Step > Operation;
 
+//Stacks with more layers than this can't use the compiled (stack-storage)
+// version of apply, and fall back to the reference version:
+const unsigned int CompiledMaxLayers = 128;
+
+//Compiled programs are a flat list of steps, each stored as:
+// [flags] [bins] [layers_to_bins[0]] ... [layers_to_bins[layers-1]]
+const uint32_t ProgramReversed = 1;
+
 class GeneralOp : public StackOp {
 public:
-	GeneralOp(Operation const &_op) : op(_op) {
+	GeneralOp(Operation const &_op) : op(_op), program_layers(0) {
+		compile();
+	}
+	//Flatten 'op' into 'program', leaving out steps that can't do anything.
+	void compile() {
+		program.clear();
+		program_layers = 0;
+		for (Operation::const_iterator step = op.begin(); step != op.end(); ++step) {
+			assert(step == op.begin() || step->layers_to_bins.size() == program_layers);
+			program_layers = step->layers_to_bins.size();
+			//with fewer than two bins, nothing ever waits, so the step is a no-op:
+			if (step->bins < 2) continue;
+			program.push_back(step->reversed ? ProgramReversed : 0);
+			program.push_back(step->bins);
+			program.insert(program.end(), step->layers_to_bins.begin(), step->layers_to_bins.end());
+		}
+		//A layer only matters to a (non-trivial) step if it's binned, or if it
+		// takes up a slot in a stream that's woven between layers held aside:
+		depends.assign(program_layers, false);
+		for (Operation::const_iterator step = op.begin(); step != op.end(); ++step) {
+			if (step->bins < 2) continue;
+			const bool has_aside = (std::find(step->layers_to_bins.begin(), step->layers_to_bins.end(), AsideBin) != step->layers_to_bins.end());
+			for (unsigned int l = 0; l < program_layers; ++l) {
+				BinIndex bi = step->layers_to_bins[l];
+				if (bi == AsideBin) continue;
+				if (bi == InstantBin && !has_aside) continue;
+				depends[l] = true;
+			}
+		}
+	}
+	virtual bool depends_on(unsigned int layer) const {
+		return layer >= depends.size() || depends[layer];
 	}
+	//Same result as apply_reference, but runs the compiled program without
+	// allocating. Reversed steps are handled by walking positions backward.
 	virtual void apply(size_t count, unsigned int *layer_to_order) const {
+		if (count > CompiledMaxLayers) {
+			apply_reference(count, layer_to_order);
+			return;
+		}
+		LayerID order[CompiledMaxLayers];
+		unsigned int size = count;
+		for (unsigned int i = 0; i < size; ++i) {
+			order[i] = -1U;
+		}
+		for (unsigned int l = 0; l < count; ++l) {
+			if (layer_to_order[l] < size) {
+				order[layer_to_order[l]] = l;
+			}
+		}
+		while (size > 0 && order[size-1] == -1U) {
+			--size;
+		}
+		for (unsigned int i = 0; i < size; ++i) {
+			assert(order[i] != -1U);
+		}
+
+		unsigned int bin_counts[CompiledMaxLayers + 1];
+		LayerID wait_head[CompiledMaxLayers + 1];
+		LayerID wait_tail[CompiledMaxLayers + 1];
+		LayerID wait_next[CompiledMaxLayers];
+		LayerID stream[CompiledMaxLayers];
+		LayerID to_emit[CompiledMaxLayers];
+
+		const uint32_t *step = program.empty() ? NULL : &program[0];
+		const uint32_t *end = step + program.size();
+		while (step != end) {
+			const bool reversed = (step[0] & ProgramReversed);
+			const unsigned int bins = step[1];
+			const uint32_t *layers_to_bins = step + 2;
+			step += 2 + program_layers;
+			assert(bins <= CompiledMaxLayers + 1);
+
+			//position in (possibly reversed) order:
+			#define AT( I ) order[reversed ? size - 1 - (I) : (I)]
+
+			//Layers get binned:
+			for (unsigned int b = 0; b < bins; ++b) {
+				bin_counts[b] = 0;
+				wait_head[b] = -1U;
+			}
+			for (unsigned int i = 0; i < size; ++i) {
+				assert(AT(i) < program_layers);
+				BinIndex bi = layers_to_bins[AT(i)];
+				if (bi < bins) {
+					bin_counts[bi] += 1;
+				}
+			}
+			//Layers get sorted:
+			unsigned int streamed = 0;
+			for (unsigned int i = 0; i < size; ++i) {
+				LayerID id = AT(i);
+				BinIndex bi = layers_to_bins[id];
+				if (bi == AsideBin) continue; //set aside.
+				if (bi == InstantBin) {
+					stream[streamed++] = id;
+				} else if (bi + 1 >= bins || bin_counts[bi + 1] == 0) {
+					unsigned int emit_at = 0;
+					unsigned int emit_end = 0;
+					to_emit[emit_end++] = id;
+					while (emit_at != emit_end) {
+						LayerID e = to_emit[emit_at++];
+						stream[streamed++] = e;
+						BinIndex bin = layers_to_bins[e];
+						assert(bin < bins);
+						assert(bin_counts[bin] > 0);
+						bin_counts[bin] -= 1;
+						if (bin_counts[bin] == 0) {
+							for (LayerID w = wait_head[bin]; w != -1U; w = wait_next[w]) {
+								to_emit[emit_end++] = w;
+							}
+							wait_head[bin] = -1U;
+						}
+					}
+				} else {
+					//record that this layer is waiting on a bin:
+					wait_next[id] = -1U;
+					if (wait_head[bi + 1] == -1U) {
+						wait_head[bi + 1] = id;
+					} else {
+						wait_next[wait_tail[bi + 1]] = id;
+					}
+					wait_tail[bi + 1] = id;
+				}
+			}
+			//stream gets re-inserted:
+			unsigned int s = 0;
+			for (unsigned int i = 0; i < size; ++i) {
+				if (layers_to_bins[AT(i)] == AsideBin) continue;
+				assert(s < streamed);
+				AT(i) = stream[s];
+				++s;
+			}
+			assert(s == streamed);
+
+			#undef AT
+		}
+
+		//Fill in layer-to-order mapping with output:
+		for (unsigned int i = 0; i < size; ++i) {
+			assert(order[i] < count);
+			layer_to_order[order[i]] = i;
+		}
+	}
+	//Straightforward (allocating) version of apply; kept to check the compiled version against.
+	void apply_reference(size_t count, unsigned int *layer_to_order) const {
 		vector< LayerID > order(count, -1U);
 		for (unsigned int l = 0; l < count; ++l) {
 			if (layer_to_order[l] < order.size()) {
@@ -139,6 +290,43 @@ public:
 			layer_to_order[order[i]] = i;
 		}
 	}
+	//Differential test: run apply and apply_reference on a bunch of orderings
+	// (shuffled, and with some layers missing, as update_tile_dense does) and
+	// make sure they agree.
+	bool check_compiled() const {
+		const unsigned int count = program_layers;
+		if (count == 0) return true;
+		uint32_t seed = 0x5eed;
+		for (unsigned int trial = 0; trial < 200; ++trial) {
+			vector< unsigned int > order(count);
+			for (unsigned int i = 0; i < count; ++i) {
+				order[i] = i;
+			}
+			if (trial == 1) {
+				reverse(order.begin(), order.end());
+			} else if (trial > 1) {
+				for (unsigned int i = count - 1; i > 0; --i) {
+					seed = seed * 1664525U + 1013904223U;
+					std::swap(order[i], order[(seed >> 8) % (i + 1)]);
+				}
+			}
+			//every other trial, leave some layers out of the stack:
+			unsigned int present = count;
+			if (trial % 2 == 1) {
+				seed = seed * 1664525U + 1013904223U;
+				present = 1 + (seed >> 8) % count;
+			}
+			vector< unsigned int > a(count, -1U);
+			for (unsigned int i = 0; i < present; ++i) {
+				a[order[i]] = i;
+			}
+			vector< unsigned int > b = a;
+			apply(a.size(), &a[0]);
+			apply_reference(b.size(), &b[0]);
+			if (a != b) return false;
+		}
+		return true;
+	}
 	virtual std::string description(std::vector< std::string > const &layer_names) const {
 		std::string ret = "";
 		for (Operation::const_iterator step = op.begin(); step != op.end(); ++step) {
@@ -223,6 +411,9 @@ public:
 		return ret;
 	}
 	Operation op;
+	vector< uint32_t > program; //compiled version of op
+	unsigned int program_layers; //layer count op was built for
+	vector< bool > depends; //per layer; see depends_on
 	vector< unsigned int > short_layers;
 	vector< char > short_seps;
 
@@ -474,3 +665,55 @@ const StackOp * StackOp::from_shorthand(std::string shorthand, std::vector< std:
 	return *f;
 }
 
+bool check_stack_ops(std::string *error) {
+	//chains, '&' groups, '|' partitions, ';' phases, and wildcards, over l0..l5:
+	static const char *corpus[] = {
+		"l0<l1", "l1>l0", "l0<l1<l2", "l2>l1>l0",
+		"l0&l1<l2", "l0<l1&l2&l3", "l0&l1>l2&l3>l4",
+		"l0<*", "*>l0", "l0<*<l1", "l0&*>l1",
+		"l0<l1|l2>l3", "l0<l1|l2<*", "l0>l1&l2|l3<l4|l5>*",
+		"l0<l1;l1>l0", "l0<l1<l2;l2&l0>l1", "l0<*;*>l1;l2<l3|l4>l5",
+	};
+	//(layer counts on both sides of CompiledMaxLayers, where apply falls back)
+	const unsigned int counts[] = { 6, 17, CompiledMaxLayers, CompiledMaxLayers + 1, 2 * CompiledMaxLayers + 3 };
+	for (unsigned int c = 0; c < sizeof(counts) / sizeof(counts[0]); ++c) {
+		vector< string > names;
+		for (unsigned int l = 0; l < counts[c]; ++l) {
+			ostringstream name;
+			name << 'l' << l;
+			names.push_back(name.str());
+		}
+		vector< string > specs(corpus, corpus + sizeof(corpus) / sizeof(corpus[0]));
+		{ //plus ops over every layer -- a chain, and groups of three:
+			string chain = names[0];
+			string groups = names[0];
+			for (unsigned int l = 1; l < names.size(); ++l) {
+				chain += '<' + names[l];
+				groups += (l % 3 ? '&' : '>') + names[l];
+			}
+			specs.push_back(chain);
+			specs.push_back(groups);
+		}
+		for (vector< string >::const_iterator spec = specs.begin(); spec != specs.end(); ++spec) {
+			string parse_error = "";
+			const StackOp *op = StackOp::from_shorthand(*spec, names, &parse_error);
+			if (!op) {
+				if (error) {
+					*error = "can't parse '" + *spec + "': " + parse_error;
+				}
+				return false;
+			}
+			const GeneralOp *general = dynamic_cast< const GeneralOp * >(op);
+			assert(general);
+			if (!general->check_compiled()) {
+				if (error) {
+					ostringstream msg;
+					msg << "compiled '" << (spec->size() > 60 ? spec->substr(0, 60) + "..." : *spec) << "' doesn't match apply_reference with " << counts[c] << " layers";
+					*error = msg.str();
+				}
+				return false;
+			}
+		}
+	}
+	return true;
+}
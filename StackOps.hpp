@@ -16,10 +16,19 @@ public:
 	virtual void apply(size_t count, unsigned int *layer_to_order) const = 0;
 	virtual std::string description(std::vector< std::string > const &layer_names) const = 0;
 	virtual std::string shorthand(std::vector< std::string > const &layer_names) const = 0;
+	//false if the way this op reorders the other layers can't depend on
+	// where 'layer' sits (so a layer nobody can see may be moved freely):
+	virtual bool depends_on(unsigned int layer) const = 0;
 
 static const StackOp *from_shorthand(std::string desc, std::vector< std::string > const &layer_names, std::string *error_desc = NULL);
 };
 
+//Parse a fixed set of shorthands (chains, groups, partitions, phases and
+// wildcards) over several layer counts, and compare each op's compiled apply
+// against its reference version on shuffled and partial stacks. Returns
+// false and fills in error on mismatch.
+bool check_stack_ops(std::string *error = NULL);
+
 
 
 
@@ -221,7 +221,7 @@ void StrokeDraw::commit(TileSet &changed) {
 				//if there was data in the stroke here, preserve it:
 				if (into->get_tile_or_null(t)) {
 					glBindTexture(GL_TEXTURE_2D, fb->texture());
-					glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, TileSize, TileSize, 0, GL_LUMINANCE, GL_UNSIGNED_BYTE, into->get_tile(t));
+					glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, TileSize, TileSize, 0, GL_LUMINANCE, GL_UNSIGNED_BYTE, into->get_tile_or_null(t));
 					glBindTexture(GL_TEXTURE_2D, 0);
 					gl_errors("stroke texture upload");
 					assert(fb->isValid());
@@ -246,7 +246,9 @@ void StrokeDraw::commit(TileSet &changed) {
 
 			glPopMatrix();
 
-			glReadPixels(0, 0, TileSize, TileSize, GL_RED, GL_UNSIGNED_BYTE, into->get_tile(t));
+			//(a new tile version if packets in flight still hold the old one)
+			glReadPixels(0, 0, TileSize, TileSize, GL_RED, GL_UNSIGNED_BYTE, into->overwrite_tile(t));
+			into->update_coverage(t);
 
 			//mark tile dirty:
 			changed.insert(t);
@@ -0,0 +1,134 @@
+#include "TilePool.hpp"
+
+#ifdef WIN32
+#include <malloc.h>
+#else
+#include <stdlib.h>
+#endif
+
+#include <cassert>
+#include <algorithm>
+#include <new>
+
+using std::vector;
+
+namespace {
+
+void *aligned_block(size_t size) {
+#ifdef WIN32
+	return _aligned_malloc(size, TilePool::Alignment);
+#else
+	void *ret = NULL;
+	if (posix_memalign(&ret, TilePool::Alignment, size) != 0) {
+		return NULL;
+	}
+	return ret;
+#endif
+}
+
+QMutex pools_lock;
+TilePool *first_pool = NULL;
+
+}
+
+//One thread's free blocks, plus what's left of its newest slab; handed back
+// to the pool when the thread exits:
+class TilePool::Cache {
+public:
+	Cache(TilePool *_pool) : pool(_pool), fresh(NULL), fresh_left(0) {
+		blocks.reserve(2 * Batch);
+	}
+	~Cache() {
+		//(untouched blocks go to the shared list too, so count them as carved)
+		pool->carved.fetchAndAddOrdered(fresh_left);
+		while (fresh_left) {
+			--fresh_left;
+			blocks.push_back(fresh + fresh_left * pool->block_size);
+		}
+		pool->drain(this, 0);
+	}
+	TilePool *pool;
+	vector< void * > blocks;
+	char *fresh; //next never-used block of the newest slab
+	unsigned int fresh_left; //never-used blocks from 'fresh' on
+};
+
+TilePool::TilePool(size_t _block_size, const char *_name) : block_size((_block_size + Alignment - 1) / Alignment * Alignment), name(_name), requests(0), carved(0), slabs(0), outstanding(0), next_pool(NULL) {
+	QMutexLocker locker(&pools_lock);
+	next_pool = first_pool;
+	first_pool = this;
+}
+
+void *TilePool::allocate() {
+	requests.ref();
+	outstanding.ref();
+	Cache *c = cache();
+	if (c->blocks.empty() && c->fresh_left == 0) {
+		refill(c);
+	}
+	if (c->blocks.empty()) {
+		//first use of a block from a new slab:
+		assert(c->fresh_left > 0);
+		carved.ref();
+		void *ret = c->fresh;
+		c->fresh += block_size;
+		--c->fresh_left;
+		return ret;
+	}
+	void *ret = c->blocks.back();
+	c->blocks.pop_back();
+	return ret;
+}
+
+void TilePool::release(void *block) {
+	if (!block) return;
+	outstanding.deref();
+	Cache *c = cache();
+	c->blocks.push_back(block);
+	if (c->blocks.size() >= 2 * Batch) {
+		drain(c, Batch);
+	}
+}
+
+TilePool::Cache *TilePool::cache() {
+	if (!caches.hasLocalData()) {
+		caches.setLocalData(new Cache(this));
+	}
+	return caches.localData();
+}
+
+void TilePool::refill(Cache *into) {
+	{ //take a batch from the shared list, if there is one:
+		QMutexLocker locker(&lock);
+		while (!shared.empty() && into->blocks.size() < Batch) {
+			into->blocks.push_back(shared.back());
+			shared.pop_back();
+		}
+	}
+	if (!into->blocks.empty()) return;
+	//otherwise it's time for a new slab:
+	char *slab = reinterpret_cast< char * >(aligned_block(SlabBlocks * block_size));
+	if (!slab) {
+		throw std::bad_alloc();
+	}
+	slabs.ref();
+	assert(into->fresh_left == 0);
+	into->fresh = slab;
+	into->fresh_left = SlabBlocks;
+}
+
+void TilePool::drain(Cache *from, unsigned int keep) {
+	QMutexLocker locker(&lock);
+	while (from->blocks.size() > keep) {
+		shared.push_back(from->blocks.back());
+		from->blocks.pop_back();
+	}
+}
+
+void TilePool::report(std::ostream &into) {
+	QMutexLocker locker(&pools_lock);
+	for (TilePool *p = first_pool; p; p = p->next_pool) {
+		const int reused = std::max(0, int(p->requests) - int(p->carved));
+		into << p->name << ": " << reused << " of " << int(p->requests) << " allocations reused; " << int(p->slabs) << " slabs of " << SlabBlocks << " x " << p->block_size << " bytes, " << int(p->outstanding) << " blocks in use." << std::endl;
+	}
+}
@@ -0,0 +1,59 @@
+#ifndef TILE_POOL_HPP
+#define TILE_POOL_HPP
+
+#include <QAtomicInt>
+#include <QMutex>
+#include <QThreadStorage>
+
+#include <vector>
+#include <iostream>
+#include <cstddef>
+
+//Fixed-size blocks (tile buffers, render packets) carved out of 64-byte
+// aligned slabs. Freed blocks go on the freeing thread's list and are handed
+// out again from there, so steady-state painting never reaches the heap;
+// threads that free more than they allocate spill into a shared list.
+//Slabs are never given back, so make pools with tile_pool< T >().
+class TilePool {
+public:
+	static const size_t Alignment = 64;
+	static const unsigned int SlabBlocks = 16; //blocks per heap allocation
+	static const unsigned int Batch = 8; //blocks moved to/from the shared list at once
+
+	TilePool(size_t block_size, const char *name);
+	void *allocate(); //throws std::bad_alloc if a new slab can't be had
+	void release(void *block); //from allocate() on any thread; NULL is fine
+
+	size_t block_size; //rounded up to Alignment
+	const char *name;
+	//stats (allocate() calls minus 'carved' is the allocations avoided):
+	QAtomicInt requests;
+	QAtomicInt carved; //blocks handed out for the first time
+	QAtomicInt slabs;
+	QAtomicInt outstanding; //allocated, not yet released
+
+	//"name: N of M allocations reused, ..." for every pool made so far:
+	static void report(std::ostream &into);
+private:
+	class Cache;
+	Cache *cache();
+	void refill(Cache *into);
+	void drain(Cache *from, unsigned int keep);
+	QThreadStorage< Cache * > caches;
+	QMutex lock; //guards shared:
+	std::vector< void * > shared;
+	TilePool *next_pool; //for report()
+
+	~TilePool(); //not defined
+	TilePool(TilePool const &); //not defined
+	TilePool &operator=(TilePool const &); //not defined
+};
+
+//The pool for blocks of sizeof(T):
+template< typename T >
+TilePool &tile_pool(const char *name) {
+	static TilePool *pool = new TilePool(sizeof(T), name);
+	return *pool;
+}
+
+#endif //TILE_POOL_HPP
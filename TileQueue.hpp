@@ -0,0 +1,57 @@
+#ifndef TILE_QUEUE_HPP
+#define TILE_QUEUE_HPP
+
+#include <Vector/Vector.hpp>
+
+#include <stdint.h>
+
+#include <vector>
+#include <algorithm>
+#include <cassert>
+
+//Tiles waiting to be rendered, best first, as a binary heap: push and pop
+// are O(log n). Keys are up to the owner (see Canvas::key_tile); when what
+// they depend on changes, recompute them in 'heap' and call reheap(), O(n).
+//Tiles aren't taken out when they stop needing work -- the owner skips
+// them as they come to the top.
+class TileQueue {
+public:
+	class Entry {
+	public:
+		Vector2ui at;
+		uint32_t tier; //lower tiers first...
+		float rank; //...then lower ranks
+		uint32_t since; //when it was queued (the owner's clock)
+		bool operator<(Entry const &o) const { //(so the heap's top is the best)
+			return tier > o.tier || (tier == o.tier && rank > o.rank);
+		}
+	};
+	bool empty() const {
+		return heap.empty();
+	}
+	unsigned int size() const {
+		return heap.size();
+	}
+	Entry const &top() const {
+		assert(!heap.empty());
+		return heap[0];
+	}
+	void push(Entry const &entry) {
+		heap.push_back(entry);
+		std::push_heap(heap.begin(), heap.end());
+	}
+	void pop() {
+		assert(!heap.empty());
+		std::pop_heap(heap.begin(), heap.end());
+		heap.pop_back();
+	}
+	void reheap() {
+		std::make_heap(heap.begin(), heap.end());
+	}
+	void clear() {
+		heap.clear();
+	}
+	std::vector< Entry > heap;
+};
+
+#endif //TILE_QUEUE_HPP
@@ -0,0 +1,89 @@
+#ifndef TILE_REF_HPP
+#define TILE_REF_HPP
+
+#include "Constants.hpp"
+#include "TilePool.hpp"
+
+#include <QAtomicInt>
+
+#include <cassert>
+#include <cstddef>
+
+//One tile's pixels, shared by reference count. Buffers come from a
+// TilePool, so pix is 64-byte aligned and dropping one doesn't free it:
+template< typename PIX >
+class TileBuffer {
+public:
+	TileBuffer() : refs(1) {
+	}
+	static void *operator new(size_t size) {
+		assert(size == sizeof(TileBuffer));
+		return pool().allocate();
+	}
+	static void operator delete(void *buffer) {
+		pool().release(buffer);
+	}
+	static TilePool &pool() {
+		return tile_pool< TileBuffer >(sizeof(PIX) == 1 ? "stroke tiles" : "layer tiles");
+	}
+	PIX pix[TileSize * TileSize]; //first, for alignment
+	QAtomicInt refs;
+private:
+	TileBuffer(TileBuffer const &); //not defined
+	TileBuffer &operator=(TileBuffer const &); //not defined
+};
+
+//Counted reference to a tile version. Readers hold one for as long as they
+// need the pixels (e.g. a RenderPacket in flight); writers only scribble on
+// a buffer nobody else references (see Tiled::get_tile), so a version never
+// changes under a reader.
+//Refs may be dropped on any thread, but only take new ones (copy) on the
+// thread that writes the tiles, so unique() can't go stale under you.
+template< typename PIX >
+class TileRef {
+public:
+	TileRef() : buffer(NULL) {
+	}
+	TileRef(TileRef const &o) : buffer(o.buffer) {
+		if (buffer) buffer->refs.ref();
+	}
+	~TileRef() {
+		release();
+	}
+	TileRef &operator=(TileRef const &o) {
+		if (o.buffer) o.buffer->refs.ref();
+		release();
+		buffer = o.buffer;
+		return *this;
+	}
+	//a fresh buffer (contents undefined):
+	static TileRef create() {
+		TileRef ret;
+		ret.buffer = new TileBuffer< PIX >();
+		return ret;
+	}
+	PIX const *get() const {
+		return (buffer ? buffer->pix : NULL);
+	}
+	//only for buffers no one else can see:
+	PIX *writable() {
+		assert(unique());
+		return buffer->pix;
+	}
+	bool unique() const {
+		return buffer && int(buffer->refs) == 1;
+	}
+	void reset() {
+		release();
+	}
+private:
+	void release() {
+		if (buffer && !buffer->refs.deref()) {
+			delete buffer;
+		}
+		buffer = NULL;
+	}
+	TileBuffer< PIX > *buffer;
+};
+
+#endif //TILE_REF_HPP
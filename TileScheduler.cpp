@@ -0,0 +1,267 @@
+#include "TileScheduler.hpp"
+
+#include <QCoreApplication>
+
+#include <cassert>
+#include <iostream>
+#include <set>
+#include <algorithm>
+
+using std::vector;
+
+TileWorker::TileWorker(TileScheduler *_scheduler, unsigned int _index) : QThread(), scheduler(_scheduler), index(_index) {
+}
+
+TileWorker::~TileWorker() {
+}
+
+void TileWorker::run() {
+	TileJob job;
+	while (scheduler->next_job(index, job)) {
+		//(drafts are cheap enough to leave whole)
+		if (!job.split && job.packet->split_blocks && !job.packet->draft && scheduler->threads() > 1) {
+			if (renderer.render_uniform(job.packet)) {
+				scheduler->completed(job.packet);
+				continue;
+			}
+			//latency-critical tile; share its blocks with the rest of the pool:
+			job = scheduler->split(job.packet);
+		}
+		if (job.split) {
+			renderer.render_blocks(job.packet, job.split->blocks, job.split->samples, job.first_block, job.end_block, job.split->keep_energy);
+			scheduler->finish_part(job);
+		} else {
+			renderer.render(job.packet, scheduler->blocks(), scheduler->samples(), scheduler->keep_energy());
+			scheduler->completed(job.packet);
+		}
+	}
+}
+
+TileScheduler::TileScheduler(QObject *_target, unsigned int threads) : QObject(), steals(0), splits(0), queued(0), blocks_setting(8), samples_setting(10), energy_setting(1000000), stopping(0), ready_posted(false), target(_target), submitted(0), next_queue(0) {
+	if (threads == 0) {
+		threads = default_threads();
+	}
+	for (unsigned int i = 0; i < threads; ++i) {
+		queues.push_back(new WorkQueue);
+	}
+	for (unsigned int i = 0; i < threads; ++i) {
+		TileWorker *worker = new TileWorker(this, i);
+		worker->setStackSize(8 * 1024 * 1024); //eight meg of stack should be enough.
+		workers.push_back(worker);
+		worker->start();
+	}
+}
+
+TileScheduler::~TileScheduler() {
+	stop();
+	for (vector< TileWorker * >::iterator w = workers.begin(); w != workers.end(); ++w) {
+		delete *w;
+	}
+	workers.clear();
+	for (vector< WorkQueue * >::iterator q = queues.begin(); q != queues.end(); ++q) {
+		for (std::deque< RenderPacket * >::iterator p = (*q)->packets.begin(); p != (*q)->packets.end(); ++p) {
+			delete *p;
+		}
+		delete *q;
+	}
+	queues.clear();
+	//unfinished split tiles (each packet and split once):
+	std::set< TileSplit * > dropped;
+	for (std::deque< TileJob >::iterator j = parts.begin(); j != parts.end(); ++j) {
+		if (dropped.insert(j->split).second) {
+			delete j->packet;
+			delete j->split;
+		}
+	}
+	parts.clear();
+	for (vector< RenderPacket * >::iterator p = completed_packets.begin(); p != completed_packets.end(); ++p) {
+		delete *p;
+	}
+	completed_packets.clear();
+}
+
+unsigned int TileScheduler::default_threads() {
+	int ideal = QThread::idealThreadCount();
+	return (ideal > 0 ? ideal : 1);
+}
+
+void TileScheduler::submit(vector< RenderPacket * > const &batch) {
+	if (batch.empty()) return;
+	//deal out round-robin; batches arrive in priority order, and workers
+	// take from the front, so the first packets get started first:
+	for (vector< RenderPacket * >::const_iterator p = batch.begin(); p != batch.end(); ++p) {
+		assert(*p);
+		WorkQueue *queue = queues[next_queue];
+		next_queue = (next_queue + 1) % queues.size();
+		QMutexLocker lock(&queue->lock);
+		queue->packets.push_back(*p);
+	}
+	submitted += batch.size();
+	queued.fetchAndAddOrdered(batch.size());
+	//wake just enough sleepers:
+	QMutexLocker lock(&sleep_lock);
+	if (batch.size() >= workers.size()) {
+		work_ready.wakeAll();
+	} else {
+		for (unsigned int i = 0; i < batch.size(); ++i) {
+			work_ready.wakeOne();
+		}
+	}
+}
+
+void TileScheduler::take_completed(vector< RenderPacket * > &into) {
+	QMutexLocker lock(&completed_lock);
+	into.insert(into.end(), completed_packets.begin(), completed_packets.end());
+	assert(completed_packets.size() <= submitted);
+	submitted -= completed_packets.size();
+	completed_packets.clear();
+	ready_posted = false;
+}
+
+void TileScheduler::wait_completed(vector< RenderPacket * > &into) {
+	QMutexLocker lock(&completed_lock);
+	while (completed_packets.empty() && submitted != 0) {
+		completion.wait(&completed_lock);
+	}
+	into.insert(into.end(), completed_packets.begin(), completed_packets.end());
+	submitted -= completed_packets.size();
+	completed_packets.clear();
+	ready_posted = false;
+}
+
+void TileScheduler::set_blocks(int new_blocks) {
+	unsigned int val = TileRenderer::round_blocks(new_blocks);
+	if (blocks() != val) {
+		blocks_setting = val;
+		std::cerr << "Render switches to " << val << " blocks." << std::endl;
+	}
+}
+
+void TileScheduler::set_samples(int new_samples) {
+	unsigned int val = TileRenderer::clamp_samples(new_samples);
+	if (samples() != val) {
+		samples_setting = val;
+		std::cerr << "Render switches to " << val << " samples." << std::endl;
+	}
+}
+
+void TileScheduler::set_energy(int new_energy) {
+	unsigned int val = TileRenderer::clamp_energy(new_energy);
+	if ((unsigned int)int(energy_setting) != val) {
+		energy_setting = val;
+		std::cerr << "Render switches to keeping " << val / 10000.0f << "% of each pixel's weight." << std::endl;
+	}
+}
+
+void TileScheduler::stop() {
+	{
+		QMutexLocker lock(&sleep_lock);
+		if (int(stopping)) return;
+		stopping = 1;
+		work_ready.wakeAll();
+	}
+	for (vector< TileWorker * >::iterator w = workers.begin(); w != workers.end(); ++w) {
+		(*w)->wait();
+	}
+}
+
+void TileScheduler::report_stats(std::ostream &into) const {
+	assert(int(stopping));
+	for (vector< TileWorker * >::const_iterator w = workers.begin(); w != workers.end(); ++w) {
+		(*w)->renderer.report_stats(into);
+	}
+}
+
+bool TileScheduler::next_job(unsigned int worker, TileJob &job) {
+	assert(worker < queues.size());
+	while (true) {
+		if (int(stopping)) return false;
+		{ //parts of split tiles first; someone is waiting on them:
+			QMutexLocker lock(&parts_lock);
+			if (!parts.empty()) {
+				job = parts.front();
+				parts.pop_front();
+				queued.fetchAndAddOrdered(-1);
+				return true;
+			}
+		}
+		{ //own queue, from the front:
+			WorkQueue *queue = queues[worker];
+			QMutexLocker lock(&queue->lock);
+			if (!queue->packets.empty()) {
+				job = TileJob(queue->packets.front());
+				queue->packets.pop_front();
+				queued.fetchAndAddOrdered(-1);
+				return true;
+			}
+		}
+		//steal from the back of someone else's:
+		for (unsigned int i = 1; i < queues.size(); ++i) {
+			WorkQueue *queue = queues[(worker + i) % queues.size()];
+			QMutexLocker lock(&queue->lock);
+			if (!queue->packets.empty()) {
+				job = TileJob(queue->packets.back());
+				queue->packets.pop_back();
+				queued.fetchAndAddOrdered(-1);
+				steals.fetchAndAddOrdered(1);
+				return true;
+			}
+		}
+		//nothing anywhere; sleep until submit/split (or stop):
+		QMutexLocker lock(&sleep_lock);
+		if (int(stopping)) return false;
+		if (int(queued) > 0) continue;
+		work_ready.wait(&sleep_lock);
+	}
+}
+
+TileJob TileScheduler::split(RenderPacket *packet) {
+	assert(packet);
+	const unsigned int tile_blocks = blocks();
+	const unsigned int count = std::min(tile_blocks, (unsigned int)workers.size());
+	TileJob first(packet);
+	if (count < 2) {
+		return first;
+	}
+	splits.fetchAndAddOrdered(1);
+	TileSplit *shared = new TileSplit(count, tile_blocks, samples(), keep_energy());
+	{
+		QMutexLocker lock(&parts_lock);
+		for (unsigned int p = 0; p < count; ++p) {
+			TileJob job(packet);
+			job.split = shared;
+			job.first_block = (p * tile_blocks) / count;
+			job.end_block = ((p + 1) * tile_blocks) / count;
+			if (p == 0) {
+				first = job;
+			} else {
+				parts.push_back(job);
+			}
+		}
+	}
+	queued.fetchAndAddOrdered(count - 1);
+	QMutexLocker lock(&sleep_lock);
+	for (unsigned int p = 1; p < count; ++p) {
+		work_ready.wakeOne();
+	}
+	return first;
+}
+
+void TileScheduler::finish_part(TileJob const &job) {
+	assert(job.split);
+	//fetchAndAdd returns the old value; 1 means we were the last part:
+	if (job.split->remaining.fetchAndAddOrdered(-1) == 1) {
+		delete job.split;
+		completed(job.packet);
+	}
+}
+
+void TileScheduler::completed(RenderPacket *packet) {
+	QMutexLocker lock(&completed_lock);
+	completed_packets.push_back(packet);
+	completion.wakeAll();
+	if (target && !ready_posted) {
+		ready_posted = true;
+		QCoreApplication::postEvent(target, new TilesReadyEvent());
+	}
+}
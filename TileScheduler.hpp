@@ -0,0 +1,155 @@
+#ifndef TILE_SCHEDULER_HPP
+#define TILE_SCHEDULER_HPP
+
+#include "Renderer.hpp"
+
+#include <QObject>
+#include <QThread>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QAtomicInt>
+
+#include <deque>
+#include <vector>
+
+class TileScheduler;
+
+//Shared by the parts of a tile whose blocks are spread over the pool:
+class TileSplit {
+public:
+	TileSplit(unsigned int parts, unsigned int _blocks, unsigned int _samples, float _keep_energy) : remaining(parts), blocks(_blocks), samples(_samples), keep_energy(_keep_energy) {
+	}
+	QAtomicInt remaining; //parts not yet finished
+	unsigned int blocks; //settings are fixed when the tile is split
+	unsigned int samples;
+	float keep_energy;
+};
+
+//A whole packet, or (if split is set) blocks [first_block, end_block) of one:
+class TileJob {
+public:
+	TileJob(RenderPacket *_packet = NULL) : packet(_packet), split(NULL), first_block(0), end_block(0) {
+	}
+	RenderPacket *packet;
+	TileSplit *split;
+	unsigned int first_block;
+	unsigned int end_block;
+};
+
+class TileWorker : public QThread {
+public:
+	TileWorker(TileScheduler *scheduler, unsigned int index);
+	virtual ~TileWorker();
+protected:
+	void run();
+	TileScheduler *scheduler;
+	unsigned int index; //which queue is ours
+public:
+	TileRenderer renderer; //run()'s (read it only once the worker has exited)
+};
+
+//Renders packets on a pool of worker threads (one per hardware thread by
+// default). Each worker has its own queue; submissions are dealt out
+// round-robin and idle workers steal from the back of other queues.
+//Packets marked split_blocks have their blocks divided into one part per
+// worker; parts go in a shared lane that every worker checks first, and
+// the worker finishing the last part completes the packet.
+//Completed packets pile up until take_completed; the target gets a single
+// TilesReadyEvent when the pile goes from empty to non-empty.
+//submit/take_completed/outstanding are for one (e.g. the GUI) thread.
+class TileScheduler : public QObject {
+	Q_OBJECT
+public:
+	//'target' may be NULL (then poll with take_completed/wait_completed).
+	//threads == 0 means default_threads().
+	TileScheduler(QObject *target, unsigned int threads = 0);
+	virtual ~TileScheduler();
+
+	//queue up a batch of packets (scheduler owns them until they're taken back):
+	void submit(std::vector< RenderPacket * > const &batch);
+	//append completed packets to 'into':
+	void take_completed(std::vector< RenderPacket * > &into);
+	//same, but blocks until there is at least one (if any are outstanding):
+	void wait_completed(std::vector< RenderPacket * > &into);
+
+	//packets submitted but not yet taken back:
+	unsigned int outstanding() const {
+		return submitted;
+	}
+	//keeping this many outstanding means no worker should run dry:
+	unsigned int queue_depth() const {
+		return 2 * workers.size();
+	}
+	unsigned int threads() const {
+		return workers.size();
+	}
+	//one per hardware thread:
+	static unsigned int default_threads();
+
+	unsigned int blocks() const {
+		return int(blocks_setting);
+	}
+	unsigned int samples() const {
+		return int(samples_setting);
+	}
+	//fraction of each pixel's weight the solver keeps (1: keep samples() coefficients):
+	float keep_energy() const {
+		return int(energy_setting) / 1000000.0f;
+	}
+
+public slots:
+	void set_blocks(int);
+	void set_samples(int);
+	//keep_energy, in parts per million:
+	void set_energy(int);
+	//finish the packet in hand and exit workers; queued packets are dropped:
+	void stop();
+
+public:
+	//for TileWorker -- returns false once stopped:
+	bool next_job(unsigned int worker, TileJob &job);
+	//queue all but the first part of packet's blocks; returns the first part:
+	TileJob split(RenderPacket *packet);
+	//completes the packet if this was its last part:
+	void finish_part(TileJob const &job);
+	void completed(RenderPacket *packet);
+
+	//stats:
+	QAtomicInt steals; //packets run by a worker other than the one they were dealt to
+	QAtomicInt splits; //packets whose blocks were spread over the pool
+	//each worker's TileRenderer::report_stats (only once stopped):
+	void report_stats(std::ostream &into) const;
+
+private:
+	class WorkQueue {
+	public:
+		QMutex lock;
+		std::deque< RenderPacket * > packets;
+	};
+	std::vector< WorkQueue * > queues;
+	std::vector< TileWorker * > workers;
+	//parts of split tiles (checked before the queues):
+	QMutex parts_lock;
+	std::deque< TileJob > parts;
+	QAtomicInt queued; //packets in all queues, plus parts
+	QAtomicInt blocks_setting;
+	QAtomicInt samples_setting;
+	QAtomicInt energy_setting; //parts per million
+
+	//idle workers sleep here:
+	QMutex sleep_lock;
+	QWaitCondition work_ready;
+	QAtomicInt stopping;
+
+	//completed packets wait here:
+	QMutex completed_lock;
+	QWaitCondition completion;
+	std::vector< RenderPacket * > completed_packets;
+	bool ready_posted; //target has a TilesReadyEvent it hasn't answered
+
+	QObject *target;
+	unsigned int submitted;
+	unsigned int next_queue;
+};
+
+#endif //TILE_SCHEDULER_HPP
@@ -5,6 +5,67 @@
 
 using std::vector;
 
+namespace {
+
+//An image's scanlines as ARGB32, top to bottom. Images already in a 32-bit
+// non-premultiplied format are read in place; anything else is converted a
+// tile-row of scanlines at a time, so there's never a full-size copy.
+class ScanlineReader {
+public:
+	ScanlineReader(QImage const &_image) : image(_image), strip_y(-1U) {
+		direct = (image.format() == QImage::Format_ARGB32 || image.format() == QImage::Format_RGB32);
+	}
+	QRgb const *line(unsigned int y) {
+		if (direct) {
+			return reinterpret_cast< QRgb const * >(image.scanLine(y));
+		}
+		if (strip_y == -1U || y < strip_y || y >= strip_y + TileSize) {
+			strip_y = y - y % TileSize;
+			strip = image.copy(0, strip_y, image.width(), TileSize).convertToFormat(QImage::Format_ARGB32);
+		}
+		return reinterpret_cast< QRgb const * >(strip.scanLine(y - strip_y));
+	}
+private:
+	QImage const &image;
+	bool direct;
+	QImage strip;
+	unsigned int strip_y;
+};
+
+//Row sources for Tiled::import_rows:
+class LayerRows {
+public:
+	LayerRows(QImage const &from) : reader(from), width(from.width()) {
+	}
+	void operator()(unsigned int y, uint32_t *out) {
+		const QRgb * line = reader.line(y);
+		for (unsigned int x = 0; x < width; ++x) {
+			reinterpret_cast< uint8_t * >(out)[4*x+0] = qRed(line[x]);
+			reinterpret_cast< uint8_t * >(out)[4*x+1] = qGreen(line[x]);
+			reinterpret_cast< uint8_t * >(out)[4*x+2] = qBlue(line[x]);
+			reinterpret_cast< uint8_t * >(out)[4*x+3] = qAlpha(line[x]);
+		}
+	}
+	ScanlineReader reader;
+	unsigned int width;
+};
+
+class StrokeRows {
+public:
+	StrokeRows(QImage const &from) : reader(from), width(from.width()) {
+	}
+	void operator()(unsigned int y, uint8_t *out) {
+		const QRgb * line = reader.line(y);
+		for (unsigned int x = 0; x < width; ++x) {
+			out[x] = qGray(line[x]);
+		}
+	}
+	ScanlineReader reader;
+	unsigned int width;
+};
+
+}
+
 Layer::Layer(std::string const &_name, QImage const &from, const LayerOp *_op) : name(_name), op(_op) {
 	thumbnail = from.scaled(ThumbSize, ThumbSize, Qt::KeepAspectRatio, Qt::SmoothTransformation);
 	{ //checked background:
@@ -29,46 +90,16 @@ Layer::Layer(std::string const &_name, QImage const &from, const LayerOp *_op) :
 		}
 	}
 
-	const QImage argb = from.convertToFormat(QImage::Format_ARGB32);
-	Vector2ui pix_size = make_vector< unsigned int >(from.width(), from.height());
-
-	//hack-y way of converting to tiles, since I don't know for sure if
-	//QImage will pad scanlines:
-	vector< uint32_t > temp(pix_size.x * pix_size.y);
-	for (unsigned int y = 0; y < pix_size.y; ++y) {
-		const QRgb * line = reinterpret_cast< const QRgb * >(argb.scanLine(y));
-		uint32_t *out = &temp[y * pix_size.x];
-		for (unsigned int x = 0; x < pix_size.x; ++x) {
-			reinterpret_cast< uint8_t * >(out)[4*x+0] = qRed(line[x]);
-			reinterpret_cast< uint8_t * >(out)[4*x+1] = qGreen(line[x]);
-			reinterpret_cast< uint8_t * >(out)[4*x+2] = qBlue(line[x]);
-			reinterpret_cast< uint8_t * >(out)[4*x+3] = qAlpha(line[x]);
-		}
-	}
-
-
-	set(pix_size, &temp[0]);
+	LayerRows rows(from);
+	import_rows(make_vector< unsigned int >(from.width(), from.height()), rows);
 }
 
 Layer::Layer(std::string const &_name, Vector2ui pix_size, const LayerOp *_op) : Tiled< uint32_t >(pix_size), name(_name), op(_op) {
 }
 
 Stroke::Stroke(QImage const &from, const StackOp *_op) : op(_op) {
-	const QImage argb = from.convertToFormat(QImage::Format_ARGB32);
-	Vector2ui pix_size = make_vector< unsigned int >(from.width(), from.height());
-
-	//hack-y way of converting to tiles, since I don't know for sure if
-	//QImage will pad scanlines:
-	vector< uint8_t > temp(pix_size.x * pix_size.y);
-	for (unsigned int y = 0; y < pix_size.y; ++y) {
-		const QRgb * line = reinterpret_cast< const QRgb * >(argb.scanLine(y));
-		uint8_t *out = &temp[y * pix_size.x];
-		for (unsigned int x = 0; x < pix_size.x; ++x) {
-			out[x] = qGray(line[x]);
-		}
-	}
-
-	set(pix_size, &temp[0]);
+	StrokeRows rows(from);
+	import_rows(make_vector< unsigned int >(from.width(), from.height()), rows);
 }
 
 
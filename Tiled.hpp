@@ -6,19 +6,57 @@
 #include <QImage>
 
 #include <vector>
-#ifdef WIN32
-#include <unordered_set>
-#include <unordered_map>
-typedef std::unordered_set< Vector2ui, HashVector< unsigned int, 2 > > TileSet;
-typedef std::unordered_map< Vector2ui, uint32_t, HashVector< unsigned int, 2 > > TileFlags;
-#else
-#include <tr1/unordered_set>
-#include <tr1/unordered_map>
-typedef std::tr1::unordered_set< Vector2ui, HashVector< unsigned int, 2 > > TileSet;
-typedef std::tr1::unordered_map< Vector2ui, uint32_t, HashVector< unsigned int, 2 > > TileFlags;
-#endif
+#include <cstring>
 
 #include "Constants.hpp"
+#include "TileRef.hpp"
+
+//amount used for Coverage* classification (see Constants.hpp):
+inline uint8_t pixel_amount(uint8_t p) {
+	return p;
+}
+inline uint8_t pixel_amount(uint32_t p) {
+	return p >> 24;
+}
+
+//Average each 2x2 block of 'from' (a whole tile, or NULL for all zero) into
+// the quadrant of 'to' at (qx, qy) * TileSize / 2:
+inline void downsample_quadrant(uint8_t const *from, uint8_t *to, unsigned int qx, unsigned int qy) {
+	const unsigned int Half = TileSize / 2;
+	for (unsigned int y = 0; y < Half; ++y) {
+		uint8_t *out = to + (qy * Half + y) * TileSize + qx * Half;
+		if (!from) {
+			memset(out, 0, Half);
+			continue;
+		}
+		uint8_t const *a = from + 2 * y * TileSize;
+		uint8_t const *b = a + TileSize;
+		for (unsigned int x = 0; x < Half; ++x) {
+			out[x] = (a[2*x] + a[2*x+1] + b[2*x] + b[2*x+1] + 2) / 4;
+		}
+	}
+}
+//(layer pixels aren't premultiplied, so colors are weighted by alpha)
+inline void downsample_quadrant(uint32_t const *from, uint32_t *to, unsigned int qx, unsigned int qy) {
+	const unsigned int Half = TileSize / 2;
+	for (unsigned int y = 0; y < Half; ++y) {
+		uint8_t *out = reinterpret_cast< uint8_t * >(to + (qy * Half + y) * TileSize + qx * Half);
+		if (!from) {
+			memset(out, 0, sizeof(uint32_t) * Half);
+			continue;
+		}
+		uint8_t const *a = reinterpret_cast< uint8_t const * >(from + 2 * y * TileSize);
+		uint8_t const *b = a + 4 * TileSize;
+		for (unsigned int x = 0; x < Half; ++x, a += 8, b += 8, out += 4) {
+			const unsigned int w0 = a[3], w1 = a[7], w2 = b[3], w3 = b[7];
+			const unsigned int w = w0 + w1 + w2 + w3;
+			for (unsigned int c = 0; c < 3; ++c) {
+				out[c] = (w ? (a[c] * w0 + a[4+c] * w1 + b[c] * w2 + b[4+c] * w3 + w / 2) / w : 0);
+			}
+			out[3] = (w + 2) / 4;
+		}
+	}
+}
 
 
 template< typename TYPE >
@@ -54,43 +92,209 @@ public:
 	std::vector< TYPE > tiles;
 };
 
+//Per-tile flag bits on a dense grid, like ScalarTiled (so checking a tile
+// is an array read), plus a list of the tiles with any bits set (so a
+// sparse state can be walked, or cleared, without scanning the grid).
+//Tiles off the grid read as 0.
+class TileFlags {
+public:
+	TileFlags() : size(make_vector(0U, 0U)) {
+	}
+	void expand(Vector2ui new_size) {
+		if (new_size.x < size.x) new_size.x = size.x;
+		if (new_size.y < size.y) new_size.y = size.y;
+		if (new_size == size) return;
+		std::vector< Vector2ui > old;
+		old.swap(listed);
+		std::vector< uint8_t > old_bits;
+		old_bits.swap(bits);
+		const Vector2ui old_size = size;
+		size = new_size;
+		bits.assign(size.x * size.y, 0);
+		slot.assign(size.x * size.y, -1U);
+		for (std::vector< Vector2ui >::const_iterator t = old.begin(); t != old.end(); ++t) {
+			set(*t, old_bits[t->y * old_size.x + t->x]);
+		}
+	}
+	uint8_t get(Vector2ui t) const {
+		if (t.x >= size.x || t.y >= size.y) return 0;
+		return bits[t.y * size.x + t.x];
+	}
+	void set(Vector2ui t, uint8_t flags) {
+		assert(t.x < size.x && t.y < size.y);
+		const unsigned int i = t.y * size.x + t.x;
+		if (flags && slot[i] == -1U) {
+			slot[i] = listed.size();
+			listed.push_back(t);
+		} else if (!flags && slot[i] != -1U) {
+			//(the last listed tile takes this one's place)
+			const Vector2ui last = listed.back();
+			slot[last.y * size.x + last.x] = slot[i];
+			listed[slot[i]] = last;
+			listed.pop_back();
+			slot[i] = -1U;
+		}
+		bits[i] = flags;
+	}
+	void add(Vector2ui t, uint8_t flags) {
+		set(t, get(t) | flags);
+	}
+	void remove(Vector2ui t, uint8_t flags) {
+		set(t, get(t) & ~flags);
+	}
+	bool empty() const {
+		return listed.empty();
+	}
+	void clear() {
+		for (std::vector< Vector2ui >::const_iterator t = listed.begin(); t != listed.end(); ++t) {
+			bits[t->y * size.x + t->x] = 0;
+			slot[t->y * size.x + t->x] = -1U;
+		}
+		listed.clear();
+	}
+	Vector2ui size; //tiles x tiles
+	//tiles with bits set, in no particular order; clearing a tile's bits
+	// moves the last one into its place, so walk it backward when doing that:
+	std::vector< Vector2ui > listed;
+private:
+	std::vector< uint8_t > bits;
+	std::vector< uint32_t > slot; //index in listed (or -1U)
+};
+
+//TileFlags with one bit:
+class TileSet : public TileFlags {
+public:
+	void insert(Vector2ui t) {
+		set(t, 1);
+	}
+	void erase(Vector2ui t) {
+		set(t, 0);
+	}
+	bool count(Vector2ui t) const {
+		return get(t) != 0;
+	}
+};
+
+//Row source for Tiled::import from a pix_size.x-wide array:
+template< typename PIX >
+class ArrayRows {
+public:
+	ArrayRows(PIX const *_source, unsigned int _width) : source(_source), width(_width) {
+	}
+	void operator()(unsigned int y, PIX *row) const {
+		memcpy(row, source + y * width, sizeof(PIX) * width);
+	}
+	PIX const *source;
+	unsigned int width;
+};
+
+//One downsampled level of a Tiled (see Tiled::get_level_ref):
+template< typename PIX >
+class MipLevel {
+public:
+	MipLevel(Vector2ui _size) : size(_size), tiles(size.x * size.y), coverage(size.x * size.y, CoverageEmpty), stale(size.x * size.y, true) {
+	}
+	Vector2ui size; //tiles x tiles
+	std::vector< TileRef< PIX > > tiles;
+	std::vector< uint8_t > coverage;
+	//needs rebuilding from the level below; a stale tile's parent is always
+	// stale too:
+	std::vector< bool > stale;
+};
+
+//Tiles are refcounted and copy-on-write: copying a Tiled (e.g. to keep a
+// snapshot) copies tile references, not pixels, and writing to a tile that
+// someone else still references gives the writer a new version.
 template< typename PIX >
 class Tiled {
 public:
 	Tiled(Vector2ui pix_size = make_vector(0U, 0U), PIX *source = NULL) : size(make_vector(0U,0U)) {
 		set(pix_size, source);
 	}
+	Tiled(Tiled< PIX > const &o) : size(o.size), tiles(o.tiles), coverage(o.coverage), mips(o.mips) {
+	}
 	~Tiled() {
 		clear();
 	}
-	Tiled< PIX > &operator=(Tiled< PIX > const &o); //not defined
+	Tiled< PIX > &operator=(Tiled< PIX > const &o) {
+		size = o.size;
+		tiles = o.tiles;
+		coverage = o.coverage;
+		mips = o.mips;
+		return *this;
+	}
 	void set(Vector2ui pix_size, PIX *source = NULL) {
 		clear();
 		size.x = (pix_size.x + TileSize - 1) / TileSize;
 		size.y = (pix_size.y + TileSize - 1) / TileSize;
-		tiles.resize(size.x * size.y, NULL);
+		tiles.resize(size.x * size.y);
+		coverage.resize(size.x * size.y, CoverageEmpty);
 		if (source) {
-			for (unsigned int y = 0; y < pix_size.y; ++y) {
-				for (unsigned int x = 0; x < pix_size.x; ++x) {
-					PIX p = source[y * pix_size.x + x];
-					if (p) {
-						PIX *tile = get_tile(x / TileSize, y / TileSize);
-						tile[(y % TileSize) * TileSize + (x % TileSize)] = p;
+			ArrayRows< PIX > rows(source, pix_size.x);
+			import_rows(pix_size, rows);
+		}
+	}
+	//Load pixels a tile-row at a time: rows(y, row) fills in pixel row y
+	// (pix_size.x pixels; leave the rest of row alone). Tiles that come out
+	// all zero are never allocated, and coverage is worked out on the way
+	// through, so fully opaque (or fully on) tiles are already CoverageFull.
+	template< typename ROWS >
+	void import_rows(Vector2ui pix_size, ROWS &rows) {
+		set(pix_size);
+		if (size.x == 0 || size.y == 0) return;
+		//one row across every tile, zero past pix_size.x:
+		std::vector< PIX > row(size.x * TileSize, PIX(0));
+		//least and greatest pixel_amount so far in each tile of this tile-row:
+		std::vector< uint8_t > lo(size.x), hi(size.x);
+		for (unsigned int ty = 0; ty < size.y; ++ty) {
+			lo.assign(size.x, 255);
+			hi.assign(size.x, 0);
+			for (unsigned int r = 0; r < TileSize; ++r) {
+				const unsigned int y = ty * TileSize + r;
+				if (y < pix_size.y) {
+					rows(y, &row[0]);
+				} else if (y == pix_size.y) {
+					row.assign(row.size(), PIX(0));
+				}
+				for (unsigned int tx = 0; tx < size.x; ++tx) {
+					PIX const *src = &row[tx * TileSize];
+					bool nonzero = false;
+					uint8_t l = lo[tx];
+					uint8_t h = hi[tx];
+					for (unsigned int i = 0; i < TileSize; ++i) {
+						nonzero = nonzero || src[i];
+						const uint8_t amt = pixel_amount(src[i]);
+						if (amt < l) l = amt;
+						if (amt > h) h = amt;
+					}
+					lo[tx] = l;
+					hi[tx] = h;
+					TileRef< PIX > &ref = tiles[ty * size.x + tx];
+					if (!ref.get()) {
+						if (!nonzero) continue;
+						//first non-zero row; the ones above were all zero:
+						ref = TileRef< PIX >::create();
+						memset(ref.writable(), 0, sizeof(PIX) * TileSize * r);
 					}
+					memcpy(ref.writable() + r * TileSize, src, sizeof(PIX) * TileSize);
+				}
+			}
+			for (unsigned int tx = 0; tx < size.x; ++tx) {
+				uint8_t &cov = coverage[ty * size.x + tx];
+				if (!tiles[ty * size.x + tx].get() || hi[tx] == 0) {
+					cov = CoverageEmpty;
+				} else if (lo[tx] == 255) {
+					cov = CoverageFull;
+				} else {
+					cov = CoverageMixed;
 				}
 			}
 		}
 	}
 	void clear() {
-		for (typename std::vector< PIX * >::iterator t = tiles.begin();
-		t != tiles.end();
-		++t) {
-			if (*t) {
-				delete[] *t;
-				*t = NULL;
-			}
-		}
 		tiles.clear();
+		coverage.clear();
+		mips.clear();
 	}
 	void expand(Vector2ui pix_size) {
 		Vector2ui new_size;
@@ -99,47 +303,160 @@ public:
 		if (new_size.x < size.x) new_size.x = size.x;
 		if (new_size.y < size.y) new_size.y = size.y;
 		if (new_size == size) return;
-		tiles.resize(new_size.x * new_size.y, NULL);
+		mips.clear();
+		tiles.resize(new_size.x * new_size.y);
+		coverage.resize(new_size.x * new_size.y, CoverageEmpty);
 		for (unsigned int y = new_size.y - 1; y < new_size.y; --y) {
 			for (unsigned int x = new_size.x - 1; x < new_size.x; --x) {
 				assert(y * size.x + x <= y * new_size.x + x); //make sure we aren't going to want something we already overwrote.
 				if (x < size.x && y < size.y) {
 					tiles[y * new_size.x + x] = tiles[y * size.x + x];
+					coverage[y * new_size.x + x] = coverage[y * size.x + x];
 				} else {
-					tiles[y * new_size.x + x] = NULL;
+					tiles[y * new_size.x + x].reset();
+					coverage[y * new_size.x + x] = CoverageEmpty;
 				}
 			}
 		}
 		size = new_size;
 	}
-	PIX *get_tile_or_null(Vector2ui t) {
+	PIX const *get_tile_or_null(Vector2ui t) const {
 		if (t.x >= size.x) return NULL;
 		if (t.y >= size.y) return NULL;
+		return tiles[t.y * size.x + t.x].get();
+	}
+	//The current version of a tile (null if the tile is empty); holding it
+	// keeps those pixels alive and unchanged:
+	TileRef< PIX > get_ref(Vector2ui t) const {
+		if (t.x >= size.x) return TileRef< PIX >();
+		if (t.y >= size.y) return TileRef< PIX >();
 		return tiles[t.y * size.x + t.x];
 	}
+	//Writable tile, allocating (zeroed) if empty and copying it if the current
+	// version is shared:
 	PIX *get_tile(Vector2ui t) {
 		assert(t.x < size.x && t.y < size.y);
-		PIX **ret = &(tiles[t.y * size.x + t.x]);
-		if (!*ret) {
-			*ret = new PIX[TileSize * TileSize];
-			memset(*ret, 0, sizeof(PIX) * TileSize * TileSize);
+		mip_changed(t);
+		TileRef< PIX > &ref = tiles[t.y * size.x + t.x];
+		if (!ref.unique()) {
+			TileRef< PIX > old = ref;
+			ref = TileRef< PIX >::create();
+			if (old.get()) {
+				memcpy(ref.writable(), old.get(), sizeof(PIX) * TileSize * TileSize);
+			} else {
+				memset(ref.writable(), 0, sizeof(PIX) * TileSize * TileSize);
+				coverage[t.y * size.x + t.x] = CoverageEmpty;
+			}
 		}
-		return *ret;
+		return ref.writable();
 	}
 	PIX *get_tile(unsigned int x, unsigned int y) {
 		return get_tile(make_vector(x,y));
 	}
+	//Writable tile whose contents are about to be entirely replaced (so a
+	// shared version isn't copied; contents are undefined):
+	PIX *overwrite_tile(Vector2ui t) {
+		assert(t.x < size.x && t.y < size.y);
+		mip_changed(t);
+		TileRef< PIX > &ref = tiles[t.y * size.x + t.x];
+		if (!ref.unique()) {
+			ref = TileRef< PIX >::create();
+		}
+		return ref.writable();
+	}
+	uint8_t get_coverage(Vector2ui t) const {
+		if (t.x >= size.x) return CoverageEmpty;
+		if (t.y >= size.y) return CoverageEmpty;
+		return coverage[t.y * size.x + t.x];
+	}
+	//Call after writing into a tile returned by get_tile():
+	void update_coverage(Vector2ui t) {
+		assert(t.x < size.x && t.y < size.y);
+		coverage[t.y * size.x + t.x] = coverage_of(tiles[t.y * size.x + t.x].get());
+	}
+	static uint8_t coverage_of(PIX const *tile) {
+		if (!tile) return CoverageEmpty;
+		uint8_t first = pixel_amount(tile[0]);
+		if (first != 0 && first != 255) return CoverageMixed;
+		for (unsigned int i = 1; i < TileSize * TileSize; ++i) {
+			if (pixel_amount(tile[i]) != first) return CoverageMixed;
+		}
+		return (first == 0 ? CoverageEmpty : CoverageFull);
+	}
+
+	//Mip pyramid: tile t of level 'level' (0 == full resolution) covers the
+	// (TileSize << level)-pixel square at t * (TileSize << level), averaged
+	// down 2^level times. Level tiles are built from the level below when
+	// first asked for, and rebuilt once a tile under them is written (through
+	// get_tile or overwrite_tile), so -- like taking refs -- only call these
+	// on the thread that writes the tiles:
+	TileRef< PIX > get_level_ref(unsigned int level, Vector2ui t) {
+		if (level == 0) return get_ref(t);
+		if (!build_level_tile(level, t)) return TileRef< PIX >();
+		MipLevel< PIX > const &mip = mips[level - 1];
+		return mip.tiles[t.y * mip.size.x + t.x];
+	}
+	uint8_t get_level_coverage(unsigned int level, Vector2ui t) {
+		if (level == 0) return get_coverage(t);
+		if (!build_level_tile(level, t)) return CoverageEmpty;
+		MipLevel< PIX > const &mip = mips[level - 1];
+		return mip.coverage[t.y * mip.size.x + t.x];
+	}
+
 	Vector2ui size; //tiles x tiles
-	std::vector< PIX * > tiles; //tile storage, 0 == "fully transparent"
+	std::vector< TileRef< PIX > > tiles; //tile storage, null == "fully transparent"
+	std::vector< uint8_t > coverage; //per-tile Coverage* values, kept up to date by update_coverage(); for layers, CoverageFull means fully opaque
+	std::vector< MipLevel< PIX > > mips; //mips[l-1] is level l; added as they're asked for
+
+private:
+	//mark the level tiles over full-resolution tile t as needing a rebuild:
+	void mip_changed(Vector2ui t) {
+		for (unsigned int l = 0; l < mips.size(); ++l) {
+			t.x /= 2;
+			t.y /= 2;
+			std::vector< bool >::reference stale = mips[l].stale[t.y * mips[l].size.x + t.x];
+			if (stale) break; //(so is everything above)
+			stale = true;
+		}
+	}
+	//bring level tile t up to date; false if it's off the edge:
+	bool build_level_tile(unsigned int level, Vector2ui t) {
+		assert(level > 0);
+		while (mips.size() < level) {
+			Vector2ui below = (mips.empty() ? size : mips.back().size);
+			mips.push_back(MipLevel< PIX >(make_vector((below.x + 1) / 2, (below.y + 1) / 2)));
+		}
+		MipLevel< PIX > &mip = mips[level - 1];
+		if (t.x >= mip.size.x || t.y >= mip.size.y) return false;
+		const unsigned int i = t.y * mip.size.x + t.x;
+		if (!mip.stale[i]) return true;
+		TileRef< PIX > quads[4];
+		bool any = false;
+		for (unsigned int q = 0; q < 4; ++q) {
+			quads[q] = get_level_ref(level - 1, make_vector(2 * t.x + q % 2, 2 * t.y + q / 2));
+			any = any || quads[q].get();
+		}
+		//(a new version, since packets may still hold the old one)
+		mip.tiles[i].reset();
+		if (any) {
+			mip.tiles[i] = TileRef< PIX >::create();
+			for (unsigned int q = 0; q < 4; ++q) {
+				downsample_quadrant(quads[q].get(), mip.tiles[i].writable(), q % 2, q / 2);
+			}
+		}
+		mip.coverage[i] = coverage_of(mip.tiles[i].get());
+		mip.stale[i] = false;
+		return true;
+	}
 };
 
 class LayerOp;
 
+//(copying or assigning a Layer or Stroke shares its tiles; see Tiled)
 class Layer : public Tiled< uint32_t > {
 public:
 	Layer(std::string const &name, QImage const &from, const LayerOp *op); //load image contents
 	Layer(std::string const &name, Vector2ui pix_size, const LayerOp *op); //blank layer
-	Layer &operator=(Layer const &o); //not defined yet.
 	std::string name;
 	QImage thumbnail;
 	const LayerOp *op;
@@ -151,7 +468,6 @@ class Stroke : public Tiled< uint8_t > {
 public:
 	Stroke(QImage const &from, const StackOp *op);
 	Stroke(Vector2ui pix_size, const StackOp *op);
-	Stroke &operator=(Stroke const &o); //not defined yet.
 	const StackOp *op;
 };
 
@@ -0,0 +1,59 @@
+#ifndef COEF_ARENA_HPP
+#define COEF_ARENA_HPP
+
+#include <stdint.h>
+
+#include <vector>
+#include <algorithm>
+#include <cassert>
+
+//Structure-of-arrays storage for the per-pixel coefficient lists used by
+// the tile solvers. Pixel p owns entries [offset[p], offset[p] + count[p])
+// of 'weight' (amount of the stacking) and 'ind' (which stacking).
+//Solvers keep two of these and swap them after every stroke, so storage
+// is reused across strokes and blocks rather than re-allocated.
+class CoefArena {
+public:
+	CoefArena() : used(0) {
+	}
+	//every pixel gets the single coefficient (1.0, stacking 0):
+	void reset(unsigned int pixels) {
+		weight.assign(pixels, 1.0f);
+		ind.assign(pixels, 0);
+		offset.resize(pixels);
+		count.assign(pixels, 1);
+		for (unsigned int p = 0; p < pixels; ++p) {
+			offset[p] = p;
+		}
+		used = pixels;
+	}
+	//make room for 'pixels' lists holding up to 'entries' coefficients in total.
+	//Contents are not preserved.
+	void prepare(unsigned int pixels, unsigned int entries) {
+		if (weight.size() < entries) {
+			weight.resize(entries);
+			ind.resize(entries);
+		}
+		offset.resize(pixels);
+		count.resize(pixels);
+		used = 0;
+	}
+	void swap(CoefArena &o) {
+		weight.swap(o.weight);
+		ind.swap(o.ind);
+		offset.swap(o.offset);
+		count.swap(o.count);
+		std::swap(used, o.used);
+	}
+	unsigned int pixels() const {
+		assert(offset.size() == count.size());
+		return offset.size();
+	}
+	std::vector< float > weight;
+	std::vector< uint32_t > ind;
+	std::vector< uint32_t > offset;
+	std::vector< uint32_t > count;
+	uint32_t used; //entries [0, used) of weight/ind are live.
+};
+
+#endif //COEF_ARENA_HPP
@@ -0,0 +1,123 @@
+#include "resolve.hpp"
+#include "coef_arena.hpp"
+
+#include <Vector/Vector.hpp>
+
+#include <ctime>
+#include <iostream>
+#include <vector>
+
+using std::cerr;
+using std::endl;
+using std::vector;
+
+void resolve_coefs(CoefArena const &coefs, uint32_t const * const *comps, uint32_t *out) {
+	const unsigned int pixels = coefs.pixels();
+	for (unsigned int pix = 0; pix < pixels; ++pix) {
+		const float *weight = &coefs.weight[coefs.offset[pix]];
+		const uint32_t *ind = &coefs.ind[coefs.offset[pix]];
+		const unsigned int count = coefs.count[pix];
+		//lone full-weight coefficient (the common untouched pixel) resolves exactly to its composite:
+		if (count == 1 && weight[0] == 1.0f) {
+			out[pix] = comps[ind[0]][pix];
+			continue;
+		}
+		__m128 color_acc = _mm_setzero_ps();
+		float coef_acc = 0.0f;
+		for (unsigned int c = 0; c < count; ++c) {
+			assert(comps[ind[c]]);
+			color_acc = accumulate_color(color_acc, weight[c], comps[ind[c]][pix]);
+			coef_acc += weight[c];
+		}
+		if (coef_acc == 0.0f) {
+			cerr << "Dire circumstance: we may have trimmed almost all of the energy from a pixel (has " << count << " remaining.)" << endl;
+		} else {
+			color_acc = _mm_mul_ps(color_acc, _mm_set1_ps(1.0f / coef_acc));
+		}
+		out[pix] = pack_color(color_acc);
+	}
+}
+
+void resolve_coefs_scalar(CoefArena const &coefs, uint32_t const * const *comps, uint32_t *out) {
+	const unsigned int pixels = coefs.pixels();
+	for (unsigned int pix = 0; pix < pixels; ++pix) {
+		const float *weight = &coefs.weight[coefs.offset[pix]];
+		const uint32_t *ind = &coefs.ind[coefs.offset[pix]];
+		const unsigned int count = coefs.count[pix];
+		Vector4f color_acc = make_vector(0.0f, 0.0f, 0.0f, 0.0f);
+		float coef_acc = 0.0f;
+		for (unsigned int c = 0; c < count; ++c) {
+			assert(comps[ind[c]]);
+			uint32_t src = comps[ind[c]][pix];
+			color_acc += weight[c] * make_vector< float >( (src >> 24) & 0xff, (src >> 16) & 0xff, (src >> 8) & 0xff, src & 0xff);
+			coef_acc += weight[c];
+		}
+		if (coef_acc == 0.0f) {
+			cerr << "Dire circumstance: we may have trimmed almost all of the energy from a pixel (has " << count << " remaining.)" << endl;
+		} else {
+			color_acc *= 1.0f / coef_acc;
+		}
+		{ //convert to bytes:
+			int a = color_acc.c[0];
+			int b = color_acc.c[1];
+			int g = color_acc.c[2];
+			int r = color_acc.c[3];
+			if (a < 0) a = 0;
+			if (a > 255) a = 255;
+			if (b < 0) b = 0;
+			if (b > 255) b = 255;
+			if (g < 0) g = 0;
+			if (g > 255) g = 255;
+			if (r < 0) r = 0;
+			if (r > 255) r = 255;
+			out[pix] = (a << 24) | (b << 16) | (g << 8) | (r);
+		}
+	}
+}
+
+bool benchmark_resolve(std::ostream &report) {
+	//a 128x128 tile over 40 composites; a quarter of the pixels are
+	// untouched, the rest have 2-16 coefficients:
+	const unsigned int Pixels = 128 * 128;
+	const unsigned int Comps = 40;
+	const unsigned int Iters = 200;
+	uint32_t seed = 1;
+	#define NEXT() (seed = seed * 1664525U + 1013904223U)
+	vector< vector< uint32_t > > comp_pix(Comps, vector< uint32_t >(Pixels));
+	vector< uint32_t const * > comps(Comps);
+	for (unsigned int c = 0; c < Comps; ++c) {
+		for (unsigned int p = 0; p < Pixels; ++p) {
+			comp_pix[c][p] = 0xff000000 | (NEXT() >> 8);
+		}
+		comps[c] = &comp_pix[c][0];
+	}
+	CoefArena coefs;
+	coefs.prepare(Pixels, Pixels * 16);
+	for (unsigned int p = 0; p < Pixels; ++p) {
+		unsigned int count = (NEXT() >> 16) % 4 == 0 ? 1 : 2 + (NEXT() >> 16) % 15;
+		coefs.offset[p] = coefs.used;
+		coefs.count[p] = count;
+		for (unsigned int c = 0; c < count; ++c) {
+			coefs.weight[coefs.used] = (count == 1 ? 1.0f : ((NEXT() >> 8) & 0xffff) / 65535.0f);
+			coefs.ind[coefs.used] = (NEXT() >> 16) % Comps;
+			++coefs.used;
+		}
+	}
+	#undef NEXT
+
+	vector< uint32_t > out_scalar(Pixels), out_simd(Pixels);
+	std::clock_t before = std::clock();
+	for (unsigned int iter = 0; iter < Iters; ++iter) {
+		resolve_coefs_scalar(coefs, &comps[0], &out_scalar[0]);
+	}
+	double scalar = (std::clock() - before) / double(CLOCKS_PER_SEC);
+	before = std::clock();
+	for (unsigned int iter = 0; iter < Iters; ++iter) {
+		resolve_coefs(coefs, &comps[0], &out_simd[0]);
+	}
+	double simd = (std::clock() - before) / double(CLOCKS_PER_SEC);
+
+	bool same = (out_scalar == out_simd);
+	report << "resolve (" << coefs.used / double(Pixels) << " coefs/pixel): scalar " << scalar * 1e9 / (Iters * Pixels) << " ns/px, simd " << simd * 1e9 / (Iters * Pixels) << " ns/px (" << scalar / simd << "x); outputs " << (same ? "identical" : "DIFFER") << "." << endl;
+	return same;
+}
@@ -0,0 +1,46 @@
+#ifndef RESOLVE_HPP
+#define RESOLVE_HPP
+
+#include <stdint.h>
+#include <emmintrin.h>
+
+#include <ostream>
+
+class CoefArena;
+
+//Final resolve for the solvers: each pixel's color is the weighted average
+// of the stacking composites named by its coefficients.
+
+//out[pix] = sum(weight * comps[ind][pix]) / sum(weight), for every pixel of
+// 'coefs'. Bit-identical to resolve_coefs_scalar.
+void resolve_coefs(CoefArena const &coefs, uint32_t const * const *comps, uint32_t *out);
+
+//The per-channel Vector4f loop resolve_coefs replaced (reference for checks):
+void resolve_coefs_scalar(CoefArena const &coefs, uint32_t const * const *comps, uint32_t *out);
+
+//Time both on a synthetic tile, writing a summary to 'report'. Returns
+// false if their outputs differ.
+bool benchmark_resolve(std::ostream &report);
+
+//Building blocks, for solvers that accumulate colors their own way.
+//Lanes hold channels in byte order (lane 0 == low byte):
+inline __m128 unpack_color(uint32_t col) {
+	const __m128i zero = _mm_setzero_si128();
+	__m128i c = _mm_unpacklo_epi8(_mm_cvtsi32_si128(col), zero);
+	return _mm_cvtepi32_ps(_mm_unpacklo_epi16(c, zero));
+}
+
+//acc += weight * col:
+inline __m128 accumulate_color(__m128 acc, float weight, uint32_t col) {
+	return _mm_add_ps(acc, _mm_mul_ps(_mm_set1_ps(weight), unpack_color(col)));
+}
+
+//Truncate toward zero, saturate to [0,255] (no branches), and pack:
+inline uint32_t pack_color(__m128 color) {
+	__m128i c = _mm_cvttps_epi32(color);
+	c = _mm_packs_epi32(c, c);
+	c = _mm_packus_epi16(c, c);
+	return _mm_cvtsi128_si32(c);
+}
+
+#endif //RESOLVE_HPP
@@ -0,0 +1,373 @@
+#include "simd_compose.hpp"
+
+#include <cassert>
+#include <sstream>
+
+#include "sse_compose.hpp"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_AVX_KERNELS
+#include <immintrin.h>
+#endif
+
+using std::vector;
+using std::string;
+
+//Reference: one layer at a time, on pixels [begin, count).
+static void generic_stack_from(StackLayer const *layers, unsigned int layer_count, uint32_t *into, uint32_t begin, uint32_t count) {
+	for (unsigned int l = 0; l < layer_count; ++l) {
+		if (layers[l].multiply) {
+			generic_multiply(into + begin, layers[l].fg + begin, into + begin, count - begin);
+		} else {
+			generic_compose(into + begin, layers[l].fg + begin, into + begin, count - begin);
+		}
+	}
+}
+
+static void generic_stack(StackLayer const *layers, unsigned int layer_count, uint32_t *into, uint32_t count) {
+	generic_stack_from(layers, layer_count, into, 0, count);
+}
+
+//Between layers the accumulator stays unpacked to 16 bits; every blend
+// result is in [0,255], so skipping the pack/unpack doesn't change anything.
+//(The alpha lane holds junk until the end, but nothing reads it: blends
+// take alpha from fg.)
+static void sse2_stack_from(StackLayer const *layers, unsigned int layer_count, uint32_t *into, uint32_t begin, uint32_t count) {
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i alpha_mask = _mm_set1_epi32(0xff000000);
+	unsigned int i = begin;
+	for (; i + 4 <= count; i += 4) {
+		__m128i acc = _mm_loadu_si128(reinterpret_cast< const __m128i * >(into + i));
+		__m128i lo = _mm_unpacklo_epi8(acc, zero);
+		__m128i hi = _mm_unpackhi_epi8(acc, zero);
+		for (unsigned int l = 0; l < layer_count; l += layers[l].run) {
+			const StackLayer *run = layers + l;
+			const StackLayer *run_end = run + layers[l].run;
+			if (run->multiply) {
+				for (; run != run_end; ++run) {
+					__m128i fg = _mm_loadu_si128(reinterpret_cast< const __m128i * >(run->fg + i));
+					lo = multiply_2px(_mm_unpacklo_epi8(fg, zero), lo);
+					hi = multiply_2px(_mm_unpackhi_epi8(fg, zero), hi);
+				}
+			} else {
+				for (; run != run_end; ++run) {
+					__m128i fg = _mm_loadu_si128(reinterpret_cast< const __m128i * >(run->fg + i));
+					lo = over_2px(_mm_unpacklo_epi8(fg, zero), lo);
+					hi = over_2px(_mm_unpackhi_epi8(fg, zero), hi);
+				}
+			}
+		}
+		acc = _mm_or_si128(alpha_mask, _mm_packus_epi16(lo, hi));
+		_mm_storeu_si128(reinterpret_cast< __m128i * >(into + i), acc);
+	}
+	generic_stack_from(layers, layer_count, into, i, count);
+}
+
+static void sse2_stack(StackLayer const *layers, unsigned int layer_count, uint32_t *into, uint32_t count) {
+	sse2_stack_from(layers, layer_count, into, 0, count);
+}
+
+#ifdef HAVE_AVX_KERNELS
+
+//The wide kernels do the same math as over_2px/multiply_2px in sse_compose.hpp
+// -- including the hack-y /255 -> (r2i + 1 + (r2i >> 8)) >> 8 -- just on more
+// pixels at once. unpack/pack work per 128-bit lane, so pixel order survives.
+//Stores are unaligned, so no pre-roll is needed; leftovers go to generic_*.
+
+#define AVX2 __attribute__((target("avx2")))
+#define AVX512 __attribute__((target("avx512f,avx512bw")))
+
+AVX2 static inline __m256i div255_8px(__m256i v) {
+	return _mm256_srli_epi16(_mm256_add_epi16(v, _mm256_add_epi16(_mm256_set1_epi16(1), _mm256_srli_epi16(v, 8))), 8);
+}
+
+AVX2 static inline __m256i blend_8px(__m256i fg, __m256i bg, __m256i alpha) {
+	//bg << 8 - bg + (fg - bg) * alpha:
+	__m256i out = _mm256_sub_epi16(_mm256_slli_epi16(bg, 8), bg);
+	out = _mm256_add_epi16(out, _mm256_mullo_epi16(_mm256_sub_epi16(fg, bg), alpha));
+	return div255_8px(out);
+}
+
+AVX2 static inline __m256i alpha_8px(__m256i fg) {
+	__m256i alpha = _mm256_shufflelo_epi16(fg, _MM_SHUFFLE(3,3,3,3));
+	return _mm256_shufflehi_epi16(alpha, _MM_SHUFFLE(3,3,3,3));
+}
+
+template< bool MULTIPLY >
+AVX2 static void avx2_kernel(uint32_t const *bg_tile, uint32_t const *fg_tile, uint32_t *into_tile, uint32_t count) {
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i alpha_mask = _mm256_set1_epi32(0xff000000);
+	unsigned int i = 0;
+	for (; i + 8 <= count; i += 8) {
+		__m256i bg = _mm256_loadu_si256(reinterpret_cast< const __m256i * >(bg_tile + i));
+		__m256i fg = _mm256_loadu_si256(reinterpret_cast< const __m256i * >(fg_tile + i));
+		__m256i bglo = _mm256_unpacklo_epi8(bg, zero);
+		__m256i bghi = _mm256_unpackhi_epi8(bg, zero);
+		__m256i fglo = _mm256_unpacklo_epi8(fg, zero);
+		__m256i fghi = _mm256_unpackhi_epi8(fg, zero);
+		__m256i alo = alpha_8px(fglo);
+		__m256i ahi = alpha_8px(fghi);
+		if (MULTIPLY) {
+			fglo = div255_8px(_mm256_mullo_epi16(fglo, bglo));
+			fghi = div255_8px(_mm256_mullo_epi16(fghi, bghi));
+		}
+		__m256i out = _mm256_packus_epi16(blend_8px(fglo, bglo, alo), blend_8px(fghi, bghi, ahi));
+		out = _mm256_or_si256(alpha_mask, out);
+		_mm256_storeu_si256(reinterpret_cast< __m256i * >(into_tile + i), out);
+	}
+	if (MULTIPLY) {
+		generic_multiply(bg_tile + i, fg_tile + i, into_tile + i, count - i);
+	} else {
+		generic_compose(bg_tile + i, fg_tile + i, into_tile + i, count - i);
+	}
+}
+
+//Each layer's blend depends on the one below, so a chunk is StackWays
+// vectors wide to give the core independent work while it waits.
+const unsigned int StackWays = 4;
+
+AVX2 static void avx2_stack_from(StackLayer const *layers, unsigned int layer_count, uint32_t *into, uint32_t begin, uint32_t count) {
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i alpha_mask = _mm256_set1_epi32(0xff000000);
+	unsigned int i = begin;
+	for (; i + 8 * StackWays <= count; i += 8 * StackWays) {
+		__m256i lo[StackWays], hi[StackWays];
+		for (unsigned int w = 0; w < StackWays; ++w) {
+			__m256i acc = _mm256_loadu_si256(reinterpret_cast< const __m256i * >(into + i + 8 * w));
+			lo[w] = _mm256_unpacklo_epi8(acc, zero);
+			hi[w] = _mm256_unpackhi_epi8(acc, zero);
+		}
+		for (unsigned int l = 0; l < layer_count; l += layers[l].run) {
+			const StackLayer *run = layers + l;
+			const StackLayer *run_end = run + layers[l].run;
+			if (run->multiply) {
+				for (; run != run_end; ++run) {
+					for (unsigned int w = 0; w < StackWays; ++w) {
+						__m256i fg = _mm256_loadu_si256(reinterpret_cast< const __m256i * >(run->fg + i + 8 * w));
+						__m256i fglo = _mm256_unpacklo_epi8(fg, zero);
+						__m256i fghi = _mm256_unpackhi_epi8(fg, zero);
+						lo[w] = blend_8px(div255_8px(_mm256_mullo_epi16(fglo, lo[w])), lo[w], alpha_8px(fglo));
+						hi[w] = blend_8px(div255_8px(_mm256_mullo_epi16(fghi, hi[w])), hi[w], alpha_8px(fghi));
+					}
+				}
+			} else {
+				for (; run != run_end; ++run) {
+					for (unsigned int w = 0; w < StackWays; ++w) {
+						__m256i fg = _mm256_loadu_si256(reinterpret_cast< const __m256i * >(run->fg + i + 8 * w));
+						__m256i fglo = _mm256_unpacklo_epi8(fg, zero);
+						__m256i fghi = _mm256_unpackhi_epi8(fg, zero);
+						lo[w] = blend_8px(fglo, lo[w], alpha_8px(fglo));
+						hi[w] = blend_8px(fghi, hi[w], alpha_8px(fghi));
+					}
+				}
+			}
+		}
+		for (unsigned int w = 0; w < StackWays; ++w) {
+			__m256i out = _mm256_or_si256(alpha_mask, _mm256_packus_epi16(lo[w], hi[w]));
+			_mm256_storeu_si256(reinterpret_cast< __m256i * >(into + i + 8 * w), out);
+		}
+	}
+	sse2_stack_from(layers, layer_count, into, i, count);
+}
+
+AVX2 static void avx2_stack(StackLayer const *layers, unsigned int layer_count, uint32_t *into, uint32_t count) {
+	avx2_stack_from(layers, layer_count, into, 0, count);
+}
+
+AVX512 static inline __m512i div255_16px(__m512i v) {
+	return _mm512_srli_epi16(_mm512_add_epi16(v, _mm512_add_epi16(_mm512_set1_epi16(1), _mm512_srli_epi16(v, 8))), 8);
+}
+
+AVX512 static inline __m512i blend_16px(__m512i fg, __m512i bg, __m512i alpha) {
+	__m512i out = _mm512_sub_epi16(_mm512_slli_epi16(bg, 8), bg);
+	out = _mm512_add_epi16(out, _mm512_mullo_epi16(_mm512_sub_epi16(fg, bg), alpha));
+	return div255_16px(out);
+}
+
+AVX512 static inline __m512i alpha_16px(__m512i fg) {
+	__m512i alpha = _mm512_shufflelo_epi16(fg, _MM_SHUFFLE(3,3,3,3));
+	return _mm512_shufflehi_epi16(alpha, _MM_SHUFFLE(3,3,3,3));
+}
+
+template< bool MULTIPLY >
+AVX512 static void avx512_kernel(uint32_t const *bg_tile, uint32_t const *fg_tile, uint32_t *into_tile, uint32_t count) {
+	const __m512i zero = _mm512_setzero_si512();
+	const __m512i alpha_mask = _mm512_set1_epi32(0xff000000);
+	unsigned int i = 0;
+	for (; i + 16 <= count; i += 16) {
+		__m512i bg = _mm512_loadu_si512(bg_tile + i);
+		__m512i fg = _mm512_loadu_si512(fg_tile + i);
+		__m512i bglo = _mm512_unpacklo_epi8(bg, zero);
+		__m512i bghi = _mm512_unpackhi_epi8(bg, zero);
+		__m512i fglo = _mm512_unpacklo_epi8(fg, zero);
+		__m512i fghi = _mm512_unpackhi_epi8(fg, zero);
+		__m512i alo = alpha_16px(fglo);
+		__m512i ahi = alpha_16px(fghi);
+		if (MULTIPLY) {
+			fglo = div255_16px(_mm512_mullo_epi16(fglo, bglo));
+			fghi = div255_16px(_mm512_mullo_epi16(fghi, bghi));
+		}
+		__m512i out = _mm512_packus_epi16(blend_16px(fglo, bglo, alo), blend_16px(fghi, bghi, ahi));
+		out = _mm512_or_si512(alpha_mask, out);
+		_mm512_storeu_si512(into_tile + i, out);
+	}
+	//leftovers (fewer than 16) are worth one pass of the 8-px kernel:
+	avx2_kernel< MULTIPLY >(bg_tile + i, fg_tile + i, into_tile + i, count - i);
+}
+
+#undef AVX2
+AVX512 static void avx512_stack_from(StackLayer const *layers, unsigned int layer_count, uint32_t *into, uint32_t begin, uint32_t count) {
+	const __m512i zero = _mm512_setzero_si512();
+	const __m512i alpha_mask = _mm512_set1_epi32(0xff000000);
+	unsigned int i = begin;
+	for (; i + 16 * StackWays <= count; i += 16 * StackWays) {
+		__m512i lo[StackWays], hi[StackWays];
+		for (unsigned int w = 0; w < StackWays; ++w) {
+			__m512i acc = _mm512_loadu_si512(into + i + 16 * w);
+			lo[w] = _mm512_unpacklo_epi8(acc, zero);
+			hi[w] = _mm512_unpackhi_epi8(acc, zero);
+		}
+		for (unsigned int l = 0; l < layer_count; l += layers[l].run) {
+			const StackLayer *run = layers + l;
+			const StackLayer *run_end = run + layers[l].run;
+			if (run->multiply) {
+				for (; run != run_end; ++run) {
+					for (unsigned int w = 0; w < StackWays; ++w) {
+						__m512i fg = _mm512_loadu_si512(run->fg + i + 16 * w);
+						__m512i fglo = _mm512_unpacklo_epi8(fg, zero);
+						__m512i fghi = _mm512_unpackhi_epi8(fg, zero);
+						lo[w] = blend_16px(div255_16px(_mm512_mullo_epi16(fglo, lo[w])), lo[w], alpha_16px(fglo));
+						hi[w] = blend_16px(div255_16px(_mm512_mullo_epi16(fghi, hi[w])), hi[w], alpha_16px(fghi));
+					}
+				}
+			} else {
+				for (; run != run_end; ++run) {
+					for (unsigned int w = 0; w < StackWays; ++w) {
+						__m512i fg = _mm512_loadu_si512(run->fg + i + 16 * w);
+						__m512i fglo = _mm512_unpacklo_epi8(fg, zero);
+						__m512i fghi = _mm512_unpackhi_epi8(fg, zero);
+						lo[w] = blend_16px(fglo, lo[w], alpha_16px(fglo));
+						hi[w] = blend_16px(fghi, hi[w], alpha_16px(fghi));
+					}
+				}
+			}
+		}
+		for (unsigned int w = 0; w < StackWays; ++w) {
+			__m512i out = _mm512_or_si512(alpha_mask, _mm512_packus_epi16(lo[w], hi[w]));
+			_mm512_storeu_si512(into + i + 16 * w, out);
+		}
+	}
+	avx2_stack_from(layers, layer_count, into, i, count);
+}
+
+AVX512 static void avx512_stack(StackLayer const *layers, unsigned int layer_count, uint32_t *into, uint32_t count) {
+	avx512_stack_from(layers, layer_count, into, 0, count);
+}
+
+#undef AVX512
+
+#endif //HAVE_AVX_KERNELS
+
+vector< ComposeKernels > available_compose_kernels() {
+	vector< ComposeKernels > ret;
+	ret.push_back(ComposeKernels("generic", generic_compose, generic_multiply, generic_stack));
+	ret.push_back(ComposeKernels("sse2", sse_compose, sse_multiply, sse2_stack));
+#ifdef HAVE_AVX_KERNELS
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		ret.push_back(ComposeKernels("avx2", avx2_kernel< false >, avx2_kernel< true >, avx2_stack));
+		if (__builtin_cpu_supports("avx512bw")) {
+			ret.push_back(ComposeKernels("avx512bw", avx512_kernel< false >, avx512_kernel< true >, avx512_stack));
+		}
+	}
+#endif
+	return ret;
+}
+
+ComposeKernels const &compose_kernels() {
+	static ComposeKernels best = available_compose_kernels().back();
+	return best;
+}
+
+bool check_compose_kernels(string *error) {
+	//every (bg, fg) byte pair, in each channel, for each alpha. A couple of
+	// extra pixels and an offset start make sure leftovers/alignment get run.
+	const unsigned int Pairs = 256 * 256;
+	const unsigned int Count = Pairs + 7;
+	vector< uint32_t > bg(Count + 1), fg(Count + 1), want(Count + 1), got(Count + 1);
+	vector< ComposeKernels > kernels = available_compose_kernels();
+	for (unsigned int alpha = 0; alpha < 256; ++alpha) {
+		for (unsigned int i = 0; i < Count + 1; ++i) {
+			uint32_t b = i % 256;
+			uint32_t f = (i / 256) % 256;
+			bg[i] = 0xff000000 | (b << 16) | ((255 - b) << 8) | b;
+			fg[i] = (alpha << 24) | ((f ^ 0x5a) << 16) | (f << 8) | f;
+		}
+		for (unsigned int op = 0; op < 2; ++op) {
+			if (op == 0) {
+				generic_compose(&bg[1], &fg[1], &want[1], Count);
+			} else {
+				generic_multiply(&bg[1], &fg[1], &want[1], Count);
+			}
+			for (vector< ComposeKernels >::const_iterator k = kernels.begin(); k != kernels.end(); ++k) {
+				(op == 0 ? k->over : k->multiply)(&bg[1], &fg[1], &got[1], Count);
+				for (unsigned int i = 1; i < Count + 1; ++i) {
+					if (got[i] != want[i]) {
+						if (error) {
+							std::ostringstream str;
+							str << k->isa << (op == 0 ? " over" : " multiply") << " mismatch: bg " << std::hex << bg[i] << " fg " << fg[i] << " gives " << got[i] << " instead of " << want[i];
+							*error = str.str();
+						}
+						return false;
+					}
+				}
+			}
+		}
+	}
+
+	//random stacks, with runs of both ops and plenty of 0/255 alpha:
+	const unsigned int Layers = 7;
+	uint32_t seed = 1;
+	vector< vector< uint32_t > > fgs(Layers, vector< uint32_t >(Count + 1));
+	for (unsigned int trial = 0; trial < 20; ++trial) {
+		StackLayer stack[Layers];
+		for (unsigned int l = 0; l < Layers; ++l) {
+			for (unsigned int i = 0; i < Count + 1; ++i) {
+				seed = seed * 1664525U + 1013904223U;
+				uint32_t alpha = (seed >> 24);
+				if (alpha < 64) alpha = 0;
+				if (alpha > 192) alpha = 255;
+				fgs[l][i] = (alpha << 24) | ((seed >> 4) & 0xffffff);
+			}
+			seed = seed * 1664525U + 1013904223U;
+			stack[l].fg = &fgs[l][1];
+			stack[l].multiply = ((seed >> 16) % 3 == 0);
+		}
+		for (unsigned int l = Layers - 1; l < Layers; --l) {
+			stack[l].run = 1;
+			if (l + 1 < Layers && stack[l + 1].multiply == stack[l].multiply) {
+				stack[l].run += stack[l + 1].run;
+			}
+		}
+		for (unsigned int i = 0; i < Count + 1; ++i) {
+			bg[i] = 0xff000000 | (i * 2654435761U);
+		}
+		want = bg;
+		generic_stack(stack, Layers, &want[1], Count);
+		for (vector< ComposeKernels >::const_iterator k = kernels.begin(); k != kernels.end(); ++k) {
+			got = bg;
+			k->stack(stack, Layers, &got[1], Count);
+			if (got != want) {
+				if (error) {
+					unsigned int i = 0;
+					while (got[i] == want[i]) ++i;
+					std::ostringstream str;
+					str << k->isa << " stack mismatch at pixel " << i - 1 << ": gives " << std::hex << got[i] << " instead of " << want[i];
+					*error = str.str();
+				}
+				return false;
+			}
+		}
+	}
+	return true;
+}
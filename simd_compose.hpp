@@ -0,0 +1,49 @@
+#ifndef SIMD_COMPOSE_HPP
+#define SIMD_COMPOSE_HPP
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+//Compositing kernels, picked once (via cpuid) from the widest instruction
+// set available: AVX-512BW (16 px), AVX2 (8 px), or SSE2 (4 px; see sse_compose.hpp).
+//All of them give exactly the same results as generic_compose/generic_multiply.
+
+typedef void (*ComposeFn)(uint32_t const *bg_tile, uint32_t const *fg_tile, uint32_t *into_tile, uint32_t count);
+
+//One layer of a fused stack composite:
+class StackLayer {
+public:
+	uint32_t const *fg;
+	bool multiply; //else over
+	unsigned int run; //number of layers, starting here, with the same op
+};
+
+//Composite layers[0], layers[1], ... (bottom to top) over into. Fused
+// kernels keep each chunk of pixels in registers through the whole stack.
+typedef void (*ComposeStackFn)(StackLayer const *layers, unsigned int layer_count, uint32_t *into, uint32_t count);
+
+class ComposeKernels {
+public:
+	ComposeKernels(std::string const &_isa = "", ComposeFn _over = 0, ComposeFn _multiply = 0, ComposeStackFn _stack = 0) : isa(_isa), over(_over), multiply(_multiply), stack(_stack) {
+	}
+	std::string isa;
+	ComposeFn over;
+	ComposeFn multiply;
+	ComposeStackFn stack;
+};
+
+//Best kernels for this machine:
+ComposeKernels const &compose_kernels();
+
+//All kernels this machine can run (including generic and sse2):
+std::vector< ComposeKernels > available_compose_kernels();
+
+//Exhaustively compare every available kernel against generic_* for all
+// (background, foreground, alpha) byte values, and stack kernels against
+// layer-at-a-time generic_* on random stacks. Returns false and fills in
+// error on mismatch.
+bool check_compose_kernels(std::string *error = 0);
+
+#endif //SIMD_COMPOSE_HPP
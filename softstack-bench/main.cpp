@@ -0,0 +1,512 @@
+//softstack-bench: times the tile solvers on a scene and reports JSON.
+//  softstack-bench (-l name mode image [-l ...] [-s spec image ...] | --gen params)
+//                  [--modes m1,m2,...] [--iters n] [--warmup n]
+//                  [--reference file] [--save prefix] [-o out.json]
+//Modes are 'full[-bN]', 'dense', 'trimmed-K[-r][-eP][-bN]', 'pairs-K[-bN]'
+// and 'sampled-S[-bN]', where K is coefficients kept (at most, with eP), r
+// renormalizes trimmed weights, eP keeps just enough coefficients to hold P
+// percent of each pixel's weight, S is samples per pixel, and bN means blocks
+// of TileSize*TileSize/N pixels.
+
+#include "Scene.hpp"
+#include "SceneGenerator.hpp"
+#include "Renderer.hpp"
+#include "LayerOps.hpp"
+#include "StackOps.hpp"
+#include "default_bg.hpp"
+#include "simd_compose.hpp"
+#include "update_tile_full.hpp"
+#include "update_tile_trimmed.hpp"
+#include "update_tile_pairs.hpp"
+#include "update_tile_dense.hpp"
+#include "update_tile_sampled.hpp"
+
+#include <QCoreApplication>
+#include <QStringList>
+#include <QImage>
+#include <QElapsedTimer>
+
+#include <algorithm>
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using std::vector;
+using std::string;
+
+namespace {
+
+class Mode {
+public:
+	enum Kind {
+		Full,
+		Dense,
+		Trimmed,
+		Pairs,
+		Sampled
+	};
+	Mode(string const &_name = "", Kind _kind = Full, unsigned int _coefs = -1U, unsigned int _block_size = TileSize * TileSize, bool _renormalize = false) : name(_name), kind(_kind), coefs(_coefs), block_size(_block_size), renormalize(_renormalize), keep_energy(1.0f) {
+	}
+	string name;
+	Kind kind;
+	unsigned int coefs; //(samples, for Sampled)
+	unsigned int block_size;
+	bool renormalize;
+	float keep_energy;
+	//(trimmed and sampled modes keep stats in the scratch given)
+	void run(RenderPacket *pkt, TrimmedScratch *scratch = NULL, SampledScratch *sampled_scratch = NULL) const {
+		switch (kind) {
+			case Full:
+				update_tile_full(pkt->layers, pkt->strokes, pkt->out, block_size);
+				break;
+			case Dense:
+				update_tile_dense(pkt->layers, pkt->strokes, pkt->out);
+				break;
+			case Trimmed:
+				update_tile_trimmed(pkt->layers, pkt->strokes, pkt->out, coefs, block_size, NULL, NULL, scratch, &pkt->layer_coverage, renormalize, keep_energy);
+				break;
+			case Pairs:
+				update_tile_trimmed_pairs(pkt->layers, pkt->strokes, pkt->out, coefs, block_size);
+				break;
+			case Sampled:
+				update_tile_sampled(pkt->layers, pkt->strokes, pkt->out, coefs, block_size, NULL, NULL, sampled_scratch, &pkt->layer_coverage);
+				break;
+		}
+	}
+};
+
+//parse 'full-b32', 'trimmed-10-b16', 'trimmed-40-r-e99.5', 'sampled-16', etc; returns false if 'name' isn't a mode:
+bool parse_mode(string const &name, Mode *mode) {
+	assert(mode);
+	vector< string > parts;
+	{
+		std::istringstream str(name);
+		string part;
+		while (std::getline(str, part, '-')) {
+			parts.push_back(part);
+		}
+	}
+	if (parts.empty()) return false;
+	unsigned int divisions = 16;
+	if (parts.size() >= 2 && parts.back().size() > 1 && parts.back()[0] == 'b') {
+		divisions = atoi(parts.back().c_str() + 1);
+		if (divisions == 0 || (TileSize * TileSize) % divisions != 0) return false;
+		parts.pop_back();
+	}
+	bool renormalize = false;
+	float keep_energy = 1.0f;
+	while (parts.size() >= 3 && parts[0] == "trimmed") {
+		if (parts.back() == "r") {
+			renormalize = true;
+		} else if (parts.back().size() > 1 && parts.back()[0] == 'e') {
+			keep_energy = atof(parts.back().c_str() + 1) / 100.0f;
+			if (!(keep_energy > 0.0f && keep_energy <= 1.0f)) return false;
+		} else {
+			return false;
+		}
+		parts.pop_back();
+	}
+	if (parts.size() == 1 && parts[0] == "full") {
+		*mode = Mode(name, Mode::Full, -1U, TileSize * TileSize / divisions);
+		return true;
+	}
+	if (parts.size() == 1 && parts[0] == "dense") {
+		*mode = Mode(name, Mode::Dense);
+		return true;
+	}
+	if (parts.size() == 2 && parts[0] == "sampled") {
+		unsigned int samples = atoi(parts[1].c_str());
+		if (samples == 0) return false;
+		*mode = Mode(name, Mode::Sampled, samples, TileSize * TileSize / divisions);
+		return true;
+	}
+	if (parts.size() == 2 && (parts[0] == "trimmed" || parts[0] == "pairs")) {
+		unsigned int coefs = atoi(parts[1].c_str());
+		if (coefs == 0) return false;
+		*mode = Mode(name, (parts[0] == "trimmed" ? Mode::Trimmed : Mode::Pairs), coefs, TileSize * TileSize / divisions, renormalize);
+		mode->keep_energy = keep_energy;
+		return true;
+	}
+	return false;
+}
+
+//Time per tile, over every (timed) iteration:
+class Timings {
+public:
+	vector< double > ns;
+	//q in [0,1]; nearest-rank:
+	double quantile(double q) {
+		assert(!ns.empty());
+		unsigned int rank = std::min< unsigned int >(ns.size() - 1, (unsigned int)(q * ns.size()));
+		std::nth_element(ns.begin(), ns.begin() + rank, ns.end());
+		return ns[rank];
+	}
+};
+
+class Error {
+public:
+	Error() : max(0), sum(0) {
+	}
+	int max;
+	unsigned long long sum;
+};
+
+Error compare(vector< uint32_t > const &ref, vector< uint32_t > const &pix) {
+	assert(ref.size() == pix.size());
+	Error err;
+	for (unsigned int i = 0; i < ref.size(); ++i) {
+		for (unsigned int c = 0; c < 32; c += 8) {
+			int a = (ref[i] >> c) & 0xff;
+			int b = (pix[i] >> c) & 0xff;
+			int e = abs(a - b);
+			err.sum += e;
+			err.max = std::max(err.max, e);
+		}
+	}
+	return err;
+}
+
+//Render every packet with 'mode', untimed, into a linear image:
+vector< uint32_t > render(Scene const &scene, vector< RenderPacket * > const &workload, Mode const &mode) {
+	vector< uint32_t > pix(scene.pix_size.x * scene.pix_size.y, 0xff000000);
+	for (vector< RenderPacket * >::const_iterator p = workload.begin(); p != workload.end(); ++p) {
+		memcpy(&((*p)->out[0]), default_bg(), sizeof(uint32_t) * TileSize * TileSize);
+		mode.run(*p);
+		scene.store_result(*p, &pix[0]);
+	}
+	return pix;
+}
+
+bool save_image(vector< uint32_t > &pix, Vector2ui size, QString const &file) {
+	QImage image = QImage(reinterpret_cast< uchar * >(&pix[0]), size.x, size.y, QImage::Format_RGB32);
+	return image.save(file);
+}
+
+//FNV-1a over everything the reference depends on:
+class SceneKey {
+public:
+	SceneKey() : hash(14695981039346656037ULL) {
+	}
+	void add(const void *data, size_t bytes) {
+		const unsigned char *b = reinterpret_cast< const unsigned char * >(data);
+		for (size_t i = 0; i < bytes; ++i) {
+			hash = (hash ^ b[i]) * 1099511628211ULL;
+		}
+	}
+	void add(string const &str) {
+		add(str.c_str(), str.size() + 1);
+	}
+	template< typename PIX >
+	void add(Tiled< PIX > const &tiled) {
+		add(&tiled.size, sizeof(tiled.size));
+		for (unsigned int t = 0; t < tiled.tiles.size(); ++t) {
+			PIX const *pix = tiled.tiles[t].get();
+			const unsigned char present = (pix ? 1 : 0);
+			add(&present, 1);
+			if (pix) add(pix, sizeof(PIX) * TileSize * TileSize);
+		}
+	}
+	unsigned long long hash;
+};
+
+//Key for a scene's cached reference (ops, names, and pixels of every layer
+// and stroke, plus how the reference is rendered):
+string reference_key(Scene const &scene, Mode const &mode) {
+	SceneKey key;
+	key.add(&scene.pix_size, sizeof(scene.pix_size));
+	const vector< string > names = scene.layer_names();
+	for (unsigned int l = 0; l < scene.layers.size(); ++l) {
+		key.add(scene.layers[l]->name);
+		key.add(scene.layers[l]->op->shorthand());
+		key.add(*scene.layers[l]);
+	}
+	for (unsigned int s = 0; s < scene.strokes.size(); ++s) {
+		key.add(scene.strokes[s]->op->shorthand(names));
+		key.add(*scene.strokes[s]);
+	}
+	std::ostringstream str;
+	str << mode.name << "-b" << (TileSize * TileSize / mode.block_size) << " " << std::hex << std::setw(16) << std::setfill('0') << key.hash;
+	return str.str();
+}
+
+//Time every mode on one scene, appending a JSON object to 'json'. The reference
+// is cached in reference_file if given (keyed by reference_key, in
+// reference_file.key); results go to save_prefix-mode.png:
+void bench_scene(Scene const &scene, string const &label, vector< Mode > const &modes, unsigned int iters, unsigned int warmup, QString const &reference_file, QString const &save_prefix, std::ostream &json) {
+	vector< RenderPacket * > workload = scene.result_workload();
+	const unsigned int pixels = scene.pix_size.x * scene.pix_size.y;
+	std::cerr << scene.pix_size.x << "x" << scene.pix_size.y << " is " << workload.size() << " tiles." << std::endl;
+
+	//Reference image, from the untrimmed solver (or the cache):
+	const Mode reference_mode("full", Mode::Full, -1U, TileSize * TileSize / 32);
+	const string key = reference_key(scene, reference_mode);
+	const string key_file = string(qPrintable(reference_file)) + ".key";
+	vector< uint32_t > reference;
+	if (reference_file != "") {
+		QImage cached(reference_file);
+		string cached_key;
+		{
+			std::ifstream key_in(key_file.c_str());
+			std::getline(key_in, cached_key);
+		}
+		if (!cached.isNull() && cached_key != key) {
+			std::cerr << "WARNING: reference '" << qPrintable(reference_file) << "' doesn't match this scene (no matching key in '" << key_file << "'); recomputing." << std::endl;
+		} else if (!cached.isNull() && cached.width() == (int)scene.pix_size.x && cached.height() == (int)scene.pix_size.y) {
+			cached = cached.convertToFormat(QImage::Format_RGB32);
+			reference.resize(pixels);
+			for (unsigned int y = 0; y < scene.pix_size.y; ++y) {
+				memcpy(&reference[y * scene.pix_size.x], cached.scanLine(y), sizeof(uint32_t) * scene.pix_size.x);
+			}
+			std::cerr << "Using reference from '" << qPrintable(reference_file) << "'." << std::endl;
+		} else if (!cached.isNull()) {
+			std::cerr << "WARNING: reference '" << qPrintable(reference_file) << "' is the wrong size; recomputing." << std::endl;
+		}
+	}
+	if (reference.empty()) {
+		std::cerr << "Computing reference with full..." << std::endl;
+		reference = render(scene, workload, reference_mode);
+		if (reference_file != "") {
+			std::ofstream key_out(key_file.c_str());
+			key_out << key << std::endl;
+			if (!key_out || !save_image(reference, scene.pix_size, reference_file)) {
+				std::cerr << "WARNING: can't write reference to '" << qPrintable(reference_file) << "' (and its key to '" << key_file << "')." << std::endl;
+			}
+		}
+	}
+
+	json << "\t\t{ \"scene\": \"" << label << "\",\n";
+	json << "\t\t\"width\": " << scene.pix_size.x << ", \"height\": " << scene.pix_size.y << ", \"tiles\": " << workload.size() << ",\n";
+	json << "\t\t\"layers\": " << scene.layers.size() << ", \"strokes\": " << scene.strokes.size() << ",\n";
+	json << "\t\t\"modes\": [\n";
+	for (vector< Mode >::const_iterator m = modes.begin(); m != modes.end(); ++m) {
+		std::cerr << "Running " << m->name << "..." << std::endl;
+		for (unsigned int iter = 0; iter < warmup; ++iter) {
+			render(scene, workload, *m);
+		}
+		Timings timings;
+		timings.ns.reserve(iters * workload.size());
+		TrimmedScratch scratch;
+		SampledScratch sampled_scratch;
+		for (unsigned int iter = 0; iter < iters; ++iter) {
+			for (vector< RenderPacket * >::iterator p = workload.begin(); p != workload.end(); ++p) {
+				memcpy(&((*p)->out[0]), default_bg(), sizeof(uint32_t) * TileSize * TileSize);
+				QElapsedTimer timer;
+				timer.start();
+				m->run(*p, &scratch, &sampled_scratch);
+				timings.ns.push_back(timer.nsecsElapsed());
+			}
+		}
+		double total = 0.0;
+		for (vector< double >::iterator t = timings.ns.begin(); t != timings.ns.end(); ++t) {
+			total += *t;
+		}
+		const double median = timings.quantile(0.5);
+		const double p95 = timings.quantile(0.95);
+
+		//results of the last pass are still in the packets:
+		vector< uint32_t > pix(pixels, 0xff000000);
+		for (vector< RenderPacket * >::iterator p = workload.begin(); p != workload.end(); ++p) {
+			scene.store_result(*p, &pix[0]);
+		}
+		Error err = compare(reference, pix);
+		if (save_prefix != "") {
+			QString file = save_prefix + m->name.c_str() + ".png";
+			if (!save_image(pix, scene.pix_size, file)) {
+				std::cerr << "WARNING: can't write '" << qPrintable(file) << "'." << std::endl;
+			}
+		}
+
+		std::cerr << "  median " << median / 1000.0 << "us, p95 " << p95 / 1000.0 << "us per tile; maxerr " << err.max << " sumerr " << err.sum;
+		if (m->kind == Mode::Trimmed) {
+			std::cerr << "; " << scratch.mean_kept() << " coefs per pixel (max " << scratch.max_kept << ")";
+		}
+		if (m->kind == Mode::Sampled) {
+			std::cerr << "; " << sampled_scratch.mean_slots() << " stackings per block";
+		}
+		std::cerr << std::endl;
+		json << "\t\t\t{ \"name\": \"" << m->name << "\"";
+		json << ", \"ns_per_tile\": { \"median\": " << median << ", \"p95\": " << p95 << ", \"mean\": " << total / timings.ns.size() << " }";
+		json << ", \"ns_per_pixel\": { \"median\": " << median / (TileSize * TileSize) << ", \"p95\": " << p95 / (TileSize * TileSize) << " }";
+		json << ", \"max_error\": " << err.max << ", \"sum_error\": " << err.sum;
+		if (m->kind == Mode::Trimmed) {
+			json << ", \"coefs_per_pixel\": { \"mean\": " << scratch.mean_kept() << ", \"max\": " << scratch.max_kept << " }";
+		}
+		if (m->kind == Mode::Sampled) {
+			json << ", \"stackings_per_block\": " << sampled_scratch.mean_slots();
+		}
+		json << " }";
+		json << (m + 1 != modes.end() ? ",\n" : "\n");
+	}
+	json << "\t\t] }";
+
+	for (vector< RenderPacket * >::iterator p = workload.begin(); p != workload.end(); ++p) {
+		delete *p;
+	}
+
+}
+
+void usage() {
+	std::cerr << "Usage:\n"
+		"  softstack-bench (-l name mode image [-l ...] [-s spec image ...] | --gen params)\n"
+		"                  [--modes m1,m2,...] [--iters n] [--warmup n]\n"
+		"                  [--reference file] [--save prefix] [-o out.json]\n"
+		"  --gen         generate scenes instead; params are key=value[:value...],...\n"
+		"                  (every combination of listed values is run). Keys, with defaults:\n"
+		"                  " << SceneParams().describe() << "\n"
+		"  --modes       solvers to time (default full-b32,trimmed-40,trimmed-20,trimmed-10,trimmed-5,pairs-10)\n"
+		"                  full[-bN] | dense | trimmed-K[-r][-eP][-bN] | pairs-K[-bN] | sampled-S[-bN];\n"
+		"                  blocks are TileSize^2/N (default N=16), r renormalizes the weight trimming\n"
+		"                  drops, eP keeps only the coefficients (up to K) holding P percent of each\n"
+		"                  pixel's weight, and S is stacking samples per pixel\n"
+		"  --iters n     timed passes over every tile (default 5)\n"
+		"  --warmup n    untimed passes first (default 1)\n"
+		"  --reference   image to measure error against; written (with 'full') if it doesn't\n"
+		"                exist or its key (in file.key) doesn't match the scene\n"
+		"  --save        also write each mode's result to prefix-mode.png\n"
+		"  -o file       write JSON here instead of stdout\n";
+}
+
+}
+
+int main(int argc, char **argv) {
+	QCoreApplication app(argc, argv);
+
+	Scene scene;
+	string mode_list = "full-b32,trimmed-40,trimmed-20,trimmed-10,trimmed-5,pairs-10";
+	unsigned int iters = 5;
+	unsigned int warmup = 1;
+	QString reference_file = "";
+	QString save_prefix = "";
+	QString out_file = "";
+	vector< SceneParams > sweep;
+	bool arg_error = false;
+
+	QStringList args = app.arguments();
+	if (!args.empty()) {
+		args.pop_front(); //program name
+	}
+	while (!args.empty()) {
+		if (scene.parse_arg(args, &arg_error)) continue;
+		QString opt = args.front();
+		args.pop_front();
+		if (opt == "-h" || opt == "--help") {
+			usage();
+			return 0;
+		} else if (opt == "--modes" || opt == "--iters" || opt == "--warmup" || opt == "--reference" || opt == "--save" || opt == "--gen" || opt == "-o") {
+			if (args.empty()) {
+				std::cerr << "ERROR: Expecting '" << qPrintable(opt) << "' to be followed by a value." << std::endl;
+				arg_error = true;
+				break;
+			}
+			QString val = args.front();
+			args.pop_front();
+			bool ok = true;
+			if (opt == "--modes") {
+				mode_list = qPrintable(val);
+			} else if (opt == "--iters") {
+				iters = val.toUInt(&ok);
+				ok = ok && iters > 0;
+			} else if (opt == "--warmup") {
+				warmup = val.toUInt(&ok);
+			} else if (opt == "--reference") {
+				reference_file = val;
+			} else if (opt == "--save") {
+				save_prefix = val;
+			} else if (opt == "--gen") {
+				string error = "";
+				if (!parse_scene_sweep(qPrintable(val), &sweep, &error)) {
+					std::cerr << "ERROR: In '--gen': " << error << std::endl;
+					arg_error = true;
+				}
+			} else {
+				out_file = val;
+			}
+			if (!ok) {
+				std::cerr << "ERROR: Can't use '" << qPrintable(val) << "' for '" << qPrintable(opt) << "'." << std::endl;
+				arg_error = true;
+			}
+		} else {
+			std::cerr << "ERROR: Unknown argument '" << qPrintable(opt) << "'." << std::endl;
+			arg_error = true;
+		}
+	}
+
+	vector< Mode > modes;
+	{
+		std::istringstream str(mode_list);
+		string name;
+		while (std::getline(str, name, ',')) {
+			if (name == "") continue;
+			Mode mode;
+			if (!parse_mode(name, &mode)) {
+				std::cerr << "ERROR: Unknown mode '" << name << "'." << std::endl;
+				arg_error = true;
+				continue;
+			}
+			modes.push_back(mode);
+		}
+	}
+	if (!arg_error && modes.empty()) {
+		std::cerr << "ERROR: No modes to run." << std::endl;
+		arg_error = true;
+	}
+	if (!arg_error && scene.layers.empty() && sweep.empty()) {
+		std::cerr << "ERROR: Nothing to render; add some layers with '-l' or generate them with '--gen'." << std::endl;
+		arg_error = true;
+	}
+	if (!arg_error && !scene.layers.empty() && !sweep.empty()) {
+		std::cerr << "ERROR: Use either '-l' or '--gen', not both." << std::endl;
+		arg_error = true;
+	}
+	if (arg_error) {
+		usage();
+		return 1;
+	}
+
+	std::ostringstream json;
+	json << std::fixed << std::setprecision(2);
+	json << "{\n";
+	json << "\t\"isa\": \"" << compose_kernels().isa << "\",\n";
+	json << "\t\"iters\": " << iters << ", \"warmup\": " << warmup << ",\n";
+	json << "\t\"runs\": [\n";
+	if (sweep.empty()) {
+		QString prefix = "";
+		if (save_prefix != "") {
+			prefix = save_prefix + "-";
+		}
+		bench_scene(scene, "files", modes, iters, warmup, reference_file, prefix, json);
+		json << "\n";
+	} else {
+		for (unsigned int i = 0; i < sweep.size(); ++i) {
+			std::cerr << "Scene " << i << " of " << sweep.size() << ": " << sweep[i].describe() << std::endl;
+			Scene generated;
+			generate_scene(sweep[i], &generated);
+			std::ostringstream prefix;
+			if (save_prefix != "") {
+				prefix << qPrintable(save_prefix) << "-" << i << "-";
+			}
+			bench_scene(generated, sweep[i].describe(), modes, iters, warmup, (sweep.size() == 1 ? reference_file : QString("")), prefix.str().c_str(), json);
+			json << (i + 1 < sweep.size() ? ",\n" : "\n");
+		}
+	}
+	json << "\t]\n";
+	json << "}\n";
+
+	if (out_file != "") {
+		std::ofstream out(qPrintable(out_file));
+		out << json.str();
+		if (!out) {
+			std::cerr << "ERROR: Can't write '" << qPrintable(out_file) << "'." << std::endl;
+			return 1;
+		}
+	} else {
+		std::cout << json.str();
+	}
+	return 0;
+}
@@ -0,0 +1,146 @@
+//softstack-render: composites layers and strokes to an image file, no
+// display needed. Takes the same '-l' and '-s' arguments as sparse:
+//  softstack-render -l name mode image [-l ...] [-s spec image ...] -o out.png
+//                   [-j threads] [--blocks n] [--samples n] [--energy percent]
+
+#include "Scene.hpp"
+#include "Renderer.hpp"
+#include "TileScheduler.hpp"
+
+#include <QCoreApplication>
+#include <QStringList>
+#include <QImage>
+#include <QTime>
+
+#include <iostream>
+#include <vector>
+
+using std::vector;
+
+namespace {
+
+void usage() {
+	std::cerr << "Usage:\n"
+		"  softstack-render -l name mode image [-l ...] [-s spec image ...] -o out.png\n"
+		"                   [-j threads] [--blocks n] [--samples n] [--energy percent]\n"
+		"  -l name mode image  add a layer (mode as in sparse, e.g. 'over')\n"
+		"  -s spec image       add a stroke with shorthand opspec 'spec'\n"
+		"  -o file             where to write the composite\n"
+		"  -j threads          worker threads (default: one per hardware thread)\n"
+		"  --blocks n          blocks per tile (default 8)\n"
+		"  --samples n         coefficients kept per block (default 10)\n"
+		"  --energy percent    keep only as many coefficients (up to --samples) as\n"
+		"                      hold this much of each pixel's weight (default 100)\n";
+}
+
+}
+
+int main(int argc, char **argv) {
+	QCoreApplication app(argc, argv);
+
+	Scene scene;
+	QString out_file = "";
+	unsigned int threads = 0;
+	int blocks = 8;
+	int samples = 10;
+	double energy = 100.0;
+	bool arg_error = false;
+
+	QStringList args = app.arguments();
+	if (!args.empty()) {
+		args.pop_front(); //program name
+	}
+	while (!args.empty()) {
+		if (scene.parse_arg(args, &arg_error)) continue;
+		QString opt = args.front();
+		args.pop_front();
+		if (opt == "-h" || opt == "--help") {
+			usage();
+			return 0;
+		} else if (opt == "-o" || opt == "-j" || opt == "--blocks" || opt == "--samples" || opt == "--energy") {
+			if (args.empty()) {
+				std::cerr << "ERROR: Expecting '" << qPrintable(opt) << "' to be followed by a value." << std::endl;
+				arg_error = true;
+				break;
+			}
+			QString val = args.front();
+			args.pop_front();
+			bool ok = true;
+			if (opt == "-o") {
+				out_file = val;
+			} else if (opt == "-j") {
+				threads = val.toUInt(&ok);
+			} else if (opt == "--blocks") {
+				blocks = val.toInt(&ok);
+			} else if (opt == "--samples") {
+				samples = val.toInt(&ok);
+			} else {
+				energy = val.toDouble(&ok);
+				ok = ok && energy > 0.0 && energy <= 100.0;
+			}
+			if (!ok) {
+				std::cerr << "ERROR: Can't read '" << qPrintable(val) << "' as a number for '" << qPrintable(opt) << "'." << std::endl;
+				arg_error = true;
+			}
+		} else {
+			std::cerr << "ERROR: Unknown argument '" << qPrintable(opt) << "'." << std::endl;
+			arg_error = true;
+		}
+	}
+	if (!arg_error && scene.layers.empty()) {
+		std::cerr << "ERROR: Nothing to render; add some layers with '-l'." << std::endl;
+		arg_error = true;
+	}
+	if (!arg_error && out_file == "") {
+		std::cerr << "ERROR: No output file given; use '-o'." << std::endl;
+		arg_error = true;
+	}
+	if (arg_error) {
+		usage();
+		return 1;
+	}
+
+	const Vector2ui pix_size = scene.pix_size;
+	const Vector2ui tiles = scene.tiles();
+	vector< uint32_t > pix(pix_size.x * pix_size.y, 0xff000000);
+
+	TileScheduler scheduler(NULL, threads);
+	scheduler.set_blocks(blocks);
+	scheduler.set_samples(samples);
+	scheduler.set_energy(int(energy * 10000.0 + 0.5));
+	std::cerr << "Rendering " << pix_size.x << "x" << pix_size.y << " (" << tiles.x * tiles.y << " tiles) on " << scheduler.threads() << " threads." << std::endl;
+
+	QTime timer;
+	timer.start();
+	//keep the pool fed, but only queue_depth() tiles in memory at once:
+	unsigned int next = 0;
+	vector< RenderPacket * > batch;
+	vector< RenderPacket * > done;
+	while (next < tiles.x * tiles.y || scheduler.outstanding()) {
+		batch.clear();
+		while (next < tiles.x * tiles.y && scheduler.outstanding() + batch.size() < scheduler.queue_depth()) {
+			batch.push_back(scene.result_packet(make_vector(next % tiles.x, next / tiles.x)));
+			++next;
+		}
+		scheduler.submit(batch);
+		done.clear();
+		scheduler.wait_completed(done);
+		for (vector< RenderPacket * >::iterator p = done.begin(); p != done.end(); ++p) {
+			scene.store_result(*p, &pix[0]);
+			RenderPacket::recycle(*p);
+		}
+	}
+	scheduler.stop();
+	std::cerr << "Rendered in " << timer.elapsed() << "ms (" << int(scheduler.steals) << " steals)." << std::endl;
+	scheduler.report_stats(std::cerr);
+	report_allocations(std::cerr);
+
+	QImage image = QImage(reinterpret_cast< uchar * >(&pix[0]), pix_size.x, pix_size.y, QImage::Format_RGB32);
+	if (!image.save(out_file)) {
+		std::cerr << "ERROR: Can't write image to '" << qPrintable(out_file) << "'." << std::endl;
+		return 1;
+	}
+	std::cerr << "Wrote '" << qPrintable(out_file) << "'." << std::endl;
+
+	return 0;
+}
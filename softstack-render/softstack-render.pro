@@ -0,0 +1,56 @@
+#Headless batch renderer: just the solvers and the tile pool, no widgets or GL.
+TEMPLATE = app
+TARGET = softstack-render
+CONFIG += console
+CONFIG -= app_bundle
+INCLUDEPATH += ..
+DEPENDPATH += ..
+
+HEADERS += ../coefs.hpp
+HEADERS += ../coef_arena.hpp
+HEADERS += ../update_tile_trimmed.hpp
+HEADERS += ../update_tile_sampled.hpp
+HEADERS += ../update_tile_uniform.hpp
+HEADERS += ../resolve.hpp
+HEADERS += ../OrderingCache.hpp
+HEADERS += ../CompositeTree.hpp
+HEADERS += ../default_bg.hpp
+HEADERS += ../simd_compose.hpp
+HEADERS += ../Constants.hpp
+HEADERS += ../Renderer.hpp
+HEADERS += ../TileScheduler.hpp
+HEADERS += ../Tiled.hpp
+HEADERS += ../TileRef.hpp
+HEADERS += ../TilePool.hpp
+HEADERS += ../LayerOps.hpp
+HEADERS += ../StackOps.hpp
+HEADERS += ../Scene.hpp
+
+SOURCES += ../update_tile_trimmed.cpp
+SOURCES += ../update_tile_sampled.cpp
+SOURCES += ../update_tile_uniform.cpp
+SOURCES += ../OrderingCache.cpp
+SOURCES += ../CompositeTree.cpp
+SOURCES += ../default_bg.cpp
+SOURCES += ../coefs.cpp
+SOURCES += ../resolve.cpp
+SOURCES += ../Renderer.cpp
+SOURCES += ../TileScheduler.cpp
+SOURCES += ../Tiled.cpp
+SOURCES += ../TilePool.cpp
+SOURCES += ../LayerOps.cpp
+SOURCES += ../simd_compose.cpp
+SOURCES += ../StackOps.cpp
+SOURCES += ../Scene.cpp
+SOURCES += main.cpp
+
+#QImage (for loading and saving) is in QtGui, but nothing here opens a window:
+QT -= opengl
+!win32 {
+	QMAKE_CFLAGS_DEBUG += -Werror -g -O3
+	QMAKE_CFLAGS_RELEASE += -Werror -g -O3
+	QMAKE_CXXFLAGS += -Werror -g -O3
+}
+win32 {
+	QMAKE_CXXFLAGS += /Iutil /wd4146
+}
@@ -4,9 +4,17 @@ HEADERS += gl_errors.hpp
 HEADERS += coefs.hpp
 HEADERS += update_tile_dense.hpp
 HEADERS += update_tile_trimmed.hpp
+HEADERS += update_tile_pairs.hpp
+HEADERS += coef_arena.hpp
+HEADERS += resolve.hpp
+HEADERS += OrderingCache.hpp
+HEADERS += CompositeTree.hpp
 HEADERS += update_tile_full.hpp
+HEADERS += update_tile_uniform.hpp
+HEADERS += update_tile_sampled.hpp
 HEADERS += default_bg.hpp
 HEADERS += sse_compose.hpp
+HEADERS += simd_compose.hpp
 HEADERS += Constants.hpp
 HEADERS += LayerList.hpp
 HEADERS += StrokeList.hpp
@@ -14,8 +22,12 @@ HEADERS += BrushParams.hpp
 HEADERS += StackSelect.hpp
 HEADERS += Canvas.hpp
 HEADERS += Renderer.hpp
+HEADERS += TileScheduler.hpp
 HEADERS += Misc.hpp
 HEADERS += Tiled.hpp
+HEADERS += TileQueue.hpp
+HEADERS += TileRef.hpp
+HEADERS += TilePool.hpp
 HEADERS += LayerOps.hpp
 HEADERS += StackOps.hpp
 HEDDERS += StrokeDraw.hpp
@@ -24,18 +36,27 @@ HEADERS += GLHacks.hpp
 
 SOURCES += update_tile_dense.cpp
 SOURCES += update_tile_trimmed.cpp
+SOURCES += update_tile_pairs.cpp
+SOURCES += OrderingCache.cpp
+SOURCES += CompositeTree.cpp
 SOURCES += update_tile_full.cpp
+SOURCES += update_tile_uniform.cpp
+SOURCES += update_tile_sampled.cpp
 SOURCES += default_bg.cpp
 SOURCES += coefs.cpp
+SOURCES += resolve.cpp
 SOURCES += Canvas.cpp
 SOURCES += Renderer.cpp
+SOURCES += TileScheduler.cpp
 SOURCES += LayerList.cpp
 SOURCES += StrokeList.cpp
 SOURCES += BrushParams.cpp
 SOURCES += StackSelect.cpp
 SOURCES += Misc.cpp
 SOURCES += Tiled.cpp
+SOURCES += TilePool.cpp
 SOURCES += LayerOps.cpp
+SOURCES += simd_compose.cpp
 SOURCES += StackOps.cpp
 SOURCES += StrokeDraw.cpp
 SOURCES += App.cpp
@@ -1,3 +1,6 @@
+#ifndef SSE_COMPOSE_HPP
+#define SSE_COMPOSE_HPP
+
 #include <xmmintrin.h>
 
 inline void sse_compose(uint32_t const *bg_tile, uint32_t const *fg_tile, uint32_t *into_tile, uint32_t count);
@@ -39,8 +42,9 @@ inline __m128i multiply_2px(__m128i fg, __m128i bg) {
 	//bg << 8:
 	__m128i bg_shift_8 = _mm_slli_epi16(bg, 8);
 
-	//Multiply:
+	//Multiply (using same /255 trick as below, so we match generic_multiply):
 	fg = _mm_mullo_epi16(fg, bg);
+	fg = _mm_add_epi16(fg, _mm_add_epi16(_mm_set1_epi16(1), _mm_srli_epi16(fg, 8)));
 	fg = _mm_srli_epi16(fg, 8);
 
 	//subtract bg from everything:
@@ -67,6 +71,7 @@ inline void sse_multiply(uint32_t const *bg_tile, uint32_t const *fg_tile, uint3
 
 	//pre-roll -- count into_tile should be 16-byte aligned:
 	unsigned int pre = 4 - ((into_tile - (uint32_t*)(NULL)) % 4);
+	if (pre > count) pre = count;
 	if (pre != 4) {
 		generic_multiply(bg_tile, fg_tile, into_tile, pre);
 		bg_tile += pre;
@@ -74,6 +79,7 @@ inline void sse_multiply(uint32_t const *bg_tile, uint32_t const *fg_tile, uint3
 		into_tile += pre;
 		count -= pre;
 	}
+	if (count == 0) return;
 
 	assert((uint64_t(into_tile) & 0xf) == 0);
 
@@ -187,6 +193,7 @@ inline void sse_compose(uint32_t const *bg_tile, uint32_t const *fg_tile, uint32
 
 	//pre-roll -- count into_tile should be 16-byte aligned:
 	unsigned int pre = 4 - ((into_tile - (uint32_t*)(NULL)) % 4);
+	if (pre > count) pre = count;
 	if (pre != 4) {
 		generic_compose(bg_tile, fg_tile, into_tile, pre);
 		bg_tile += pre;
@@ -194,6 +201,7 @@ inline void sse_compose(uint32_t const *bg_tile, uint32_t const *fg_tile, uint32
 		into_tile += pre;
 		count -= pre;
 	}
+	if (count == 0) return;
 
 	assert((uint64_t(into_tile) & 0xf) == 0);
 
@@ -253,3 +261,5 @@ inline void sse_compose(uint32_t const *bg_tile, uint32_t const *fg_tile, uint32
 	generic_compose(bg_tile, fg_tile, into_tile, count);
 
 }
+
+#endif //SSE_COMPOSE_HPP
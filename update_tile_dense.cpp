@@ -2,6 +2,7 @@
 #include "LayerOps.hpp"
 #include "StackOps.hpp"
 #include "coefs.hpp"
+#include "resolve.hpp"
 #include <Vector/Vector.hpp>
 
 using std::vector;
@@ -54,7 +55,7 @@ void update_tile_dense(std::vector< std::pair< const LayerOp *, const uint32_t *
 			coefs = new_coefs;
 		}
 		//Okay, now have proper coefs for all stackings, do a compositing pass:
-		Vector4f color = make_vector(0.0f, 0.0f, 0.0f, 0.0f);
+		__m128 color = _mm_setzero_ps();
 		for (unsigned int idx = 0; idx < coefs.size(); ++idx) {
 			if (coefs[idx] == 0.0f) continue;
 			vector< uint32_t > order = to_stacking(idx, opaque.size());
@@ -62,23 +63,9 @@ void update_tile_dense(std::vector< std::pair< const LayerOp *, const uint32_t *
 			for (vector< uint32_t >::iterator o = order.begin(); o != order.end(); ++o) {
 				layers[opaque[*o]].first->compose(&col, &(layers[opaque[*o]].second[pix]), &col, 1);
 			}
-			color += coefs[idx] * make_vector< float >( (col >> 24) & 0xff, (col >> 16) & 0xff, (col >> 8) & 0xff, col & 0xff);
-		}
-		{ //color labels here are maybe not actually right, but whatever:
-			int a = color.c[0];
-			int b = color.c[1];
-			int g = color.c[2];
-			int r = color.c[3];
-			if (a < 0) a = 0;
-			if (a > 255) a = 255;
-			if (b < 0) b = 0;
-			if (b > 255) b = 255;
-			if (g < 0) g = 0;
-			if (g > 255) g = 255;
-			if (r < 0) r = 0;
-			if (r > 255) r = 255;
-			out[pix] = (a << 24) | (b << 16) | (g << 8) | (r);
+			color = accumulate_color(color, coefs[idx], col);
 		}
+		out[pix] = pack_color(color);
 	}
 }
 
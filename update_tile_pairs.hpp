@@ -0,0 +1,35 @@
+#ifndef UPDATE_TILE_PAIRS_HPP
+#define UPDATE_TILE_PAIRS_HPP
+
+#include "Constants.hpp"
+
+#include <vector>
+#include <utility>
+#include <stdint.h>
+
+class LayerOp;
+class StackOp;
+
+//Reference version of update_tile_trimmed, which keeps per-pixel coefficient
+// lists as (-1,-1U)-terminated runs of pairs. Slower; kept around for timing
+// comparisons and to check the arena-based solver against.
+
+//For these calls, out should be initialized with the desired background color.
+
+void update_tile_trimmed_pairs(
+	std::vector< std::pair< const LayerOp *, const uint32_t * > > const &layers,
+	std::vector< std::pair< const StackOp *, const uint8_t * > > const &strokes,
+	uint32_t *out,
+	unsigned int coefs_to_keep,
+	unsigned int block_size = TileSize * TileSize);
+
+template< unsigned int COUNT, unsigned int BS > 
+void update_tile_trimmed_pairs(
+	std::vector< std::pair< const LayerOp *, const uint32_t * > > const &layers,
+	std::vector< std::pair< const StackOp *, const uint8_t * > > const &strokes,
+	uint32_t *out) {
+	update_tile_trimmed_pairs(layers, strokes, out, COUNT, BS);
+}
+
+
+#endif //UPDATE_TILE_PAIRS_HPP
@@ -1,144 +1,188 @@
 #include "update_tile_sampled.hpp"
 #include "LayerOps.hpp"
 #include "StackOps.hpp"
-#include "coefs.hpp"
-#include <Vector/Vector.hpp>
-#include <tr1/unordered_map>
+#include "OrderingCache.hpp"
+#include "CompositeTree.hpp"
+#include "resolve.hpp"
+
+#include <algorithm>
+#include <cassert>
 
 using std::vector;
-using std::pair;
-using std::tr1::unordered_map;
 
-class ConstraintInfo {
+namespace {
+
+//Small LCG, so results don't depend on the platform's rand():
+class SampleRng {
 public:
-	ConstraintInfo(float _energy) : energy(_energy) { }
-	float energy; //energy (== summed opacity) for which this constraint accounts
+	SampleRng(uint32_t seed) : state(seed * 2654435761U + 1) {
+	}
+	uint32_t next() {
+		state = state * 1664525U + 1013904223U;
+		return state >> 8;
+	}
+	//uniform in [0,1):
+	float unit() {
+		return next() / float(1 << 24);
+	}
+	uint32_t state;
 };
 
-void update_tile_sampled_tile(unsigned int samples, std::vector< std::pair< const LayerOp *, const uint32_t * > > const &layers, std::vector< std::pair< const StackOp *, const uint8_t * > > const &strokes, uint32_t *out) {
-
-
-	//calculate the 'energy' == 'average alpha' of each constraint:
-	vector< ConstraintInfo > infos;
-	for (vector< pair< const StackOp *, const uint8_t * > >::const_iterator s = strokes.begin(); s != strokes.end(); ++s) {
-		float sum = 0.0f;
-		for (unsigned int i = 0; i < TileSize * TileSize; ++i) {
-			sum += s->second[i];
-		}
-		sum /= TileSize * TileSize;
-		infos.push_back(ConstraintInfo(sum / (TileSize * TileSize * 255.0f)));
-	}
-	//path says we should either take constraint (true) or not take constraint (false).
-	vector< bool > path(infos.size(), false);
-	//init path to highest-energy setting:
-	for (unsigned int i = 0; i < path.size(); ++i) {
-		//take constraint if it has more than 50% of the energy:
-		path[i] = (infos[i].energy > 0.5f);
-	}
-	vector< uint16_t > path_order(infos.size());
-	{
-		vector< pair< float, uint16_t > > path_energy(infos.size());
-		for (unsigned int i = 0; i < infos.size(); ++i) {
-			path_energy[i].first = infos[i].energy;
-			path_energy[i].second = i;
+//Fill needs[k * samples + s] with the alpha at which sample s takes stroke
+// k. Each stroke's thresholds are one jittered draw from each of 'samples'
+// equal strata, shuffled independently per stroke (a latin hypercube), so
+// every sample's thresholds are independent uniforms and P(alpha >= need)
+// is exactly alpha / 255:
+void choose_needs(unsigned int strokes, unsigned int samples, vector< uint8_t > &needs) {
+	needs.resize(strokes * samples);
+	for (unsigned int k = 0; k < strokes; ++k) {
+		SampleRng rng(k + 1);
+		uint8_t *need = &needs[k * samples];
+		for (unsigned int s = 0; s < samples; ++s) {
+			float u = (s + rng.unit()) / samples;
+			need[s] = uint8_t(std::min(254, int(u * 255.0f)) + 1);
 		}
-		sort(path_energy.begin(), path_energy.end());
-		assert(path_energy.empty() || path_energy[0].first <= path_energy.back().first);
-		for (unsigned int i = 0; i < infos.size(); ++i) {
-			path_order[i] = path_energy[i].second;
+		for (unsigned int s = samples; s > 1; --s) {
+			std::swap(need[s - 1], need[rng.next() % s]);
 		}
 	}
+}
 
-	
-	Vector< float, TileSize * TileSize > coef_sums = make_vector< float, TileSize * TileSize >(0.0f);
-	vector< Vector4f, TileSize * TileSize > final_colors = make_vector< Vector4f, TileSize * TileSize >(make_vector(0.0f, 0.0f, 0.0f, 0.0f));
-
-	for (unsigned int sample = 0; sample < samples; ++sample) {
-		//Run the current path:
-		vector< unsigned int > layer_to_order(layers.size(), -1U);
-		{ //set up default order:
-			unsigned int o = 0;
-			for (unsigned int l = 0; l < layers.size(); ++l) {
-				if (layers[l].second == NULL) {
-					/* ignore */
-				} else {
-					layer_to_order[l] = o;
-					++o;
-				}
-			}
+//Slot holding ordering 'id' in this block, adding one if it has none:
+unsigned int take_slot(SampledScratch &scratch, OrderingCache *orderings, uint32_t id) {
+	vector< uint32_t > &slot_of = scratch.slot_of;
+	if (id >= slot_of.size()) {
+		slot_of.resize(orderings->size(), -1U);
+	}
+	if (slot_of[id] == -1U) {
+		slot_of[id] = scratch.l2os.size();
+		scratch.l2os.push_back(id);
+	}
+	return slot_of[id];
+}
+
+}
+
+void update_tile_sampled(std::vector< std::pair< const LayerOp *, const uint32_t * > > const &layers, std::vector< std::pair< const StackOp *, const uint8_t * > > const &strokes, uint32_t *out, unsigned int samples, unsigned int block_size, OrderingCache *orderings, CompositeTree *composites, SampledScratch *scratch, std::vector< uint8_t > const *layer_coverage) {
+	assert((TileSize * TileSize) % block_size == 0);
+	assert(samples > 0);
+	SampledScratch local_scratch;
+	if (!scratch) {
+		scratch = &local_scratch;
+	}
+	OrderingCache local_orderings;
+	if (!orderings) {
+		orderings = &local_orderings;
+	}
+	const uint32_t starting = orderings->begin_tile(layers.size());
+	CompositeTree local_composites;
+	if (!composites) {
+		composites = &local_composites;
+	}
+	vector< uint8_t > &needs = scratch->needs;
+	vector< uint32_t > &at = scratch->at;
+	vector< uint32_t > &l2os = scratch->l2os;
+	vector< uint32_t > &slot_of = scratch->slot_of;
+	vector< uint32_t > &moved = scratch->moved;
+	vector< unsigned int > &ind_loc = scratch->ind_loc;
+	vector< bool > &reached = scratch->reached;
+	vector< unsigned int > &comp_of = scratch->comp_of;
+	vector< uint32_t const * > &comps = scratch->comps;
+	CoefArena &coefs = scratch->coefs;
+
+	choose_needs(strokes.size(), samples, needs);
+	for (unsigned int block_base = 0; block_base < TileSize * TileSize; block_base += block_size) {
+
+	//every sample starts every pixel in slot 0, the starting ordering:
+	l2os.assign(1, starting);
+	if (slot_of.size() < orderings->size()) {
+		slot_of.resize(orderings->size(), -1U);
+	}
+	slot_of[starting] = 0;
+	at.assign(samples * block_size, 0);
+
+	for (unsigned int k = 0; k < strokes.size(); ++k) {
+		const uint8_t *stroke = strokes[k].second + block_base;
+		uint8_t most = 0;
+		for (unsigned int pix = 0; pix < block_size; ++pix) {
+			most = std::max(most, stroke[pix]);
 		}
-		{ //apply the constraints along this path:
-			vector< bool >::const_iterator p = path.begin();
-			for (vector< pair< const StackOp *, const uint8_t * > >::const_iterator s = strokes.begin(); s != strokes.end(); ++s, ++p) {
-				if (*p) {
-					s->first->apply(layer_to_order.size(), &layer_to_order[0]);
+		if (most == 0) continue;
+		//slots reached by this stroke, filled in as pixels need them (slots
+		// added meanwhile are only ever destinations):
+		moved.assign(l2os.size(), -1U);
+		const uint8_t *need = &needs[k * samples];
+		for (unsigned int s = 0; s < samples; ++s) {
+			if (need[s] > most) continue;
+			uint32_t *slot = &at[s * block_size];
+			for (unsigned int pix = 0; pix < block_size; ++pix) {
+				if (stroke[pix] < need[s]) continue;
+				uint32_t &to = moved[slot[pix]];
+				if (to == -1U) {
+					uint32_t id = orderings->apply(l2os[slot[pix]], strokes[k].first);
+					to = take_slot(*scratch, orderings, id);
 				}
+				slot[pix] = to;
 			}
 		}
-		//Compute the final order after constraints applied:
-		vector< uint16_t > final_order;
-		for (unsigned int l = 0; l < layer_to_order.size(); ++l) {
-			if (layer_to_order[l] == -1U) continue;
-			while (layer_to_order[l] >= final_order.size()) {
-				final_order.push_back(uint16_t(-1U));
+	}
+
+	//each pixel's coefficients are the slots its samples reached, weighted
+	// by how many did:
+	coefs.prepare(block_size, samples * block_size);
+	ind_loc.assign(l2os.size(), -1U);
+	unsigned int used = 0;
+	for (unsigned int pix = 0; pix < block_size; ++pix) {
+		const unsigned int base = used;
+		for (unsigned int s = 0; s < samples; ++s) {
+			const uint32_t i = at[s * block_size + pix];
+			const unsigned int loc = ind_loc[i];
+			if (int(loc) < int(base)) {
+				ind_loc[i] = used;
+				coefs.weight[used] = 1.0f;
+				coefs.ind[used] = i;
+				++used;
+			} else {
+				coefs.weight[loc] += 1.0f;
 			}
-			assert(final_order[layer_to_order[l]] == uint16_t(-1U));
-			final_order[layer_to_order[l]] = l;
 		}
-
-		Vector< uint32_t, TileSize * TileSize > col;
-		//copy background color from out:
-		memcpy(colors.c, out, sizeof(uint32_t) * TileSize * TileSize);
-		//And compose the other layers:
-		for (vector< uint16_t >::const_iterator o = final_order.begin(); o != final_order.end(); ++o) {
-			layers[*o].first->compose(&(col[0]), &(layers[*o].second[0]), &(col[0]), TileSize * TileSize);
+		//(so a pixel every sample agrees on is exactly 1.0 and resolves to its composite)
+		for (unsigned int c = base; c < used; ++c) {
+			coefs.weight[c] /= samples;
 		}
+		coefs.offset[pix] = base;
+		coefs.count[pix] = used - base;
+	}
+	coefs.used = used;
 
-		Vector< float, TileSize * TileSize > coefs = make_vector< float, TileSize * TileSize >(1.0f);
-		{ //figure out how important this path was:
-			vector< bool >::const_iterator p = path.begin();
-			for (vector< pair< const StackOp *, const uint8_t * > >::const_iterator s = strokes.begin(); s != strokes.end(); ++s, ++p) {
-				if (*p) {
-					for (unsigned int i = 0; i < TileSize * TileSize; ++i) {
-						coefs[i] *= s->second[i] / 255.0f;
-					}
-				} else {
-					for (unsigned int i = 0; i < TileSize * TileSize; ++i) {
-						coefs[i] *= 1.0f - (s->second[i] / 255.0f);
-					}
-				}
-			}
+	//composite the stackings some pixel ended up in:
+	reached.assign(l2os.size(), false);
+	for (unsigned int c = 0; c < used; ++c) {
+		reached[coefs.ind[c]] = true;
+	}
+	composites->begin(layers, block_base, out + block_base, block_size, layer_coverage);
+	comp_of.assign(l2os.size(), -1U);
+	for (unsigned int i = 0; i < l2os.size(); ++i) {
+		if (!reached[i]) continue;
+		comp_of[i] = composites->add(orderings->ordering(l2os[i]));
+		++scratch->slots_used;
+	}
+	composites->composite();
+	comps.assign(l2os.size(), NULL);
+	for (unsigned int i = 0; i < l2os.size(); ++i) {
+		if (comp_of[i] != -1U) {
+			comps[i] = composites->result(comp_of[i]);
 		}
+	}
+	resolve_coefs(coefs, &comps[0], out + block_base);
+	++scratch->blocks;
 
-		//Accumulate color info:
-		for (unsigned int i = 0; i < TileSize * TileSize; ++i) {
-			final_colors[i] += coefs[i] * make_vector< float >( (col[i] >> 24) & 0xff, (col[i] >> 16) & 0xff, (col[i] >> 8) & 0xff, col[i] & 0xff);
-		}
-		//Accumulate coefs:
-		coef_sums += coefs;
-
-		//Advance to next path:
-		//TODO.
-	}
-
-	//Compute colors based on samples:
-	for (unsigned int i = 0; i < TileSize * TileSize; ++i) {
-		if (coefs_sums[i] == 0.0f) continue;
-		Vector4f color = final_colors[i] / coef_sums[i];
-		//color labels here are maybe not actually right, but whatever:
-		int a = color.c[0];
-		int b = color.c[1];
-		int g = color.c[2];
-		int r = color.c[3];
-		if (a < 0) a = 0;
-		if (a > 255) a = 255;
-		if (b < 0) b = 0;
-		if (b > 255) b = 255;
-		if (g < 0) g = 0;
-		if (g > 255) g = 255;
-		if (r < 0) r = 0;
-		if (r > 255) r = 255;
-		out[i] = (a << 24) | (b << 16) | (g << 8) | (r);
+	//leave slot_of clear for the next block:
+	for (vector< uint32_t >::const_iterator l = l2os.begin(); l != l2os.end(); ++l) {
+		slot_of[*l] = -1U;
 	}
-}
 
+	composites->end();
+
+	} //end of for(block_base)
+}
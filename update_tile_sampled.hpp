@@ -1,29 +1,74 @@
 #ifndef UPDATE_TILE_SAMPLED_HPP
 #define UPDATE_TILE_SAMPLED_HPP
 
+#include "Constants.hpp"
+#include "coef_arena.hpp"
+
 #include <vector>
 #include <utility>
 #include <stdint.h>
+#include <cstddef>
 
 class LayerOp;
 class StackOp;
+class OrderingCache;
+class CompositeTree;
+
+//Working storage for the sampled solver; like TrimmedScratch, pass the same
+// one to every call on a thread:
+class SampledScratch {
+public:
+	SampledScratch() : slots_used(0), blocks(0) { }
+	std::vector< uint8_t > needs; //[stroke * samples + sample]: alpha at which the sample takes the stroke
+	std::vector< uint32_t > at; //[sample * block_size + pixel]: slot the sample is in
+	std::vector< uint32_t > l2os; //slot -> ordering id
+	std::vector< uint32_t > slot_of; //ordering id -> slot (or -1U); all -1U between calls
+	std::vector< uint32_t > moved; //slot -> slot after the current stroke (or -1U)
+	std::vector< unsigned int > ind_loc;
+	std::vector< bool > reached; //slots some pixel ends up in
+	std::vector< unsigned int > comp_of;
+	std::vector< uint32_t const * > comps;
+	CoefArena coefs;
+	//stats:
+	uint64_t slots_used; //distinct stackings composited, over...
+	uint64_t blocks; //...this many blocks
+	float mean_slots() const {
+		return (blocks ? slots_used / float(blocks) : 0.0f);
+	}
+};
 
 //For these calls, out should be initialized with the desired background color.
 
-//per-pixel is possibly slower and likely a bit nicer:
-/* TBD
-void update_tile_sampled_pixel(
-	unsigned int samples,
+//Monte-Carlo solver: each pixel follows 'samples' stacking paths, taking
+// each stroke with probability (its alpha / 255), and ends up the average of
+// the stackings they reach. Samples draw their thresholds per stroke rather
+// than per pixel (stratified, so 'samples' draws split a stroke's
+// probability as evenly as they can), which keeps neighbouring pixels on the
+// same paths: every stacking reached anywhere in a block is composited once,
+// and pixels only average the ones they reached.
+//Cost goes with samples * strokes rather than with the number of stackings
+// alive, and the result converges on update_tile_full as samples grows.
+//Strokes that are all 0 or all 255 over a pixel are followed exactly, so
+// uniform regions come out the same as the exact solvers.
+//'orderings', 'composites', 'scratch' and 'layer_coverage' are as for
+// update_tile_trimmed.
+void update_tile_sampled(
 	std::vector< std::pair< const LayerOp *, const uint32_t * > > const &layers,
 	std::vector< std::pair< const StackOp *, const uint8_t * > > const &strokes,
-	uint32_t *out);
-	*/
-
-//Whole-tile (possibly less accurate):
-void update_tile_sampled_tile(
+	uint32_t *out,
 	unsigned int samples,
+	unsigned int block_size = TileSize * TileSize,
+	OrderingCache *orderings = NULL,
+	CompositeTree *composites = NULL,
+	SampledScratch *scratch = NULL,
+	std::vector< uint8_t > const *layer_coverage = NULL);
+
+template< unsigned int SAMPLES, unsigned int BS >
+void update_tile_sampled(
 	std::vector< std::pair< const LayerOp *, const uint32_t * > > const &layers,
 	std::vector< std::pair< const StackOp *, const uint8_t * > > const &strokes,
-	uint32_t *out);
+	uint32_t *out) {
+	update_tile_sampled(layers, strokes, out, SAMPLES, BS);
+}
 
 #endif //UPDATE_TILE_SAMPLED_HPP
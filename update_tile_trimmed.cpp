@@ -2,21 +2,18 @@
 #include "LayerOps.hpp"
 #include "StackOps.hpp"
 #include "coefs.hpp"
+#include "coef_arena.hpp"
+#include "OrderingCache.hpp"
+#include "CompositeTree.hpp"
+#include "resolve.hpp"
 
 #include <Vector/Vector.hpp>
 
 #include <memory.h>
 
+#include <algorithm>
 #include <iostream>
 
-#ifdef WIN32
-#include <unordered_map>
-using std::unordered_map;
-#else
-#include <tr1/unordered_map>
-using std::tr1::unordered_map;
-#endif
-
 using std::cerr;
 using std::endl;
 
@@ -24,21 +21,9 @@ using std::vector;
 using std::pair;
 using std::make_pair;
 
-class LayerToOrder : public vector< unsigned int > {
-public:
-	LayerToOrder() { }
-};
-
-class HashLayerToOrder {
-public:
-	size_t operator()(LayerToOrder const &o) const {
-		size_t ret = 0;
-		for (unsigned int i = 0; i < o.size(); ++i) {
-			ret ^= ( (ret << 5) | (ret >> (sizeof(size_t)*8-5)) ) ^ o[i];
-		}
-		return ret;
-	}
-};
+//Runs of coefficients this short are trimmed with a plain sort, which beats
+// nth_element's selection at that size:
+static const unsigned int TrimBySorting = 24;
 
 class GreaterCoef {
 public:
@@ -51,163 +36,340 @@ public:
 	}
 };
 
-typedef unordered_map< LayerToOrder, uint32_t , HashLayerToOrder > LayerToOrderToInd;
+//Sets scratch.keep to the layers that can still be told apart after stroke
+// 'from' - 1 (those seen in the block, or that stroke 'from' or a later one
+// depends on); returns false if that's all of them:
+static bool choose_kept(TrimmedScratch &scratch, unsigned int layer_count, unsigned int from) {
+	vector< bool > &keep = scratch.keep;
+	keep.resize(layer_count);
+	bool all = true;
+	for (unsigned int l = 0; l < layer_count; ++l) {
+		keep[l] = scratch.seen[l] || scratch.pinned[from * layer_count + l];
+		all = all && keep[l];
+	}
+	if (keep != scratch.last_keep) {
+		//collapsed ids were for the old set; forget them:
+		for (vector< uint32_t >::iterator i = scratch.projected_ids.begin(); i != scratch.projected_ids.end(); ++i) {
+			scratch.projected[*i] = -1U;
+		}
+		scratch.projected_ids.clear();
+		scratch.last_keep = keep;
+	}
+	return !all;
+}
+
+//id of the ordering that stands in for ordering 'id' under scratch.keep:
+static uint32_t collapse(TrimmedScratch &scratch, OrderingCache *orderings, uint32_t id) {
+	vector< uint32_t > &projected = scratch.projected;
+	if (id >= projected.size()) {
+		projected.resize(orderings->size(), -1U);
+	}
+	if (projected[id] == -1U) {
+		projected[id] = orderings->project(id, scratch.keep);
+		scratch.projected_ids.push_back(id);
+	}
+	return projected[id];
+}
+
+//Slot holding ordering 'id' in this block, taking a free one if it has none:
+static unsigned int take_slot(TrimmedScratch &scratch, OrderingCache *orderings, uint32_t id, unsigned int &first_free_l2o, unsigned int &first_used_l2o) {
+	vector< uint32_t > &slot_of = scratch.slot_of;
+	vector< uint32_t > &l2os = scratch.l2os;
+	vector< unsigned int > &next_l2o = scratch.next_l2o;
+	if (id >= slot_of.size()) {
+		slot_of.resize(orderings->size(), -1U);
+	}
+	if (slot_of[id] != -1U) {
+		return slot_of[id];
+	}
+	if (first_free_l2o == -1U) {
+		//allocate a new spot at the end:
+		first_free_l2o = l2os.size();
+		l2os.push_back(-1U);
+		next_l2o.push_back(-1U);
+	}
+	//Slot in l2o at first free spot:
+	unsigned int ind = first_free_l2o;
+	first_free_l2o = next_l2o[ind];
+	if (ind > 0) {
+		next_l2o[ind] = next_l2o[ind-1];
+		next_l2o[ind-1] = ind;
+	} else {
+		next_l2o[ind] = first_used_l2o;
+		first_used_l2o = ind;
+	}
+	slot_of[id] = ind;
+	l2os[ind] = id;
+	return ind;
+}
 
-void update_tile_trimmed(std::vector< std::pair< const LayerOp *, const uint32_t * > > const &layers, std::vector< std::pair< const StackOp *, const uint8_t * > > const &strokes, uint32_t *out, unsigned int coefs_to_keep, unsigned int block_size) {
+void update_tile_trimmed(std::vector< std::pair< const LayerOp *, const uint32_t * > > const &layers, std::vector< std::pair< const StackOp *, const uint8_t * > > const &strokes, uint32_t *out, unsigned int coefs_to_keep, unsigned int block_size, OrderingCache *orderings, CompositeTree *composites, TrimmedScratch *scratch, std::vector< uint8_t > const *layer_coverage, bool renormalize, float keep_energy) {
 	assert((TileSize * TileSize) % block_size == 0);
-	for (unsigned int block_base = 0; block_base + block_size <= TileSize * TileSize; block_base += block_size) {
+	update_tile_trimmed_blocks(layers, strokes, out, coefs_to_keep, block_size, 0, (TileSize * TileSize) / block_size, orderings, composites, scratch, layer_coverage, renormalize, keep_energy);
+}
 
-	LayerToOrder starting;
-	starting.resize(layers.size(), -1U);
-	//fill up starting order:
-	for (unsigned int l = 0; l < starting.size(); ++l) {
-		starting[l] = l;
+void update_tile_trimmed_blocks(std::vector< std::pair< const LayerOp *, const uint32_t * > > const &layers, std::vector< std::pair< const StackOp *, const uint8_t * > > const &strokes, uint32_t *out, unsigned int coefs_to_keep, unsigned int block_size, unsigned int first_block, unsigned int end_block, OrderingCache *orderings, CompositeTree *composites, TrimmedScratch *scratch, std::vector< uint8_t > const *layer_coverage, bool renormalize, float keep_energy) {
+	assert((TileSize * TileSize) % block_size == 0);
+	assert(first_block <= end_block && end_block * block_size <= TileSize * TileSize);
+	assert(coefs_to_keep > 0);
+	assert(keep_energy > 0.0f && keep_energy <= 1.0f);
+	//keep_energy == 1 is a plain count:
+	const bool adaptive = (keep_energy < 1.0f);
+	//scratch storage, reused across strokes and blocks -- and, if the caller
+	// passes some, across tiles:
+	TrimmedScratch local_scratch;
+	if (!scratch) {
+		scratch = &local_scratch;
+	}
+	CoefArena &coefs = scratch->coefs;
+	CoefArena &new_coefs = scratch->new_coefs;
+	vector< unsigned int > &new_inds = scratch->new_inds;
+	vector< unsigned int > &stay_inds = scratch->stay_inds;
+	vector< unsigned int > &ind_loc = scratch->ind_loc;
+	vector< pair< float, unsigned int > > &sort_scratch = scratch->sort_scratch;
+	vector< float > &lost = scratch->lost;
+	//orderings are interned (and transitions remembered) across blocks -- and,
+	// if the caller passes a cache, across tiles:
+	OrderingCache local_orderings;
+	if (!orderings) {
+		orderings = &local_orderings;
+	}
+	const uint32_t starting = orderings->begin_tile(layers.size());
+	CompositeTree local_composites;
+	if (!composites) {
+		composites = &local_composites;
+	}
+	//Every layer is in every ordering, NULL or not, so orderings mean the same
+	// thing in every block and tile; stackings that can't be told apart in a
+	// block are collapsed by moving the layers that don't matter there to the
+	// bottom. pinned[k * layer_count + l] is set if stroke k or a later one
+	// depends on where layer l sits:
+	const unsigned int layer_count = layers.size();
+	vector< bool > &pinned = scratch->pinned;
+	pinned.assign((strokes.size() + 1) * layer_count, false);
+	for (unsigned int k = strokes.size(); k > 0; --k) {
+		for (unsigned int l = 0; l < layer_count; ++l) {
+			pinned[(k - 1) * layer_count + l] = pinned[k * layer_count + l] || strokes[k - 1].first->depends_on(l);
+		}
+	}
+	vector< bool > &seen = scratch->seen;
+	//ids collapsed by earlier calls may have been flushed from 'orderings':
+	scratch->last_keep.clear();
+	//maps ordering ids -> slots in this block (or -1U); kept all -1U between blocks:
+	vector< uint32_t > &slot_of = scratch->slot_of;
+	vector< uint32_t > &l2os = scratch->l2os;
+	vector< unsigned int > &next_l2o = scratch->next_l2o;
+	vector< bool > &used = scratch->used;
+	vector< unsigned int > &comp_of = scratch->comp_of;
+	vector< uint32_t const * > &comps = scratch->comps;
+	for (unsigned int block_base = first_block * block_size; block_base < end_block * block_size; block_base += block_size) {
+
+	//which layers show up anywhere in this block:
+	seen.assign(layer_count, false);
+	for (unsigned int l = 0; l < layer_count; ++l) {
+		const uint32_t *pix = layers[l].second;
+		if (!pix) continue;
+		const uint8_t coverage = (layer_coverage ? (*layer_coverage)[l] : CoverageMixed);
+		if (coverage == CoverageEmpty) continue;
+		if (coverage == CoverageFull) {
+			seen[l] = true;
+			continue;
+		}
+		pix += block_base;
+		for (unsigned int i = 0; i < block_size; ++i) {
+			if (pix[i] & 0xff000000) {
+				seen[l] = true;
+				break;
+			}
+		}
 	}
-	//Even NULL layers included because there would be tile artifacts otherwise.
 
-	LayerToOrderToInd l2o_ind;
-	vector< LayerToOrder > l2os;
-	l2o_ind.insert(make_pair(starting, 0));
-	l2os.push_back(starting);
-	vector< unsigned int > next_l2o;
-	next_l2o.push_back(-1U);
+	//slots hold the ordering ids live in this block (-1U == free slot):
+	l2os.assign(1, starting);
+	if (slot_of.size() < orderings->size()) {
+		slot_of.resize(orderings->size(), -1U);
+	}
+	slot_of[starting] = 0;
+	next_l2o.assign(1, -1U);
 	unsigned int first_free_l2o = -1U;
 	unsigned int first_used_l2o = 0;
 
-	//coefs per pixel will kinda string out...
-	vector< pair< float, unsigned int > > coefs(block_size * 2);
-	vector< pair< float, unsigned int > > new_coefs;
-	for (unsigned int i = 0; i < block_size; ++i) {
-		coefs[2*i+0] = make_pair(1.0f, 0U);
-		coefs[2*i+1] = make_pair(-1.0f,-1U);
+	//coefs per pixel live in a pair of arenas; 'coefs' is current, 'new_coefs' is being built:
+	coefs.reset(block_size);
+	if (adaptive) {
+		lost.assign(block_size, 0.0f);
 	}
 	//We'll wrap all the asserts in tight loops:
 	#define PARANOID( X ) /* nothing; could be: assert( X ) */
 	for (vector< pair< const StackOp *, const uint8_t * > >::const_iterator s = strokes.begin(); s != strokes.end(); ++s) {
-		vector< unsigned int > new_inds(l2os.size(), -1U);
-		{ //new_inds maps from inds of stackings to inds of their mapped versions:
+		const bool collapsing = choose_kept(*scratch, layer_count, (s - strokes.begin()) + 1);
+		new_inds.assign(l2os.size(), -1U);
+		{ //new_inds maps from inds of stackings to inds of their mapped versions;
+			// stay_inds to the inds they keep where the stroke doesn't reach:
 			unsigned int size = l2os.size();
+			stay_inds.resize(size);
+			for (unsigned int i = 0; i < size; ++i) {
+				stay_inds[i] = i;
+			}
 			assert(next_l2o.size() == l2os.size());
 			assert(first_used_l2o < l2os.size()); //can't be using no orderings, right?
 			for (unsigned int i = first_used_l2o; i < size; i = next_l2o[i]) {
-				LayerToOrder l2o = l2os[i];
-				s->first->apply(l2o.size(), &l2o[0]);
-				LayerToOrderToInd::iterator f = l2o_ind.find(l2o);
-				if (f != l2o_ind.end()) {
-					new_inds[i] = f->second;
-				} else {
-					if (first_free_l2o == -1U) {
-						//allocate a new spot at the end:
-						first_free_l2o = l2os.size();
-						l2os.push_back(LayerToOrder());
-						next_l2o.push_back(-1U);
+				uint32_t id = orderings->apply(l2os[i], s->first);
+				if (collapsing) {
+					//where this stacking stays (if the stroke doesn't move it) has to be collapsed too:
+					uint32_t stay = collapse(*scratch, orderings, l2os[i]);
+					if (stay != l2os[i]) {
+						++scratch->collapsed;
+						stay_inds[i] = take_slot(*scratch, orderings, stay, first_free_l2o, first_used_l2o);
 					}
-					//Slot in l2o at first free spot:
-					unsigned int ind = first_free_l2o;
-					PARANOID(ind < l2os.size());
-					PARANOID(ind < next_l2o.size());
-					first_free_l2o = next_l2o[ind];
-					PARANOID(ind < first_free_l2o);
-					if (ind > 0) {
-						PARANOID(next_l2o[ind-1] > ind);
-						next_l2o[ind] = next_l2o[ind-1];
-						next_l2o[ind-1] = ind;
-					} else {
-						PARANOID(ind < first_used_l2o);
-						PARANOID(first_used_l2o < next_l2o.size());
-						next_l2o[ind] = first_used_l2o;
-						first_used_l2o = ind;
-					}
-					l2o_ind.insert(make_pair(l2o, ind));
-					new_inds[i] = ind;
-					l2os[ind] = l2o;
+					id = collapse(*scratch, orderings, id);
 				}
+				new_inds[i] = take_slot(*scratch, orderings, id, first_free_l2o, first_used_l2o);
 			}
 		}
-		new_coefs.clear();
+		//every old coef can turn into at most two new ones:
+		new_coefs.prepare(block_size, 2 * coefs.used);
+		float *new_weight = &new_coefs.weight[0];
+		uint32_t *new_ind = &new_coefs.ind[0];
+		unsigned int at = 0;
 		//tracks location of various inds:
-		vector< unsigned int > ind_loc(l2os.size(), -1U);
+		ind_loc.assign(l2os.size(), -1U);
 		//Fill in new_coefs by mapping coefs one-by-one:
-		unsigned int pix = block_base;
-		for (vector< pair< float, unsigned int > >::const_iterator c = coefs.begin(); c != coefs.end(); ++c) {
-			PARANOID(c->second != -1U); //No empty coef lists, darn it.
-			uint8_t alpha = s->second[pix];
-			unsigned int new_base = new_coefs.size();
+		const uint8_t *stroke = s->second + block_base;
+		for (unsigned int pix = 0; pix < block_size; ++pix) {
+			const float *weight = &coefs.weight[coefs.offset[pix]];
+			const uint32_t *ind = &coefs.ind[coefs.offset[pix]];
+			const unsigned int count = coefs.count[pix];
+			PARANOID(count > 0); //No empty coef lists, darn it.
+			uint8_t alpha = stroke[pix];
+			unsigned int new_base = at;
 			//Push in the old:
 			if (alpha != 255) {
 				float amt = 1.0f - alpha / 255.0f;
-				vector< pair< float, unsigned int > >::const_iterator c2 = c;
-				while (c2->second != -1U) {
-					pair< float, unsigned int > old = *c2;
-					old.first *= amt;
-					PARANOID(old.second < ind_loc.size());
-					ind_loc[old.second] = new_coefs.size();
-					new_coefs.push_back(old);
-					++c2;
-					PARANOID(c2 != coefs.end());
+				for (unsigned int c = 0; c < count; ++c) {
+					PARANOID(ind[c] < stay_inds.size());
+					unsigned int i = stay_inds[ind[c]];
+					unsigned int loc = ind_loc[i];
+					if (int(loc) < int(new_base)) {
+						ind_loc[i] = at;
+						new_weight[at] = weight[c] * amt;
+						new_ind[at] = i;
+						++at;
+					} else {
+						//collapsed onto a stacking already here:
+						new_weight[loc] += weight[c] * amt;
+					}
 				}
 			}
 			//Push in the new:
 			if (alpha != 0) {
-				vector< pair< float, unsigned int > >::const_iterator before = c;
 				float amt = alpha / 255.0f;
-				while (c->second != -1U) {
-					pair< float, unsigned int > old = *c;
-					old.first *= amt;
-					old.second = new_inds[old.second];
-					unsigned int loc = ind_loc[old.second];
+				for (unsigned int c = 0; c < count; ++c) {
+					float w = weight[c] * amt;
+					unsigned int i = new_inds[ind[c]];
+					unsigned int loc = ind_loc[i];
 					if (int(loc) < int(new_base)) {
-						ind_loc[old.second] = new_coefs.size();
-						new_coefs.push_back(old);
+						ind_loc[i] = at;
+						new_weight[at] = w;
+						new_ind[at] = i;
+						++at;
 					} else {
-						new_coefs[loc].first += old.first;
+						new_weight[loc] += w;
 					}
-					++c;
-					PARANOID(c != coefs.end());
 				}
-			} else {
-				while (c->second != -1U) {
-					++c;
-					PARANOID(c != coefs.end());
+			}
+			const unsigned int new_count = at - new_base;
+			//(where the stroke didn't reach, no weight changed, so there's
+			// nothing new to drop; nor once the pixel's budget is spent:)
+			bool drop_small = (adaptive && alpha != 0 && lost[pix] < 1.0f - keep_energy);
+			float total = 0.0f; //weight before trimming
+			float kept_total = 0.0f; //...and after
+			if (drop_small || (renormalize && new_count > coefs_to_keep)) {
+				float smallest = new_weight[new_base];
+				for (unsigned int i = new_base; i < at; ++i) {
+					total += new_weight[i];
+					smallest = std::min(smallest, new_weight[i]);
+				}
+				kept_total = total;
+				//(no need to sort if even the smallest can't go)
+				if (drop_small && new_count <= coefs_to_keep && lost[pix] + smallest * (1.0f - lost[pix]) / total > 1.0f - keep_energy) {
+					drop_small = false;
 				}
 			}
-			PARANOID(c->second == -1U);
-			if (new_coefs.size() > new_base + coefs_to_keep) {
+			if (new_count > coefs_to_keep || drop_small) {
 				//Need to clear ind_loc:
-				for (unsigned int i = new_base; i < new_coefs.size(); ++i) {
-					PARANOID(new_coefs[i].second < ind_loc.size());
-					ind_loc[new_coefs[i].second] = -1U;
+				sort_scratch.clear();
+				for (unsigned int i = new_base; i < at; ++i) {
+					PARANOID(new_ind[i] < ind_loc.size());
+					ind_loc[new_ind[i]] = -1U;
+					sort_scratch.push_back(make_pair(new_weight[i], new_ind[i]));
 				}
-				sort(new_coefs.begin() + new_base, new_coefs.end(), GreaterCoef());
-				while (new_coefs.size() > new_base + coefs_to_keep) {
-					PARANOID(new_coefs[new_coefs.size()-1].first <= new_coefs[new_coefs.size()-2].first); //Make sure we're trimming small coefs.
-					new_coefs.pop_back();
+				//only the biggest 'keep' need finding, and -- unless small ones
+				// are to be dropped from the end -- not their order:
+				const unsigned int keep = std::min(new_count, coefs_to_keep);
+				if (sort_scratch.size() <= TrimBySorting) {
+					sort(sort_scratch.begin(), sort_scratch.end(), GreaterCoef());
+				} else {
+					if (keep < new_count) {
+						std::nth_element(sort_scratch.begin(), sort_scratch.begin() + (keep - 1), sort_scratch.end(), GreaterCoef());
+					}
+					if (drop_small) {
+						sort(sort_scratch.begin(), sort_scratch.begin() + keep, GreaterCoef());
+					}
+				}
+				if (keep < new_count) {
+					kept_total = 0.0f;
+					for (unsigned int i = 0; i < keep; ++i) {
+						kept_total += sort_scratch[i].first;
+					}
+				}
+				for (unsigned int i = 0; i < keep; ++i) {
+					new_weight[new_base + i] = sort_scratch[i].first;
+					new_ind[new_base + i] = sort_scratch[i].second;
+				}
+				at = new_base + keep;
+			}
+			if (drop_small && total > 0.0f) {
+				//what the pixel's weight now stands for, as a fraction of its
+				// starting weight (less than 'total' if renormalizing):
+				const float scale = (1.0f - lost[pix]) / total;
+				lost[pix] += (total - kept_total) * scale;
+				//drop the smallest (from the end, since they're sorted) for as
+				// long as the loss over every stroke so far stays in budget:
+				while (at - new_base > 1) {
+					const float w = new_weight[at - 1] * scale;
+					if (lost[pix] + w > 1.0f - keep_energy) break;
+					lost[pix] += w;
+					kept_total -= new_weight[at - 1];
+					--at;
 				}
 			}
-			PARANOID(new_coefs.size() > new_base); //still have ~some~ coefs.
-			new_coefs.push_back(make_pair(-1.0f,-1U));
-			++pix;
+			if (renormalize && kept_total < total && kept_total > 0.0f) {
+				const float scale = total / kept_total;
+				for (unsigned int i = new_base; i < at; ++i) {
+					new_weight[i] *= scale;
+				}
+			}
+			PARANOID(at > new_base); //still have ~some~ coefs.
+			new_coefs.offset[pix] = new_base;
+			new_coefs.count[pix] = at - new_base;
 		}
-		//Not a tight-loop assert, so not going to PARANOID it.
-		assert(pix == block_base + block_size);
+		new_coefs.used = at;
 		coefs.swap(new_coefs);
 		{ //Trim unused l2os:
-			vector< bool > used(l2os.size(), false);
-			for (vector< pair< float, unsigned int > >::const_iterator c = coefs.begin(); c != coefs.end(); ++c) {
-				if (c->second != -1U) {
-					PARANOID(c->second < used.size());
-					used[c->second] = true;
-				}
+			used.assign(l2os.size(), false);
+			for (unsigned int c = 0; c < coefs.used; ++c) {
+				PARANOID(coefs.ind[c] < used.size());
+				used[coefs.ind[c]] = true;
 			}
 			PARANOID(next_l2o.size() == l2os.size());
 			//First advance first_used_l2o until it appears to be used:
 			while (first_used_l2o < l2os.size() && !used[first_used_l2o]) {
 				unsigned int ind = first_used_l2o;
 				{ //remove info for this:
-					LayerToOrderToInd::iterator f = l2o_ind.find(l2os[ind]);
-					PARANOID(f != l2o_ind.end());
-					l2o_ind.erase(f);
-					l2os[ind].clear();
+					PARANOID(slot_of[l2os[ind]] == ind);
+					slot_of[l2os[ind]] = -1U;
+					l2os[ind] = -1U;
 				}
 				first_used_l2o = next_l2o[first_used_l2o];
 				if (ind == 0) {
@@ -230,10 +392,9 @@ void update_tile_trimmed(std::vector< std::pair< const LayerOp *, const uint32_t
 				while (next_l2o[used_at] < l2os.size() && !used[next_l2o[used_at]]) {
 					unsigned int ind = next_l2o[used_at];
 					{ //remove info for this:
-						LayerToOrderToInd::iterator f = l2o_ind.find(l2os[ind]);
-						PARANOID(f != l2o_ind.end());
-						l2o_ind.erase(f);
-						l2os[ind].clear();
+						PARANOID(slot_of[l2os[ind]] == ind);
+						slot_of[l2os[ind]] = -1U;
+						l2os[ind] = -1U;
 					}
 
 					//Now: patch ind out of used list and into free list.
@@ -284,78 +445,33 @@ void update_tile_trimmed(std::vector< std::pair< const LayerOp *, const uint32_t
 	}
 
 	
-	//Pre-composite for all used orders:
-	vector< uint32_t * > comps(l2os.size(), NULL);
+	//Pre-composite for all used orders (sharing common bottom prefixes):
+	composites->begin(layers, block_base, out + block_base, block_size, layer_coverage);
+	comp_of.assign(l2os.size(), -1U);
 	for (unsigned int i = first_used_l2o; i < l2os.size(); i = next_l2o[i]) {
-		uint32_t *col = new uint32_t[block_size];
-		memcpy(col, out + block_base, block_size * sizeof(uint32_t));
-		comps[i] = col;
-		vector< unsigned int > order(layers.size(), -1U);
-		for (vector< unsigned int >::iterator l = l2os[i].begin(); l != l2os[i].end(); ++l) {
-			assert(*l < order.size());
-			order[*l] = l - l2os[i].begin();
-		}
-		for (vector< unsigned int >::const_iterator o = order.begin(); o != order.end(); ++o) {
-			assert(*o < layers.size());
-			//Don't composite 'NULL' of course:
-			if (layers[*o].second) {
-				layers[*o].first->compose(col, &(layers[*o].second[block_base]), col, block_size);
-			}
-		}
+		comp_of[i] = composites->add(orderings->ordering(l2os[i]));
+	}
+	composites->composite();
+	comps.assign(l2os.size(), NULL);
+	for (unsigned int i = first_used_l2o; i < l2os.size(); i = next_l2o[i]) {
+		comps[i] = composites->result(comp_of[i]);
 	}
 
 	//actually blend, per-pixel:
-	Vector4f color_acc = make_vector(0.0f, 0.0f, 0.0f, 0.0f);
-	float coef_acc = 0.0f;
-	unsigned int sum = 0;
-	unsigned int pix = 0;
-	for (vector< pair< float, unsigned int > >::const_iterator c = coefs.begin(); c != coefs.end(); ++c) {
-		if (c->second == -1U) {
-			if (coef_acc == 0.0f) {
-				cerr << "Dire circumstance: we may have trimmed almost all of the energy from a pixel (has " << sum << " remaining.)" << endl;
-			} else {
-				color_acc *= 1.0f / coef_acc;
-			
-			}
-			{ //convert to bytes:
-				int a = color_acc.c[0];
-				int b = color_acc.c[1];
-				int g = color_acc.c[2];
-				int r = color_acc.c[3];
-				if (a < 0) a = 0;
-				if (a > 255) a = 255;
-				if (b < 0) b = 0;
-				if (b > 255) b = 255;
-				if (g < 0) g = 0;
-				if (g > 255) g = 255;
-				if (r < 0) r = 0;
-				if (r > 255) r = 255;
-				out[block_base + pix] = (a << 24) | (b << 16) | (g << 8) | (r);
-			}
-
-
-			color_acc = make_vector(0.0f, 0.0f, 0.0f, 0.0f);
-			coef_acc = 0.0f;
-			sum = 0;
-			++pix;
-		} else {
-			assert(c->second < comps.size());
-			assert(comps[c->second]);
-			uint32_t src = comps[c->second][pix];
-			color_acc += c->first * make_vector< float >( (src >> 24) & 0xff, (src >> 16) & 0xff, (src >> 8) & 0xff, src & 0xff);
-			coef_acc += c->first;
-			++sum;
-		}
+	resolve_coefs(coefs, &comps[0], out + block_base);
+	for (unsigned int pix = 0; pix < block_size; ++pix) {
+		scratch->kept_coefs += coefs.count[pix];
+		scratch->max_kept = std::max(scratch->max_kept, coefs.count[pix]);
 	}
-	assert(pix == block_size);
+	scratch->kept_pixels += block_size;
 
-	//free allocated comps:
-	for (unsigned int i = 0; i < comps.size(); ++i) {
-		if (comps[i]) {
-			delete[] comps[i];
-		}
+	//leave slot_of clear for the next block:
+	for (unsigned int i = first_used_l2o; i < l2os.size(); i = next_l2o[i]) {
+		slot_of[l2os[i]] = -1U;
 	}
 
+	composites->end();
+
 	} //end of for(block_base)
 
 }
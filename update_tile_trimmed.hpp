@@ -2,22 +2,105 @@
 #define UPDATE_TILE_TRIMMED_HPP
 
 #include "Constants.hpp"
+#include "coef_arena.hpp"
 
 #include <vector>
 #include <utility>
 #include <stdint.h>
+#include <cstddef>
 
 class LayerOp;
 class StackOp;
+class OrderingCache;
+class CompositeTree;
+
+//Working storage for the trimmed solver; pass the same one to every call on
+// a thread and the solver stops allocating once it has seen a big enough tile:
+class TrimmedScratch {
+public:
+	TrimmedScratch() : collapsed(0), kept_coefs(0), kept_pixels(0), max_kept(0) { }
+	CoefArena coefs, new_coefs;
+	std::vector< unsigned int > new_inds;
+	std::vector< unsigned int > stay_inds;
+	std::vector< unsigned int > ind_loc;
+	std::vector< std::pair< float, unsigned int > > sort_scratch;
+	std::vector< float > lost; //per pixel of the block: fraction of its starting weight trimmed away so far
+	std::vector< uint32_t > slot_of; //all -1U between calls
+	std::vector< uint32_t > l2os;
+	std::vector< unsigned int > next_l2o;
+	std::vector< bool > used;
+	std::vector< unsigned int > comp_of;
+	std::vector< uint32_t const * > comps;
+	//for collapsing stackings that only differ in unseen layers:
+	std::vector< bool > pinned; //[stroke * layers + layer]: some stroke from there on depends on layer
+	std::vector< bool > seen; //layers visible in the block
+	std::vector< bool > keep, last_keep;
+	std::vector< uint32_t > projected; //ordering id -> collapsed id (or -1U)
+	std::vector< uint32_t > projected_ids; //ids set in projected
+	//stats:
+	uint64_t collapsed; //stackings folded into an equivalent one
+	uint64_t kept_coefs; //coefficients blended, over...
+	uint64_t kept_pixels; //...this many pixels
+	unsigned int max_kept; //most any one pixel was blended from
+	float mean_kept() const {
+		return (kept_pixels ? kept_coefs / float(kept_pixels) : 0.0f);
+	}
+};
 
 //For these calls, out should be initialized with the desired background color.
 
+//If 'orderings' is given, stacking orders (and the effect of strokes on them)
+// are remembered there across calls; otherwise they only persist across blocks.
+//Likewise 'composites' lends its buffer pool (and keeps stats) across calls,
+// and 'scratch' its storage.
+//'layer_coverage' (a Coverage* value per layer tile) lets compositing start
+// at the topmost opaque layer of each stacking; stackings that then look
+// the same share one composite.
+//Within a block, stackings that only differ in where layers nobody can see
+// there (NULL or clear across the block) sit -- and that no remaining stroke
+// can tell apart -- are collapsed into one, merging their coefficients
+// before trimming.
+//Pixels with more than coefs_to_keep coefficients after a stroke keep the
+// biggest ones. The dropped weight is simply lost (the final blend divides
+// by what's left) unless 'renormalize' is set, in which case the survivors
+// are scaled back up to the pixel's old total -- so weights stay
+// probabilities and can't dwindle away over a long run of strokes.
+//With keep_energy < 1, pixels drop their smallest coefficients as long as
+// the weight they've lost over all strokes so far (to the cap too) stays
+// within 1 - keep_energy of what they started with (and still keep no more
+// than coefs_to_keep), so one dominant stacking costs one coefficient and
+// near-ties get the whole budget.
 void update_tile_trimmed(
 	std::vector< std::pair< const LayerOp *, const uint32_t * > > const &layers,
 	std::vector< std::pair< const StackOp *, const uint8_t * > > const &strokes,
 	uint32_t *out,
 	unsigned int coefs_to_keep,
-	unsigned int block_size = TileSize * TileSize);
+	unsigned int block_size = TileSize * TileSize,
+	OrderingCache *orderings = NULL,
+	CompositeTree *composites = NULL,
+	TrimmedScratch *scratch = NULL,
+	std::vector< uint8_t > const *layer_coverage = NULL,
+	bool renormalize = false,
+	float keep_energy = 1.0f);
+
+//Same, but only updates blocks [first_block, end_block) of the tile (block
+// i is pixels [i * block_size, (i + 1) * block_size)); the rest of 'out' is
+// left alone. Blocks are independent, so disjoint ranges can be run on
+// different threads (each with its own caches).
+void update_tile_trimmed_blocks(
+	std::vector< std::pair< const LayerOp *, const uint32_t * > > const &layers,
+	std::vector< std::pair< const StackOp *, const uint8_t * > > const &strokes,
+	uint32_t *out,
+	unsigned int coefs_to_keep,
+	unsigned int block_size,
+	unsigned int first_block,
+	unsigned int end_block,
+	OrderingCache *orderings = NULL,
+	CompositeTree *composites = NULL,
+	TrimmedScratch *scratch = NULL,
+	std::vector< uint8_t > const *layer_coverage = NULL,
+	bool renormalize = false,
+	float keep_energy = 1.0f);
 
 template< unsigned int COUNT, unsigned int BS > 
 void update_tile_trimmed(
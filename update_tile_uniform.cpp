@@ -0,0 +1,62 @@
+#include "update_tile_uniform.hpp"
+#include "LayerOps.hpp"
+#include "StackOps.hpp"
+#include "OrderingCache.hpp"
+#include "Constants.hpp"
+
+#include <cassert>
+
+using std::vector;
+using std::pair;
+
+bool update_tile_uniform(std::vector< std::pair< const LayerOp *, const uint32_t * > > const &layers, std::vector< std::pair< const StackOp *, const uint8_t * > > const &strokes, std::vector< uint8_t > const &coverage, uint32_t *out, OrderingCache *orderings, std::vector< unsigned int > *order_scratch, std::vector< uint8_t > const *layer_coverage) {
+	assert(!layer_coverage || layer_coverage->size() == layers.size());
+	assert(coverage.size() == strokes.size());
+	for (vector< uint8_t >::const_iterator c = coverage.begin(); c != coverage.end(); ++c) {
+		if (*c == CoverageMixed) return false;
+	}
+
+	//Figure out the one stacking, applying only the full strokes:
+	LayerToOrder local_l2o;
+	LayerToOrder const *l2o = &local_l2o;
+	if (orderings) {
+		uint32_t id = orderings->begin_tile(layers.size());
+		for (unsigned int s = 0; s < strokes.size(); ++s) {
+			if (coverage[s] == CoverageFull) {
+				id = orderings->apply(id, strokes[s].first);
+			}
+		}
+		l2o = &orderings->ordering(id);
+	} else {
+		local_l2o.resize(layers.size());
+		for (unsigned int l = 0; l < local_l2o.size(); ++l) {
+			local_l2o[l] = l;
+		}
+		for (unsigned int s = 0; s < strokes.size(); ++s) {
+			if (coverage[s] == CoverageFull) {
+				strokes[s].first->apply(local_l2o.size(), &local_l2o[0]);
+			}
+		}
+	}
+
+	vector< unsigned int > local_order;
+	vector< unsigned int > &order = (order_scratch ? *order_scratch : local_order);
+	order.assign(layers.size(), -1U);
+	for (LayerToOrder::const_iterator l = l2o->begin(); l != l2o->end(); ++l) {
+		assert(*l < order.size());
+		order[*l] = l - l2o->begin();
+	}
+	//start at the topmost layer that hides everything under it:
+	unsigned int first = 0;
+	if (layer_coverage) {
+		for (unsigned int o = 0; o < order.size(); ++o) {
+			if (LayerOp::hides_below(layers[order[o]], (*layer_coverage)[order[o]])) {
+				first = o;
+			}
+		}
+	}
+	if (first < order.size()) {
+		LayerOp::compose_stack(&order[first], order.size() - first, layers, 0, out);
+	}
+	return true;
+}
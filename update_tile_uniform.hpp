@@ -0,0 +1,31 @@
+#ifndef UPDATE_TILE_UNIFORM_HPP
+#define UPDATE_TILE_UNIFORM_HPP
+
+#include <vector>
+#include <utility>
+#include <stdint.h>
+#include <cstddef>
+
+class LayerOp;
+class StackOp;
+class OrderingCache;
+
+//out should be initialized with the desired background color.
+
+//Fast path for tiles where every stroke is uniformly 0 or 255 (according to
+// coverage, which holds a Coverage* value per stroke). Such a tile has a
+// single stacking, which is composited straight into out.
+//Returns false (leaving out alone) if any stroke is mixed.
+//'order_scratch', if given, holds the composite order (so repeated calls
+// needn't allocate). With 'layer_coverage' (a Coverage* value per layer),
+// layers under an opaque one aren't composited.
+bool update_tile_uniform(
+	std::vector< std::pair< const LayerOp *, const uint32_t * > > const &layers,
+	std::vector< std::pair< const StackOp *, const uint8_t * > > const &strokes,
+	std::vector< uint8_t > const &coverage,
+	uint32_t *out,
+	OrderingCache *orderings = NULL,
+	std::vector< unsigned int > *order_scratch = NULL,
+	std::vector< uint8_t > const *layer_coverage = NULL);
+
+#endif //UPDATE_TILE_UNIFORM_HPP